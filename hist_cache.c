@@ -0,0 +1,632 @@
+/*
+ * libmcabberhist - cache of parsed and sorted entry tables
+ * Copyright (C) 2016 Benjamin Abendroth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "mcabberhist.h"
+
+/*
+ * A cache file holds the entries of one input file as read with one
+ * set of type filters through a transparent or the gzip backend,
+ * sorted:
+ *
+ *   header, n_entries records, bodies, absolute path of the input
+ *
+ * It is named by a hash of the key and the filters and only used if
+ * the key stored in its header matches. Numbers are in native byte
+ * order, the cache is local to a machine.
+ *
+ * The first store into a cache directory evicts the files of inputs
+ * that changed or are gone, then the least recently used ones until the
+ * cache fits into its size bound. Later stores count what they add and
+ * evict again whenever the bound is exceeded. Loading a file marks it
+ * used.
+ */
+
+#define HIST_CACHE_MAGIC "MHTAB03\n"
+#define HIST_CACHE_MAGIC_LEN 8
+
+// Temporary files of stores older than this many seconds were left
+// behind by killed runs
+#define HIST_CACHE_STALE_TEMP (24 * 3600)
+
+/*
+ * Header of a cache file
+ */
+struct hist_cache_header
+{
+   char magic[HIST_CACHE_MAGIC_LEN];
+   struct hist_cache_key key;
+
+   // Hash of the type filters and the kind of backend the entries were
+   // read with
+   uint64_t filter;
+
+   uint64_t n_entries;
+   uint64_t body_size;
+
+   // Malformed records of the input, whether it is an archive and
+   // whether its entries were in order already
+   uint32_t n_malformed;
+   uint32_t archive;
+   uint32_t in_order;
+
+   // Length of the path of the input behind the bodies
+   uint32_t path_len;
+};
+
+/*
+ * Entry of a cache file, its body is at body_offset behind the records
+ */
+struct hist_cache_record
+{
+   char type[3];
+   char timestamp[19];
+   char follow_lines[4];
+   uint32_t passthrough;
+   uint64_t body_offset;
+   uint64_t body_len;
+};
+
+/*
+ * File of the cache directory while evicting
+ */
+struct hist_cache_file
+{
+   char *path;
+   uint64_t size;
+   struct timespec used;
+};
+
+/*
+ * Cache directory stored into, with the bytes it is known to hold
+ */
+struct hist_cache_dir
+{
+   char *dir;
+   uint64_t size;
+   struct hist_cache_dir *next;
+};
+
+// Cache directories of this process, in use by all threads
+static struct hist_cache_dir *cache_dirs;
+static pthread_mutex_t cache_dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Continue an FNV-1a hash over len bytes of data
+ */
+static uint64_t hash_bytes
+ (
+   uint64_t hash,
+   const void *data,
+   size_t len
+ )
+{
+   for (size_t i = 0; i < len; ++i) {
+      hash ^= ((const unsigned char *) data)[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return hash;
+}
+
+/*
+ * Hash the type filters of opts, NULL and empty lists differ, and
+ * whether the backend decompresses: gzip reads other entries from the
+ * same file than the transparent backends.
+ */
+static uint64_t hash_filter
+ (
+   const struct hist_options *opts
+ )
+{
+   uint64_t hash = 14695981039346656037ULL;
+   const char *lists[2] = { opts->types, opts->drop_types };
+
+   for (int i = 0; i < 2; ++i) {
+      if (lists[i])
+         hash = hash_bytes(hash, lists[i], strlen(lists[i]) + 1);
+      else
+         hash = hash_bytes(hash, "\xff", 1);
+   }
+
+   return hash_bytes(hash, hist_io_transparent() ? "t" : "z", 1);
+}
+
+/*
+ * Build the path of the cache file of key read with the filters of
+ * opts in dir.
+ * Returns the path (to be freed) or NULL if failed.
+ */
+static char* cache_path
+ (
+   const char *dir,
+   const struct hist_cache_key *key,
+   const struct hist_options *opts
+ )
+{
+   uint64_t hash = hash_bytes(hash_filter(opts), key, sizeof(*key));
+   char *path = malloc(strlen(dir) + 1 + 16 + 1);
+
+   if (! path) {
+      perror("malloc");
+      return NULL;
+   }
+
+   sprintf(path, "%s/%016llx", dir, (unsigned long long) hash);
+   return path;
+}
+
+/*
+ * Get the cache key of the regular file at path: device, inode, size,
+ * modification and change time.
+ * Returns 1 on success or 0 if path can not be cached.
+ */
+int hist_cache_key
+ (
+   const char *path,
+   struct hist_cache_key *key
+ )
+{
+   struct stat statbuf;
+
+   if (! strcmp(path, "-") || stat(path, &statbuf) == -1 || ! S_ISREG(statbuf.st_mode))
+      return 0;
+
+   memset(key, 0, sizeof(*key));
+   key->dev = statbuf.st_dev;
+   key->ino = statbuf.st_ino;
+   key->size = statbuf.st_size;
+   key->mtime_sec = statbuf.st_mtim.tv_sec;
+   key->mtime_nsec = statbuf.st_mtim.tv_nsec;
+   key->ctime_sec = statbuf.st_ctim.tv_sec;
+   key->ctime_nsec = statbuf.st_ctim.tv_nsec;
+   return 1;
+}
+
+/*
+ * Turn the records of a mapped cache file into entries, long bodies
+ * are interned in pool.
+ * Returns the entries or NULL if the file is damaged or on error.
+ */
+static struct hist_entry** load_entries
+ (
+   const char *data,
+   size_t size,
+   struct hist_pool *pool
+ )
+{
+   const struct hist_cache_header *header = (const void *) data;
+   const struct hist_cache_record *records = (const void *) (data + sizeof(*header));
+   const char *bodies;
+   struct hist_entry **entries;
+   uint64_t n = header->n_entries;
+
+   if (header->path_len > size - sizeof(*header) ||
+         n > (size - sizeof(*header) - header->path_len) / sizeof(*records) ||
+         header->body_size != size - sizeof(*header) - n * sizeof(*records) - header->path_len)
+      return NULL;
+   bodies = (const char *) (records + n);
+
+   // an empty table is not an error
+   if (! (entries = malloc((n ? n : 1) * sizeof(struct hist_entry *)))) {
+      perror("malloc");
+      return NULL;
+   }
+
+   for (uint64_t i = 0; i < n; ++i) {
+      const struct hist_cache_record *record = &records[i];
+      struct hist_entry *entry;
+
+      if (record->body_offset > header->body_size ||
+            record->body_len > header->body_size - record->body_offset ||
+            ! (entry = calloc(1, sizeof(struct hist_entry)))) {
+         free_hist_entries(entries, i);
+         return NULL;
+      }
+      entries[i] = entry;
+
+      memcpy(entry->type, record->type, sizeof(entry->type) - 1);
+      memcpy(entry->timestamp, record->timestamp, sizeof(entry->timestamp) - 1);
+      memcpy(entry->follow_lines, record->follow_lines, sizeof(entry->follow_lines) - 1);
+      entry->passthrough = record->passthrough;
+      entry->body_len = record->body_len;
+
+      if (entry->body_len <= HIST_INLINE_BODY) {
+         memcpy(entry->inline_body, bodies + record->body_offset, entry->body_len);
+      }
+      else if (! (entry->body = hist_pool_intern(pool, bodies + record->body_offset,
+                                                 entry->body_len))) {
+         free_hist_entries(entries, i + 1);
+         return NULL;
+      }
+   }
+
+   return entries;
+}
+
+/*
+ * Load the entries of the file with key, read with the type filters of
+ * opts, from the cache in dir. They are sorted like read_hist() sorts
+ * them, long bodies are interned in pool.
+ * Returns the entries or NULL if not cached.
+ */
+struct hist_entry** hist_cache_load
+ (
+   const char *dir,
+   const struct hist_cache_key *key,
+   const struct hist_options *opts,
+   struct hist_pool *pool,
+   int *n_entries,
+   int *archive,
+   int *n_malformed,
+   int *in_order
+ )
+{
+   char *path = cache_path(dir, key, opts);
+   const struct hist_cache_header *header;
+   struct hist_entry **entries = NULL;
+   struct stat statbuf;
+   void *data;
+   int fd;
+
+   if (! path)
+      return NULL;
+
+   fd = open(path, O_RDONLY);
+   free(path);
+   if (fd == -1)
+      return NULL;
+
+   if (fstat(fd, &statbuf) == -1 || statbuf.st_size < sizeof(*header) ||
+         (data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+      close(fd);
+      return NULL;
+   }
+
+   header = data;
+   if (! memcmp(header->magic, HIST_CACHE_MAGIC, HIST_CACHE_MAGIC_LEN) &&
+         ! memcmp(&header->key, key, sizeof(*key)) && header->filter == hash_filter(opts) &&
+         header->n_entries <= INT_MAX &&
+         (entries = load_entries(data, statbuf.st_size, pool))) {
+      *n_entries = header->n_entries;
+      *archive = header->archive;
+      *n_malformed = header->n_malformed;
+      *in_order = header->in_order;
+
+      // used now, whatever atime the filesystem keeps
+      const struct timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+      futimens(fd, times);
+   }
+
+   munmap(data, statbuf.st_size);
+   close(fd);
+   return entries;
+}
+
+/*
+ * Check whether the cache file at path is still of use: written by
+ * this version for an input that is unchanged since.
+ * Returns 1 if so, 0 if it can be deleted.
+ */
+static int cache_file_valid
+ (
+   const char *path,
+   const struct stat *statbuf
+ )
+{
+   struct hist_cache_header header;
+   struct hist_cache_key key;
+   char *source;
+   int fd, valid = 0;
+
+   if ((fd = open(path, O_RDONLY)) == -1)
+      return 0;
+
+   if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+         ! memcmp(header.magic, HIST_CACHE_MAGIC, HIST_CACHE_MAGIC_LEN) &&
+         header.path_len && header.path_len <= statbuf->st_size - sizeof(header) &&
+         (source = malloc(header.path_len + 1))) {
+      if (pread(fd, source, header.path_len, statbuf->st_size - header.path_len) ==
+            header.path_len) {
+         source[header.path_len] = '\0';
+         valid = hist_cache_key(source, &key) && ! memcmp(&key, &header.key, sizeof(key));
+      }
+      free(source);
+   }
+
+   close(fd);
+   return valid;
+}
+
+/*
+ * Order cache files from the least to the most recently used
+ */
+static int cmp_cache_file
+ (
+   const void *a,
+   const void *b
+ )
+{
+   const struct hist_cache_file *file_a = a, *file_b = b;
+
+   if (file_a->used.tv_sec != file_b->used.tv_sec)
+      return file_a->used.tv_sec < file_b->used.tv_sec ? -1 : 1;
+   if (file_a->used.tv_nsec != file_b->used.tv_nsec)
+      return file_a->used.tv_nsec < file_b->used.tv_nsec ? -1 : 1;
+   return 0;
+}
+
+/*
+ * Delete the files of the cache in dir whose input changed or is gone
+ * and temporary files of killed runs, then the least recently used
+ * files until the rest take at most max_size bytes (0 for no bound).
+ * Failing to delete is no error, the cache is only an optimization.
+ * Returns the bytes the cache files left take.
+ */
+static uint64_t evict
+ (
+   const char *dir,
+   uint64_t max_size
+ )
+{
+   struct hist_cache_file *files = NULL, *grown;
+   size_t n_files = 0, size_files = 0;
+   uint64_t total = 0;
+   struct dirent *dirent;
+   struct stat statbuf;
+   time_t now = time(NULL);
+   char *path;
+   DIR *dh;
+
+   if (! (dh = opendir(dir)))
+      return 0;
+
+   while ((dirent = readdir(dh))) {
+      if (! strcmp(dirent->d_name, ".") || ! strcmp(dirent->d_name, ".."))
+         continue;
+
+      if (! (path = malloc(strlen(dir) + 1 + strlen(dirent->d_name) + 1))) {
+         perror("malloc");
+         break;
+      }
+      sprintf(path, "%s/%s", dir, dirent->d_name);
+
+      if (lstat(path, &statbuf) == -1 || ! S_ISREG(statbuf.st_mode)) {
+         free(path);
+         continue;
+      }
+
+      // being written by another run unless old
+      if (! strncmp(dirent->d_name, ".tmp.", 5)) {
+         if (statbuf.st_mtime < now - HIST_CACHE_STALE_TEMP)
+            unlink(path);
+         free(path);
+         continue;
+      }
+
+      if (! cache_file_valid(path, &statbuf)) {
+         unlink(path);
+         free(path);
+         continue;
+      }
+
+      if (n_files == size_files) {
+         size_files = size_files ? 2 * size_files : 64;
+         if (! (grown = realloc(files, size_files * sizeof(*files)))) {
+            perror("realloc");
+            free(path);
+            break;
+         }
+         files = grown;
+      }
+
+      files[n_files].path = path;
+      files[n_files].size = statbuf.st_size;
+      files[n_files].used = statbuf.st_atim;
+      total += statbuf.st_size;
+      ++n_files;
+   }
+   closedir(dh);
+
+   qsort(files, n_files, sizeof(*files), cmp_cache_file);
+
+   for (size_t i = 0; i < n_files; ++i) {
+      if (max_size && total > max_size && unlink(files[i].path) != -1)
+         total -= files[i].size;
+      free(files[i].path);
+   }
+
+   free(files);
+   return total;
+}
+
+/*
+ * Count size bytes added to the cache in dir and evict if it exceeds
+ * max_size. The first call for a directory evicts in any case and
+ * takes over the size found.
+ */
+static void account
+ (
+   const char *dir,
+   uint64_t size,
+   uint64_t max_size
+ )
+{
+   struct hist_cache_dir *cache_dir;
+
+   pthread_mutex_lock(&cache_dirs_lock);
+
+   for (cache_dir = cache_dirs; cache_dir; cache_dir = cache_dir->next)
+      if (! strcmp(cache_dir->dir, dir))
+         break;
+
+   if (! cache_dir) {
+      if ((cache_dir = calloc(1, sizeof(*cache_dir))) && (cache_dir->dir = strdup(dir))) {
+         cache_dir->size = evict(dir, max_size);
+         cache_dir->next = cache_dirs;
+         cache_dirs = cache_dir;
+      }
+      else {
+         perror("malloc");
+         free(cache_dir);
+      }
+   }
+   else if ((cache_dir->size += size) > max_size && max_size) {
+      // other processes may have added or deleted files meanwhile
+      cache_dir->size = evict(dir, max_size);
+   }
+
+   pthread_mutex_unlock(&cache_dirs_lock);
+}
+
+/*
+ * Store the sorted entries of the file at path with key, read with the
+ * type filters of opts, in the cache in dir, creating it if missing.
+ * Nothing is stored if the file has changed since key was taken.
+ * Returns 1 on success, 0 on failure.
+ */
+int hist_cache_store
+ (
+   const char *dir,
+   const char *path,
+   const struct hist_cache_key *key,
+   const struct hist_options *opts,
+   struct hist_entry **entries,
+   int n_entries,
+   int archive,
+   int n_malformed,
+   int in_order
+ )
+{
+   struct hist_cache_header header;
+   struct hist_cache_record record;
+   struct hist_cache_key now;
+   char *cache_file, *temp, *source;
+   FILE *cache_fh;
+   int fd, status = 1;
+
+   // read while being written, the next run caches it
+   if (! hist_cache_key(path, &now) || memcmp(&now, key, sizeof(now)))
+      return 1;
+
+   if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+      perror(dir);
+      return 0;
+   }
+
+   // eviction finds the input by it
+   if (! (source = realpath(path, NULL))) {
+      perror(path);
+      return 0;
+   }
+
+   if (! (cache_file = cache_path(dir, key, opts))) {
+      free(source);
+      return 0;
+   }
+
+   if (! (temp = malloc(strlen(dir) + sizeof("/.tmp.XXXXXX")))) {
+      perror("malloc");
+      free(cache_file);
+      free(source);
+      return 0;
+   }
+   sprintf(temp, "%s/.tmp.XXXXXX", dir);
+
+   if ((fd = mkstemp(temp)) == -1 || ! (cache_fh = fdopen(fd, "w"))) {
+      perror(temp);
+      if (fd != -1) {
+         close(fd);
+         unlink(temp);
+      }
+      free(temp);
+      free(cache_file);
+      free(source);
+      return 0;
+   }
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, HIST_CACHE_MAGIC, HIST_CACHE_MAGIC_LEN);
+   header.key = *key;
+   header.filter = hash_filter(opts);
+   header.n_entries = n_entries;
+   header.n_malformed = n_malformed;
+   header.archive = archive;
+   header.in_order = in_order;
+   header.path_len = strlen(source);
+   for (int i = 0; i < n_entries; ++i)
+      header.body_size += entries[i]->body_len;
+
+   status = fwrite(&header, sizeof(header), 1, cache_fh) == 1;
+
+   uint64_t body_offset = 0;
+   for (int i = 0; status && i < n_entries; ++i) {
+      memset(&record, 0, sizeof(record));
+      memcpy(record.type, entries[i]->type, sizeof(record.type));
+      memcpy(record.timestamp, entries[i]->timestamp, sizeof(record.timestamp));
+      memcpy(record.follow_lines, entries[i]->follow_lines, sizeof(record.follow_lines));
+      record.passthrough = entries[i]->passthrough;
+      record.body_offset = body_offset;
+      record.body_len = entries[i]->body_len;
+      body_offset += record.body_len;
+
+      status = fwrite(&record, sizeof(record), 1, cache_fh) == 1;
+   }
+
+   for (int i = 0; status && i < n_entries; ++i)
+      status = fwrite(hist_entry_body(entries[i]), 1, entries[i]->body_len, cache_fh) ==
+               entries[i]->body_len;
+
+   if (status)
+      status = fwrite(source, 1, header.path_len, cache_fh) == header.path_len;
+
+   status &= fclose(cache_fh) != EOF;
+
+   // readers see the whole file or none
+   if (status && rename(temp, cache_file) == -1)
+      status = 0;
+
+   if (! status) {
+      perror(cache_file);
+      unlink(temp);
+   }
+   else {
+      account(dir, sizeof(header) + n_entries * sizeof(record) + header.body_size +
+              header.path_len, opts->cache_size);
+   }
+
+   free(temp);
+   free(cache_file);
+   free(source);
+   return status;
+}
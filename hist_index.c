@@ -0,0 +1,980 @@
+/*
+ * libmcabberhist - full-text index over history files
+ * Copyright (C) 2016 Benjamin Abendroth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "mcabberhist.h"
+
+/*
+ * Index file layout, all integers little endian:
+ *
+ *   magic, n_files (u64), files_off (u64), n_terms (u64), terms_off (u64)
+ *   at files_off:  per file path_len (u32), path, size (u64), mtime (u64)
+ *   at terms_off:  n_terms offsets (u64) of term records, sorted by term
+ *   term record:   term_len (u32), term, n_postings (u32), postings
+ *   posting:       file (u32), offset (u64), timestamp key (u64)
+ *
+ * Postings of a term are sorted by file and offset.
+ */
+#define HIST_INDEX_MAGIC "MHIDX01\n"
+#define HIST_INDEX_MAGIC_LEN 8
+#define HIST_INDEX_HEADER_LEN (HIST_INDEX_MAGIC_LEN + 4 * 8)
+#define HIST_INDEX_POSTING_LEN (4 + 8 + 8)
+
+// Terms are runs of letters and digits of this length
+#define HIST_INDEX_MIN_TERM 2
+#define HIST_INDEX_MAX_TERM 64
+
+struct hist_index_posting
+{
+   uint32_t file;
+   uint64_t offset;
+   uint64_t key;
+};
+
+struct hist_index_term
+{
+   char *term;
+   size_t term_len;
+
+   struct hist_index_posting *postings;
+   size_t n_postings;
+   size_t size;
+};
+
+struct hist_index_file
+{
+   char *path;
+   uint64_t size;
+   uint64_t mtime;
+
+   // Replaced by a newer version, postings are dropped on save
+   int removed;
+};
+
+/*
+ * Inverted index of history files, held in memory while updating
+ */
+struct hist_index
+{
+   char *path;
+
+   struct hist_index_file *files;
+   uint32_t n_files;
+
+   // Open addressing hash table of terms, size is a power of two
+   struct hist_index_term **slots;
+   size_t size;
+   size_t used;
+};
+
+/*
+ * Read a little endian integer of len bytes
+ */
+static uint64_t get_le
+ (
+   const unsigned char *pos,
+   int len
+ )
+{
+   uint64_t value = 0;
+
+   for (int i = len - 1; i >= 0; --i)
+      value = (value << 8) | pos[i];
+
+   return value;
+}
+
+/*
+ * Write a little endian integer of len bytes
+ */
+static int put_le
+ (
+   FILE *out_stream,
+   uint64_t value,
+   int len
+ )
+{
+   unsigned char buf[8];
+
+   for (int i = 0; i < len; ++i, value >>= 8)
+      buf[i] = value & 0xff;
+
+   return fwrite(buf, 1, len, out_stream) == (size_t) len;
+}
+
+/*
+ * Hash function for terms (FNV-1a)
+ */
+static uint64_t hash_term
+ (
+   const char *term,
+   size_t len
+ )
+{
+   uint64_t hash = 14695981039346656037ULL;
+
+   for (size_t i = 0; i < len; ++i) {
+      hash ^= (unsigned char) term[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return hash;
+}
+
+/*
+ * Check if c belongs to a term. Bytes of multibyte characters do, so
+ * non-ASCII words are indexed as they are.
+ */
+static int is_term_char
+ (
+   unsigned char c
+ )
+{
+   return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+          (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+/*
+ * Find the next term in text starting at *pos, lowercased into term.
+ * Returns the length of the term or 0 if there is none left.
+ */
+static size_t next_term
+ (
+   const char *text,
+   size_t len,
+   size_t *pos,
+   char *term
+ )
+{
+   while (*pos < len) {
+      size_t term_len = 0;
+
+      while (*pos < len && ! is_term_char(text[*pos]))
+         ++*pos;
+
+      for (; *pos < len && is_term_char(text[*pos]); ++*pos) {
+         char c = text[*pos];
+
+         if (term_len < HIST_INDEX_MAX_TERM)
+            term[term_len] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+         ++term_len;
+      }
+
+      // overlong runs (urls, base64) are not worth indexing
+      if (term_len >= HIST_INDEX_MIN_TERM && term_len <= HIST_INDEX_MAX_TERM)
+         return term_len;
+   }
+
+   return 0;
+}
+
+/*
+ * Find the slot of term in the hash table of index.
+ */
+static struct hist_index_term** find_term
+ (
+   struct hist_index *index,
+   const char *term,
+   size_t len
+ )
+{
+   size_t i = hash_term(term, len) & (index->size - 1);
+
+   for (; index->slots[i]; i = (i + 1) & (index->size - 1))
+      if (index->slots[i]->term_len == len && ! memcmp(index->slots[i]->term, term, len))
+         break;
+
+   return &index->slots[i];
+}
+
+/*
+ * Double the hash table of index.
+ * Returns 1 on success or 0 on error.
+ */
+static int grow_terms
+ (
+   struct hist_index *index
+ )
+{
+   size_t size = index->size * 2;
+   struct hist_index_term **slots = calloc(size, sizeof(struct hist_index_term *));
+   if (! slots) {
+      perror("calloc");
+      return 0;
+   }
+
+   for (size_t i = 0; i < index->size; ++i) {
+      struct hist_index_term *term = index->slots[i];
+      if (! term)
+         continue;
+
+      size_t j = hash_term(term->term, term->term_len) & (size - 1);
+      while (slots[j])
+         j = (j + 1) & (size - 1);
+      slots[j] = term;
+   }
+
+   free(index->slots);
+   index->slots = slots;
+   index->size = size;
+   return 1;
+}
+
+/*
+ * Add a posting to term, creating the term if needed. Postings of the
+ * same entry are only added once.
+ * Returns 1 on success or 0 on error.
+ */
+static int add_posting
+ (
+   struct hist_index *index,
+   const char *word,
+   size_t len,
+   const struct hist_index_posting *posting
+ )
+{
+   struct hist_index_term **slot = find_term(index, word, len);
+   struct hist_index_term *term = *slot;
+
+   if (! term) {
+      // keep the table at most half full
+      if (2 * (index->used + 1) > index->size) {
+         if (! grow_terms(index))
+            return 0;
+         slot = find_term(index, word, len);
+      }
+
+      if (! (term = calloc(1, sizeof(struct hist_index_term))) ||
+          ! (term->term = malloc(len))) {
+         perror("malloc");
+         free(term);
+         return 0;
+      }
+
+      memcpy(term->term, word, len);
+      term->term_len = len;
+      *slot = term;
+      ++index->used;
+   }
+
+   if (term->n_postings) {
+      struct hist_index_posting *last = &term->postings[term->n_postings - 1];
+      if (last->file == posting->file && last->offset == posting->offset)
+         return 1;
+   }
+
+   if (term->n_postings == term->size) {
+      size_t size = term->size ? 2 * term->size : 4;
+      struct hist_index_posting *postings = realloc(term->postings, size * sizeof(*postings));
+      if (! postings) {
+         perror("realloc");
+         return 0;
+      }
+      term->postings = postings;
+      term->size = size;
+   }
+
+   term->postings[term->n_postings++] = *posting;
+   return 1;
+}
+
+/*
+ * Add a file to the list of indexed files.
+ * Returns its number or -1 on error.
+ */
+static long add_file
+ (
+   struct hist_index *index,
+   const char *path,
+   uint64_t size,
+   uint64_t mtime
+ )
+{
+   struct hist_index_file *files = realloc(index->files,
+      (index->n_files + 1) * sizeof(struct hist_index_file));
+   if (! files) {
+      perror("realloc");
+      return -1;
+   }
+   index->files = files;
+
+   struct hist_index_file *file = &files[index->n_files];
+   if (! (file->path = strdup(path))) {
+      perror("strdup");
+      return -1;
+   }
+   file->size = size;
+   file->mtime = mtime;
+   file->removed = 0;
+
+   return index->n_files++;
+}
+
+/*
+ * Map a whole file into memory. *data is NULL if the file does not
+ * exist or is empty.
+ * Returns 1 on success or 0 on error.
+ */
+static int map_file
+ (
+   const char *path,
+   unsigned char **data,
+   size_t *size
+ )
+{
+   struct stat statbuf;
+   int fd;
+
+   *data = NULL;
+   *size = 0;
+
+   if ((fd = open(path, O_RDONLY)) == -1) {
+      if (errno == ENOENT)
+         return 1;
+      perror(path);
+      return 0;
+   }
+
+   if (fstat(fd, &statbuf) == -1) {
+      perror(path);
+      close(fd);
+      return 0;
+   }
+
+   if (! statbuf.st_size) {
+      close(fd);
+      return 1;
+   }
+
+   *data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+
+   if (*data == MAP_FAILED) {
+      perror(path);
+      *data = NULL;
+      return 0;
+   }
+
+   *size = statbuf.st_size;
+   return 1;
+}
+
+/*
+ * Check the header of a mapped index.
+ * Returns 1 if it is usable, 0 if not.
+ */
+static int check_index
+ (
+   const unsigned char *data,
+   size_t size
+ )
+{
+   if (size < HIST_INDEX_HEADER_LEN || memcmp(data, HIST_INDEX_MAGIC, HIST_INDEX_MAGIC_LEN))
+      return 0;
+
+   uint64_t files_off = get_le(data + HIST_INDEX_MAGIC_LEN + 8, 8);
+   uint64_t n_terms = get_le(data + HIST_INDEX_MAGIC_LEN + 16, 8);
+   uint64_t terms_off = get_le(data + HIST_INDEX_MAGIC_LEN + 24, 8);
+
+   return files_off <= size && terms_off <= size && n_terms <= (size - terms_off) / 8;
+}
+
+/*
+ * Parse the term record at offset of a mapped index.
+ * Returns a pointer to the first posting or NULL if the record is
+ * corrupt.
+ */
+static const unsigned char* parse_term
+ (
+   const unsigned char *data,
+   size_t size,
+   uint64_t offset,
+   const char **term,
+   uint32_t *term_len,
+   uint32_t *n_postings
+ )
+{
+   if (offset > size || size - offset < 4)
+      return NULL;
+
+   *term_len = get_le(data + offset, 4);
+   offset += 4;
+
+   if (size - offset < (uint64_t) *term_len + 4)
+      return NULL;
+
+   *term = (const char *) data + offset;
+   offset += *term_len;
+   *n_postings = get_le(data + offset, 4);
+   offset += 4;
+
+   if ((size - offset) / HIST_INDEX_POSTING_LEN < *n_postings)
+      return NULL;
+
+   return data + offset;
+}
+
+/*
+ * Load the index stored at path, or create an empty one if there is
+ * no such file.
+ * Returns pointer to hist_index or NULL if failed.
+ */
+struct hist_index* hist_index_load
+ (
+   const char *path
+ )
+{
+   struct hist_index *index = calloc(1, sizeof(struct hist_index));
+   unsigned char *data;
+   size_t size;
+
+   if (! index || ! (index->path = strdup(path))) {
+      perror("malloc");
+      free(index);
+      return NULL;
+   }
+
+   index->size = 1024;
+   if (! (index->slots = calloc(index->size, sizeof(struct hist_index_term *)))) {
+      perror("calloc");
+      hist_index_free(index);
+      return NULL;
+   }
+
+   if (! map_file(path, &data, &size)) {
+      hist_index_free(index);
+      return NULL;
+   }
+
+   if (! data)
+      return index;
+
+   int status = check_index(data, size);
+   uint64_t n_files = status ? get_le(data + HIST_INDEX_MAGIC_LEN, 8) : 0;
+   uint64_t pos = status ? get_le(data + HIST_INDEX_MAGIC_LEN + 8, 8) : 0;
+   uint64_t n_terms = status ? get_le(data + HIST_INDEX_MAGIC_LEN + 16, 8) : 0;
+   uint64_t terms_off = status ? get_le(data + HIST_INDEX_MAGIC_LEN + 24, 8) : 0;
+
+   for (uint64_t i = 0; status && i < n_files; ++i) {
+      uint32_t path_len;
+
+      if (size - pos < 4 || size - pos - 4 < (path_len = get_le(data + pos, 4)) + 16ULL) {
+         status = 0;
+         break;
+      }
+
+      char *file_path = strndup((const char *) data + pos + 4, path_len);
+      pos += 4 + path_len;
+
+      status = file_path && add_file(index, file_path,
+         get_le(data + pos, 8), get_le(data + pos + 8, 8)) != -1;
+      pos += 16;
+      free(file_path);
+   }
+
+   for (uint64_t i = 0; status && i < n_terms; ++i) {
+      const char *term;
+      uint32_t term_len, n_postings;
+      const unsigned char *postings = parse_term(data, size,
+         get_le(data + terms_off + 8 * i, 8), &term, &term_len, &n_postings);
+
+      if (! postings) {
+         status = 0;
+         break;
+      }
+
+      for (uint32_t j = 0; status && j < n_postings; ++j, postings += HIST_INDEX_POSTING_LEN) {
+         struct hist_index_posting posting = {
+            get_le(postings, 4), get_le(postings + 4, 8), get_le(postings + 12, 8)
+         };
+
+         status = posting.file < index->n_files &&
+                  add_posting(index, term, term_len, &posting);
+      }
+   }
+
+   munmap(data, size);
+
+   if (! status) {
+      warnx("%s: Corrupt index", path);
+      hist_index_free(index);
+      return NULL;
+   }
+
+   return index;
+}
+
+/*
+ * Frees an index without saving it
+ */
+void hist_index_free
+ (
+   struct hist_index *index
+ )
+{
+   for (size_t i = 0; i < index->size && index->slots; ++i) {
+      if (index->slots[i]) {
+         free(index->slots[i]->term);
+         free(index->slots[i]->postings);
+         free(index->slots[i]);
+      }
+   }
+
+   for (uint32_t i = 0; i < index->n_files; ++i)
+      free(index->files[i].path);
+
+   free(index->slots);
+   free(index->files);
+   free(index->path);
+   free(index);
+}
+
+/*
+ * Index the history file at path, replacing postings of an earlier
+ * version. Unless force is set, files whose size and modification time
+ * did not change are skipped.
+ * Returns 1 on success or 0 on error.
+ */
+int hist_index_add_file
+ (
+   struct hist_index *index,
+   const char *path,
+   int force
+ )
+{
+   char real_path[PATH_MAX];
+   struct stat statbuf;
+   struct hist_pool *pool;
+   struct hist_reader *reader;
+   struct hist_entry *entry;
+   int status = 1;
+
+   if (! realpath(path, real_path) || stat(real_path, &statbuf) == -1) {
+      perror(path);
+      return 0;
+   }
+
+   for (uint32_t i = 0; i < index->n_files; ++i) {
+      struct hist_index_file *file = &index->files[i];
+
+      if (file->removed || strcmp(file->path, real_path))
+         continue;
+
+      if (! force && file->size == (uint64_t) statbuf.st_size &&
+            file->mtime == (uint64_t) statbuf.st_mtime)
+         return 1;
+
+      file->removed = 1;
+   }
+
+   long file = add_file(index, real_path, statbuf.st_size, statbuf.st_mtime);
+   if (file == -1)
+      return 0;
+
+   if (! (pool = hist_pool_new()))
+      return 0;
+
+   if (! (reader = hist_reader_open(real_path, pool))) {
+      hist_pool_free(pool);
+      return 0;
+   }
+
+   while (status && (entry = hist_reader_next(reader))) {
+      if (! entry->passthrough) {
+         struct hist_index_posting posting = {
+            file, hist_reader_offset(reader), hist_timestamp_key(entry->timestamp)
+         };
+         const char *body = hist_entry_body(entry);
+         char term[HIST_INDEX_MAX_TERM];
+         size_t pos = 0, term_len;
+
+         while (status && (term_len = next_term(body, entry->body_len, &pos, term)))
+            status = add_posting(index, term, term_len, &posting);
+      }
+
+      free_hist_entry(entry);
+   }
+
+   hist_reader_close(reader);
+   hist_pool_free(pool);
+   return status;
+}
+
+/*
+ * Forget files that do not exist anymore
+ */
+void hist_index_prune
+ (
+   struct hist_index *index
+ )
+{
+   for (uint32_t i = 0; i < index->n_files; ++i)
+      if (! index->files[i].removed && access(index->files[i].path, F_OK) == -1)
+         index->files[i].removed = 1;
+}
+
+/*
+ * Compare function for qsort on terms
+ */
+static int cmp_term(const void *a, const void *b)
+{
+   const struct hist_index_term *term_a = *(struct hist_index_term * const *) a;
+   const struct hist_index_term *term_b = *(struct hist_index_term * const *) b;
+   size_t len = term_a->term_len < term_b->term_len ? term_a->term_len : term_b->term_len;
+   int cmp = memcmp(term_a->term, term_b->term, len);
+
+   if (cmp)
+      return cmp;
+   return (term_a->term_len > term_b->term_len) - (term_a->term_len < term_b->term_len);
+}
+
+/*
+ * Compare function for qsort on postings
+ */
+static int cmp_posting(const void *a, const void *b)
+{
+   const struct hist_index_posting *posting_a = a;
+   const struct hist_index_posting *posting_b = b;
+
+   if (posting_a->file != posting_b->file)
+      return posting_a->file < posting_b->file ? -1 : 1;
+   return (posting_a->offset > posting_b->offset) - (posting_a->offset < posting_b->offset);
+}
+
+/*
+ * Write the index back to its file. Postings of replaced or pruned
+ * files are dropped. The file is replaced atomically.
+ * Returns 1 on success or 0 on error.
+ */
+int hist_index_save
+ (
+   struct hist_index *index
+ )
+{
+   FILE *out_stream;
+   struct hist_index_term **terms;
+   uint32_t *file_ids;
+   uint64_t n_terms = 0, n_files = 0;
+   int status = 1;
+
+   char *tmp_path = malloc(strlen(index->path) + 5);
+   terms = malloc((index->used + 1) * sizeof(struct hist_index_term *));
+   file_ids = malloc((index->n_files + 1) * sizeof(uint32_t));
+
+   if (! tmp_path || ! terms || ! file_ids) {
+      perror("malloc");
+      free(tmp_path);
+      free(terms);
+      free(file_ids);
+      return 0;
+   }
+
+   // renumber the files that are kept
+   for (uint32_t i = 0; i < index->n_files; ++i)
+      file_ids[i] = index->files[i].removed ? UINT32_MAX : n_files++;
+
+   for (size_t i = 0; i < index->size; ++i) {
+      struct hist_index_term *term = index->slots[i];
+      size_t kept = 0;
+
+      if (! term)
+         continue;
+
+      for (size_t j = 0; j < term->n_postings; ++j) {
+         if (file_ids[term->postings[j].file] == UINT32_MAX)
+            continue;
+         term->postings[kept] = term->postings[j];
+         term->postings[kept++].file = file_ids[term->postings[j].file];
+      }
+      term->n_postings = kept;
+
+      if (kept) {
+         qsort(term->postings, kept, sizeof(struct hist_index_posting), cmp_posting);
+         terms[n_terms++] = term;
+      }
+   }
+
+   // the postings now use the new numbers
+   for (uint32_t i = 0, j = 0; i < index->n_files; ++i) {
+      if (index->files[i].removed)
+         free(index->files[i].path);
+      else
+         index->files[j++] = index->files[i];
+   }
+   index->n_files = n_files;
+
+   qsort(terms, n_terms, sizeof(struct hist_index_term *), cmp_term);
+
+   sprintf(tmp_path, "%s.tmp", index->path);
+   if (! (out_stream = fopen(tmp_path, "w"))) {
+      perror(tmp_path);
+      free(tmp_path);
+      free(terms);
+      free(file_ids);
+      return 0;
+   }
+
+   uint64_t files_off = HIST_INDEX_HEADER_LEN;
+   uint64_t terms_off = files_off;
+   for (uint32_t i = 0; i < index->n_files; ++i)
+      terms_off += 4 + strlen(index->files[i].path) + 16;
+
+   fwrite(HIST_INDEX_MAGIC, 1, HIST_INDEX_MAGIC_LEN, out_stream);
+   put_le(out_stream, n_files, 8);
+   put_le(out_stream, files_off, 8);
+   put_le(out_stream, n_terms, 8);
+   put_le(out_stream, terms_off, 8);
+
+   for (uint32_t i = 0; i < index->n_files; ++i) {
+      size_t len = strlen(index->files[i].path);
+
+      put_le(out_stream, len, 4);
+      fwrite(index->files[i].path, 1, len, out_stream);
+      put_le(out_stream, index->files[i].size, 8);
+      put_le(out_stream, index->files[i].mtime, 8);
+   }
+
+   uint64_t offset = terms_off + 8 * n_terms;
+   for (uint64_t i = 0; i < n_terms; ++i) {
+      put_le(out_stream, offset, 8);
+      offset += 4 + terms[i]->term_len + 4 + HIST_INDEX_POSTING_LEN * terms[i]->n_postings;
+   }
+
+   for (uint64_t i = 0; i < n_terms; ++i) {
+      put_le(out_stream, terms[i]->term_len, 4);
+      fwrite(terms[i]->term, 1, terms[i]->term_len, out_stream);
+      put_le(out_stream, terms[i]->n_postings, 4);
+
+      for (size_t j = 0; j < terms[i]->n_postings; ++j) {
+         put_le(out_stream, terms[i]->postings[j].file, 4);
+         put_le(out_stream, terms[i]->postings[j].offset, 8);
+         put_le(out_stream, terms[i]->postings[j].key, 8);
+      }
+   }
+
+   if (ferror(out_stream) | fclose(out_stream) || rename(tmp_path, index->path) == -1) {
+      perror(index->path);
+      unlink(tmp_path);
+      status = 0;
+   }
+
+   free(tmp_path);
+   free(terms);
+   free(file_ids);
+   return status;
+}
+
+/*
+ * Find the postings of term in a mapped index by binary search.
+ * Returns a pointer to the first posting or NULL if term is not found.
+ */
+static const unsigned char* lookup_term
+ (
+   const unsigned char *data,
+   size_t size,
+   const char *word,
+   size_t len,
+   uint32_t *n_postings
+ )
+{
+   uint64_t n_terms = get_le(data + HIST_INDEX_MAGIC_LEN + 16, 8);
+   uint64_t terms_off = get_le(data + HIST_INDEX_MAGIC_LEN + 24, 8);
+   uint64_t low = 0, high = n_terms;
+
+   while (low < high) {
+      uint64_t mid = low + (high - low) / 2;
+      const char *term;
+      uint32_t term_len;
+      const unsigned char *postings = parse_term(data, size,
+         get_le(data + terms_off + 8 * mid, 8), &term, &term_len, n_postings);
+
+      if (! postings)
+         return NULL;
+
+      int cmp = memcmp(term, word, term_len < len ? term_len : len);
+      if (! cmp)
+         cmp = (term_len > len) - (term_len < len);
+
+      if (! cmp)
+         return postings;
+      else if (cmp < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+
+   return NULL;
+}
+
+/*
+ * Print the entry at offset of file, or its number for archives
+ */
+static void print_hit
+ (
+   FILE *out_stream,
+   const char *path,
+   uint64_t offset
+ )
+{
+   char line[512];
+   FILE *hist_fh;
+
+   fprintf(out_stream, "%s:%llu: ", path, (unsigned long long) offset);
+
+   // binary archives start with a non-ASCII byte, their offsets
+   // are entry numbers
+   if (! (hist_fh = fopen(path, "r")) || ! fgets(line, sizeof(line), hist_fh)) {
+      fputs("(unreadable)\n", out_stream);
+   }
+   else if ((unsigned char) line[0] == 0x89) {
+      fputs("(binary archive entry)\n", out_stream);
+   }
+   else if (fseek(hist_fh, offset, SEEK_SET) != -1 && fgets(line, sizeof(line), hist_fh)) {
+      fputs(line, out_stream);
+      if (! strchr(line, '\n'))
+         fputc('\n', out_stream);
+   }
+   else {
+      fputs("(unreadable)\n", out_stream);
+   }
+
+   if (hist_fh)
+      fclose(hist_fh);
+}
+
+/*
+ * Search the index at path for entries containing all words, with
+ * timestamp keys (see hist_timestamp_key()) between from and to, and
+ * print them to out_stream.
+ * Returns the count of hits or -1 on error.
+ */
+long hist_index_search
+ (
+   const char *path,
+   const char **words,
+   int n_words,
+   uint64_t from,
+   uint64_t to,
+   FILE *out_stream
+ )
+{
+   unsigned char *data;
+   size_t size;
+   long hits = 0;
+
+   if (! map_file(path, &data, &size))
+      return -1;
+
+   if (! data || ! n_words)
+      return 0;
+
+   if (! check_index(data, size)) {
+      warnx("%s: Corrupt index", path);
+      munmap(data, size);
+      return -1;
+   }
+
+   uint64_t n_files = get_le(data + HIST_INDEX_MAGIC_LEN, 8);
+   const unsigned char **postings = calloc(n_words, sizeof(unsigned char *));
+   uint32_t *n_postings = calloc(n_words, sizeof(uint32_t));
+   uint32_t *cursors = calloc(n_words, sizeof(uint32_t));
+   char **paths = calloc(n_files + 1, sizeof(char *));
+
+   if (! postings || ! n_postings || ! cursors || ! paths) {
+      perror("calloc");
+      hits = -1;
+   }
+
+   // file table, paths are looked up by number for every hit
+   uint64_t pos = get_le(data + HIST_INDEX_MAGIC_LEN + 8, 8);
+   for (uint64_t f = 0; hits != -1 && f < n_files; ++f) {
+      if (pos > size || size - pos < 4 || size - pos - 4 < get_le(data + pos, 4)) {
+         warnx("%s: Corrupt index", path);
+         hits = -1;
+      }
+      else if (! (paths[f] = strndup((const char *) data + pos + 4, get_le(data + pos, 4)))) {
+         perror("strndup");
+         hits = -1;
+      }
+      else {
+         pos += 4 + get_le(data + pos, 4) + 16;
+      }
+   }
+
+   for (int i = 0; hits != -1 && i < n_words; ++i) {
+      char term[HIST_INDEX_MAX_TERM];
+      size_t pos = 0;
+      size_t len = next_term(words[i], strlen(words[i]), &pos, term);
+
+      if (! len || ! (postings[i] = lookup_term(data, size, term, len, &n_postings[i]))) {
+         n_postings[0] = 0;
+         break;
+      }
+   }
+
+   // intersect the sorted posting lists, driven by the first one
+   for (uint32_t i = 0; hits != -1 && i < n_postings[0]; ++i) {
+      const unsigned char *posting = postings[0] + HIST_INDEX_POSTING_LEN * i;
+      uint64_t file = get_le(posting, 4);
+      uint64_t offset = get_le(posting + 4, 8);
+      uint64_t key = get_le(posting + 12, 8);
+      int found = key >= from && key <= to;
+
+      for (int w = 1; found && w < n_words; ++w) {
+         const unsigned char *other = NULL;
+
+         for (; cursors[w] < n_postings[w]; ++cursors[w]) {
+            other = postings[w] + HIST_INDEX_POSTING_LEN * cursors[w];
+            if (get_le(other, 4) > file ||
+                  (get_le(other, 4) == file && get_le(other + 4, 8) >= offset))
+               break;
+         }
+
+         found = cursors[w] < n_postings[w] && get_le(other, 4) == file &&
+                 get_le(other + 4, 8) == offset;
+      }
+
+      if (! found || file >= n_files)
+         continue;
+
+      print_hit(out_stream, paths[file], offset);
+      ++hits;
+   }
+
+   for (uint64_t f = 0; paths && f < n_files; ++f)
+      free(paths[f]);
+   free(paths);
+   free(postings);
+   free(n_postings);
+   free(cursors);
+   munmap(data, size);
+   return hits;
+}
@@ -0,0 +1,1359 @@
+/*
+ * libmcabberhist - file I/O backends and throttling
+ * Copyright (C) 2016 Benjamin Abendroth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// fopencookie()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "mcabberhist.h"
+
+// Copies are done in chunks of this size, so they can be throttled
+#define HIST_IO_CHUNK_SIZE (64 * 1024)
+
+// Stream buffer of the pread backend, initial buffer of the memory backend
+#define HIST_IO_BUFFER_SIZE (1024 * 1024)
+
+// Durability policies, see hist_io_durability()
+#define HIST_IO_SYNC_NONE 0
+#define HIST_IO_SYNC_PER_FILE 1
+#define HIST_IO_SYNC_BATCHED 2
+
+// Pages read or written are dropped from the page cache in steps of
+// this size (page cache policy drop)
+#define HIST_IO_DROP_STEP (4 * 1024 * 1024)
+
+/*
+ * Token bucket, one token is one byte or one I/O operation
+ */
+struct hist_bucket
+{
+   // Tokens per second, 0 for no limit
+   uint64_t rate;
+
+   // Goes negative when callers are ahead of the rate, later callers
+   // wait for that debt to be paid off
+   double tokens;
+   struct timespec last;
+
+   pthread_mutex_t lock;
+};
+
+static struct hist_bucket read_bucket = { 0, 0, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER };
+static struct hist_bucket write_bucket = { 0, 0, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER };
+static struct hist_bucket iops_bucket = { 0, 0, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Temporary file waiting to be renamed over path
+ */
+struct hist_io_rename
+{
+   char *temp;
+   char *path;
+};
+
+static int durability = HIST_IO_SYNC_NONE;
+
+// Renames deferred until hist_io_commit() (batched policy)
+static struct hist_io_rename *renames;
+static size_t n_renames;
+static size_t renames_size;
+static pthread_mutex_t renames_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Makes temporary file names unique within this process
+static unsigned long temp_counter;
+
+/*
+ * Pages of a file streamed through once. With page cache policy drop
+ * they are dropped from the page cache behind the cursor, unless they
+ * were cached before the file was opened.
+ */
+struct hist_io_pages
+{
+   // Own descriptor of the file, -1 if nothing is dropped
+   int fd;
+   int writing;
+
+   // Mapping of the file to release pages of before dropping them
+   char *map;
+
+   // Dropped up to done, the cursor is at pos
+   off_t done;
+   off_t pos;
+
+   // Pages that were cached when the file was opened for reading, one
+   // byte per page as mincore() reports them. NULL drops all pages.
+   unsigned char *cached;
+   size_t n_cached;
+};
+
+static int drop_pages = 0;
+
+/*
+ * Set the rate of bucket and start it full
+ */
+static void set_rate
+ (
+   struct hist_bucket *bucket,
+   uint64_t rate
+ )
+{
+   pthread_mutex_lock(&bucket->lock);
+   bucket->rate = rate;
+   bucket->tokens = rate / 10.0;
+   clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+   pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+ * Take n tokens out of bucket, sleeping as long as it takes to refill
+ * them. Bursts are limited to a tenth of a second worth of tokens.
+ */
+static void take_tokens
+ (
+   struct hist_bucket *bucket,
+   uint64_t n
+ )
+{
+   struct timespec now;
+   double wait = 0;
+
+   if (! bucket->rate || ! n)
+      return;
+
+   pthread_mutex_lock(&bucket->lock);
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   bucket->tokens += ((now.tv_sec - bucket->last.tv_sec) +
+                      (now.tv_nsec - bucket->last.tv_nsec) / 1e9) * bucket->rate;
+   bucket->last = now;
+
+   double burst = bucket->rate / 10.0;
+   if (burst < 1)
+      burst = 1;
+   if (bucket->tokens > burst)
+      bucket->tokens = burst;
+
+   bucket->tokens -= n;
+   if (bucket->tokens < 0)
+      wait = -bucket->tokens / bucket->rate;
+
+   pthread_mutex_unlock(&bucket->lock);
+
+   if (wait > 0) {
+      struct timespec sleep_time = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+
+      while (nanosleep(&sleep_time, &sleep_time) == -1 && errno == EINTR)
+         ;
+   }
+}
+
+/*
+ * Limit the I/O of all files opened by hist_io_open() and of all
+ * copies done by hist_io_sendfile(), shared by all threads.
+ * read_rate and write_rate are in bytes, iops in read and write calls
+ * per second. 0 removes the limit.
+ */
+void hist_io_limit
+ (
+   uint64_t read_rate,
+   uint64_t write_rate,
+   uint64_t iops
+ )
+{
+   set_rate(&read_bucket, read_rate);
+   set_rate(&write_bucket, write_rate);
+   set_rate(&iops_bucket, iops);
+}
+
+/*
+ * read() throttled by the I/O limits
+ */
+static ssize_t limited_read
+ (
+   int fd,
+   char *buf,
+   size_t size,
+   off_t offset
+ )
+{
+   take_tokens(&iops_bucket, 1);
+   take_tokens(&read_bucket, size);
+
+   return offset == -1 ? read(fd, buf, size) : pread(fd, buf, size, offset);
+}
+
+/*
+ * write() throttled by the I/O limits, writing all of buf
+ * Returns size or -1 if failed.
+ */
+static ssize_t limited_write
+ (
+   int fd,
+   const char *buf,
+   size_t size,
+   off_t offset
+ )
+{
+   size_t done = 0;
+
+   while (done < size) {
+      take_tokens(&iops_bucket, 1);
+      take_tokens(&write_bucket, size - done);
+
+      ssize_t written = offset == -1 ? write(fd, buf + done, size - done)
+                                     : pwrite(fd, buf + done, size - done, offset + done);
+      if (written == -1)
+         return -1;
+
+      done += written;
+   }
+
+   return done;
+}
+
+/*
+ * Start tracking the pages of the file at fd, opened with mode "r",
+ * "w" or "a". Does nothing unless the page cache policy is drop.
+ */
+static void pages_open
+ (
+   struct hist_io_pages *pages,
+   int fd,
+   const char *mode
+ )
+{
+   struct stat statbuf;
+   long page_size = sysconf(_SC_PAGESIZE);
+   void *map;
+
+   memset(pages, 0, sizeof(*pages));
+   pages->fd = -1;
+   pages->writing = mode[0] != 'r';
+
+   if (! drop_pages || fstat(fd, &statbuf) == -1 || (pages->fd = dup(fd)) == -1)
+      return;
+
+   posix_fadvise(pages->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+   // written files start empty or at their end
+   if (pages->writing) {
+      if (mode[0] == 'a')
+         pages->done = pages->pos = statbuf.st_size;
+      return;
+   }
+
+   // mapping without touching the pages tells which ones are cached
+   if (! statbuf.st_size)
+      return;
+
+   pages->n_cached = (statbuf.st_size + page_size - 1) / page_size;
+   if (! (pages->cached = malloc(pages->n_cached)))
+      return;
+
+   map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED || mincore(map, statbuf.st_size, pages->cached) == -1) {
+      free(pages->cached);
+      pages->cached = NULL;
+   }
+
+   if (map != MAP_FAILED)
+      munmap(map, statbuf.st_size);
+}
+
+/*
+ * Drop the pages from the last dropped one up to end, or up to the end
+ * of the file if end is -1. Written pages are written back first.
+ */
+static void pages_drop
+ (
+   struct hist_io_pages *pages,
+   off_t end
+ )
+{
+   long page_size = sysconf(_SC_PAGESIZE);
+   size_t first, last;
+
+   if (pages->fd == -1 || (end != -1 && end <= pages->done))
+      return;
+
+   if (pages->map)
+      madvise(pages->map + pages->done, end == -1 ? pages->pos - pages->done
+                                                  : end - pages->done, MADV_DONTNEED);
+
+   // dirty pages are not dropped
+   if (pages->writing) {
+      sync_file_range(pages->fd, pages->done, end == -1 ? 0 : end - pages->done,
+         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(pages->fd, pages->done, end == -1 ? 0 : end - pages->done,
+         POSIX_FADV_DONTNEED);
+   }
+   else if (! pages->cached) {
+      posix_fadvise(pages->fd, pages->done, end == -1 ? 0 : end - pages->done,
+         POSIX_FADV_DONTNEED);
+   }
+   else {
+      // runs of pages that were not cached before
+      first = pages->done / page_size;
+      last = end == -1 ? pages->n_cached : (size_t) end / page_size;
+      if (last > pages->n_cached)
+         last = pages->n_cached;
+
+      for (size_t i = first; i < last; ) {
+         if (pages->cached[i] & 1) {
+            ++i;
+            continue;
+         }
+
+         size_t start = i;
+         while (i < last && ! (pages->cached[i] & 1))
+            ++i;
+
+         posix_fadvise(pages->fd, (off_t) start * page_size, (off_t) (i - start) * page_size,
+            POSIX_FADV_DONTNEED);
+      }
+   }
+
+   if (end != -1)
+      pages->done = end;
+}
+
+/*
+ * Move the cursor of pages to pos, dropping what is a step behind it
+ */
+static void pages_seek
+ (
+   struct hist_io_pages *pages,
+   off_t pos
+ )
+{
+   long page_size = sysconf(_SC_PAGESIZE);
+
+   pages->pos = pos;
+
+   if (pages->fd != -1 && pos - pages->done >= HIST_IO_DROP_STEP)
+      pages_drop(pages, pos / page_size * page_size);
+}
+
+/*
+ * Drop the remaining pages and stop tracking them
+ */
+static void pages_close
+ (
+   struct hist_io_pages *pages
+ )
+{
+   if (pages->fd == -1)
+      return;
+
+   pages_drop(pages, -1);
+   close(pages->fd);
+   free(pages->cached);
+   pages->fd = -1;
+}
+
+/*
+ * Cookie of streams on a file descriptor (stdio and pread backends)
+ */
+struct hist_io_fd
+{
+   int fd;
+
+   // Position for pread()/pwrite(), -1 for read()/write()
+   off_t pos;
+
+   struct hist_io_pages pages;
+};
+
+static ssize_t fd_read(void *cookie, char *buf, size_t size)
+{
+   struct hist_io_fd *file = cookie;
+   ssize_t n = limited_read(file->fd, buf, size, file->pos);
+
+   if (n > 0 && file->pos != -1)
+      file->pos += n;
+   if (n > 0)
+      pages_seek(&file->pages, file->pages.pos + n);
+   return n;
+}
+
+static ssize_t fd_write(void *cookie, const char *buf, size_t size)
+{
+   struct hist_io_fd *file = cookie;
+   ssize_t n = limited_write(file->fd, buf, size, file->pos);
+
+   if (n > 0 && file->pos != -1)
+      file->pos += n;
+   if (n > 0)
+      pages_seek(&file->pages, file->pages.pos + n);
+   return n;
+}
+
+static int fd_seek(void *cookie, off64_t *offset, int whence)
+{
+   struct hist_io_fd *file = cookie;
+   off_t pos;
+
+   if (file->pos == -1 || whence != SEEK_SET)
+      pos = lseek(file->fd, *offset, whence);
+   else
+      pos = *offset;
+
+   if (pos == -1)
+      return -1;
+
+   if (file->pos != -1)
+      file->pos = pos;
+   *offset = pos;
+   return 0;
+}
+
+static int fd_close(void *cookie)
+{
+   struct hist_io_fd *file = cookie;
+   int status;
+
+   pages_close(&file->pages);
+   status = close(file->fd);
+
+   free(file);
+   return status;
+}
+
+/*
+ * Open a stream on fd reading and writing through the I/O limits,
+ * with pread()/pwrite() if positional is set. fd is closed if failed.
+ */
+static FILE* open_fd
+ (
+   int fd,
+   const char *mode,
+   int positional
+ )
+{
+   static const cookie_io_functions_t functions = { fd_read, fd_write, fd_seek, fd_close };
+   struct hist_io_fd *file = malloc(sizeof(struct hist_io_fd));
+   FILE *stream;
+
+   if (! file) {
+      close(fd);
+      return NULL;
+   }
+
+   file->fd = fd;
+   file->pos = positional ? 0 : -1;
+   pages_open(&file->pages, fd, mode);
+
+   if (! (stream = fopencookie(file, mode, functions))) {
+      pages_close(&file->pages);
+      close(fd);
+      free(file);
+      return NULL;
+   }
+
+   return stream;
+}
+
+/*
+ * Buffered stdio, through a cookie stream if limits are set or pages
+ * are dropped
+ */
+static FILE* open_stdio
+ (
+   const char *path,
+   int fd,
+   const char *mode
+ )
+{
+   FILE *stream;
+
+   if (read_bucket.rate || write_bucket.rate || iops_bucket.rate || drop_pages)
+      return open_fd(fd, mode, 0);
+
+   if (! (stream = fdopen(fd, mode)))
+      close(fd);
+
+   return stream;
+}
+
+/*
+ * pread()/pwrite() with large buffers
+ */
+static FILE* open_pread
+ (
+   const char *path,
+   int fd,
+   const char *mode
+ )
+{
+   FILE *stream;
+
+   // appending needs the file position
+   if (! (stream = open_fd(fd, mode, mode[0] != 'a')))
+      return NULL;
+
+   setvbuf(stream, NULL, _IOFBF, HIST_IO_BUFFER_SIZE);
+   return stream;
+}
+
+/*
+ * Cookie of streams on a memory buffer (mmap and memory backends)
+ */
+struct hist_io_mem
+{
+   char *data;
+   size_t size;
+   size_t len;
+   size_t pos;
+
+   // Mapped file, unmapped on close
+   int mapped;
+
+   // File written on close, -1 when reading
+   int fd;
+
+   // Pages of the mapped file
+   struct hist_io_pages pages;
+};
+
+static ssize_t mem_read(void *cookie, char *buf, size_t size)
+{
+   struct hist_io_mem *mem = cookie;
+
+   if (size > mem->len - mem->pos)
+      size = mem->len - mem->pos;
+
+   // pages of a mapping are read while copying
+   if (mem->mapped)
+      take_tokens(&read_bucket, size);
+
+   memcpy(buf, mem->data + mem->pos, size);
+   mem->pos += size;
+
+   if (mem->mapped)
+      pages_seek(&mem->pages, mem->pos);
+   return size;
+}
+
+static ssize_t mem_write(void *cookie, const char *buf, size_t size)
+{
+   struct hist_io_mem *mem = cookie;
+
+   if (mem->len + size > mem->size) {
+      size_t new_size = mem->size ? mem->size : HIST_IO_BUFFER_SIZE;
+      while (new_size < mem->len + size)
+         new_size *= 2;
+
+      char *data = realloc(mem->data, new_size);
+      if (! data)
+         return -1;
+
+      mem->data = data;
+      mem->size = new_size;
+   }
+
+   memcpy(mem->data + mem->len, buf, size);
+   mem->len += size;
+   return size;
+}
+
+static int mem_close(void *cookie)
+{
+   struct hist_io_mem *mem = cookie;
+   int status = 0;
+
+   if (mem->fd != -1) {
+      pages_open(&mem->pages, mem->fd, "a");
+      if (limited_write(mem->fd, mem->data, mem->len, -1) == -1)
+         status = -1;
+      pages_seek(&mem->pages, mem->pages.pos + mem->len);
+      if (close(mem->fd) == -1)
+         status = -1;
+   }
+
+   if (mem->mapped)
+      munmap(mem->data, mem->size);
+   else
+      free(mem->data);
+
+   // what is left of the mapping is gone
+   mem->pages.map = NULL;
+   pages_close(&mem->pages);
+
+   free(mem);
+   return status;
+}
+
+/*
+ * Open a stream on mem, mem is freed if failed
+ */
+static FILE* open_mem
+ (
+   struct hist_io_mem *mem,
+   const char *mode
+ )
+{
+   static const cookie_io_functions_t functions = { mem_read, mem_write, NULL, mem_close };
+   FILE *stream;
+
+   if (! (stream = fopencookie(mem, mode, functions))) {
+      if (mem->fd != -1)
+         close(mem->fd);
+      if (mem->mapped)
+         munmap(mem->data, mem->size);
+      else
+         free(mem->data);
+      mem->pages.map = NULL;
+      pages_close(&mem->pages);
+      free(mem);
+      return NULL;
+   }
+
+   return stream;
+}
+
+/*
+ * Reads from a private mapping of the file, writes like stdio
+ */
+static FILE* open_mmap
+ (
+   const char *path,
+   int fd,
+   const char *mode
+ )
+{
+   struct hist_io_mem *mem;
+   struct stat statbuf;
+
+   if (mode[0] != 'r')
+      return open_stdio(path, fd, mode);
+
+   if (fstat(fd, &statbuf) == -1 || ! (mem = calloc(1, sizeof(struct hist_io_mem)))) {
+      close(fd);
+      return NULL;
+   }
+
+   mem->fd = -1;
+   mem->len = mem->size = statbuf.st_size;
+   mem->pages.fd = -1;
+
+   // empty files can not be mapped
+   if (mem->size) {
+      mem->data = mmap(NULL, mem->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mem->data == MAP_FAILED) {
+         close(fd);
+         free(mem);
+         return NULL;
+      }
+      mem->mapped = 1;
+      madvise(mem->data, mem->size, MADV_SEQUENTIAL);
+
+      // mapped pages stay cached, they are released before dropping
+      pages_open(&mem->pages, fd, mode);
+      mem->pages.map = mem->data;
+   }
+
+   close(fd);
+   return open_mem(mem, mode);
+}
+
+/*
+ * Reads the whole file with one read into memory, keeps written data
+ * in memory and writes it with one write on close
+ */
+static FILE* open_memory
+ (
+   const char *path,
+   int fd,
+   const char *mode
+ )
+{
+   struct hist_io_mem *mem;
+   struct hist_io_pages pages;
+   struct stat statbuf;
+
+   if (! (mem = calloc(1, sizeof(struct hist_io_mem)))) {
+      close(fd);
+      return NULL;
+   }
+
+   mem->fd = fd;
+   mem->pages.fd = -1;
+   if (mode[0] != 'r')
+      return open_mem(mem, mode);
+
+   mem->fd = -1;
+   pages_open(&pages, fd, mode);
+   if (fstat(fd, &statbuf) == -1 || ! (mem->data = malloc(statbuf.st_size + 1))) {
+      pages_close(&pages);
+      close(fd);
+      free(mem);
+      return NULL;
+   }
+   mem->size = statbuf.st_size + 1;
+
+   ssize_t n;
+   while (mem->len < mem->size &&
+          (n = limited_read(fd, mem->data + mem->len, mem->size - mem->len, -1)) > 0)
+      mem->len += n;
+
+   // failed, or the file has grown since fstat()
+   if (n == -1 || mem->len == mem->size) {
+      if (n != -1)
+         errno = EAGAIN;
+      pages_close(&pages);
+      close(fd);
+      free(mem->data);
+      free(mem);
+      return NULL;
+   }
+
+   // the file is in memory now, its pages are not needed again
+   pages_close(&pages);
+   close(fd);
+   return open_mem(mem, mode);
+}
+
+/*
+ * Cookie of gzip streams
+ */
+struct hist_io_gz
+{
+   gzFile gz;
+
+   // Pages of the compressed file
+   struct hist_io_pages pages;
+};
+
+static ssize_t gz_read(void *cookie, char *buf, size_t size)
+{
+   struct hist_io_gz *file = cookie;
+   int n;
+
+   take_tokens(&iops_bucket, 1);
+   take_tokens(&read_bucket, size);
+
+   n = gzread(file->gz, buf, size);
+   pages_seek(&file->pages, gzoffset(file->gz));
+   return n;
+}
+
+static ssize_t gz_write(void *cookie, const char *buf, size_t size)
+{
+   struct hist_io_gz *file = cookie;
+   int n;
+
+   take_tokens(&iops_bucket, 1);
+   take_tokens(&write_bucket, size);
+
+   n = gzwrite(file->gz, buf, size);
+   pages_seek(&file->pages, gzoffset(file->gz));
+   return n == (int) size ? (ssize_t) size : -1;
+}
+
+static int gz_close(void *cookie)
+{
+   struct hist_io_gz *file = cookie;
+   int status = gzclose(file->gz) == Z_OK ? 0 : -1;
+
+   pages_close(&file->pages);
+   free(file);
+   return status;
+}
+
+/*
+ * gzip compressed files, uncompressed files are read as they are
+ */
+static FILE* open_gzip
+ (
+   const char *path,
+   int fd,
+   const char *mode
+ )
+{
+   static const cookie_io_functions_t functions = { gz_read, gz_write, NULL, gz_close };
+   struct hist_io_gz *file = malloc(sizeof(struct hist_io_gz));
+   FILE *stream;
+
+   if (! file) {
+      close(fd);
+      return NULL;
+   }
+
+   pages_open(&file->pages, fd, mode);
+
+   if (! (file->gz = gzdopen(fd, mode[0] == 'r' ? "rb" : mode[0] == 'a' ? "ab" : "wb"))) {
+      pages_close(&file->pages);
+      close(fd);
+      free(file);
+      return NULL;
+   }
+
+   if (! (stream = fopencookie(file, mode, functions))) {
+      gzclose(file->gz);
+      pages_close(&file->pages);
+      free(file);
+      return NULL;
+   }
+
+   return stream;
+}
+
+/*
+ * Available I/O backends. open() gets the file opened for mode and
+ * returns a stream on it, it closes fd if it fails.
+ */
+static const struct hist_io_backend
+{
+   const char *name;
+   FILE* (*open)(const char *path, int fd, const char *mode);
+}
+backends[] = {
+   { "stdio",  open_stdio  },
+   { "mmap",   open_mmap   },
+   { "pread",  open_pread  },
+   { "gzip",   open_gzip   },
+   { "memory", open_memory },
+   { NULL,     NULL        }
+};
+
+static const struct hist_io_backend *backend = &backends[0];
+
+/*
+ * Select the I/O backend of all files opened by hist_io_open() by name
+ * (stdio, mmap, pread, gzip or memory).
+ * Returns 1 on success or 0 if there is no such backend.
+ */
+int hist_io_backend
+ (
+   const char *name
+ )
+{
+   for (const struct hist_io_backend *it = backends; it->name; ++it) {
+      if (! strcmp(it->name, name)) {
+         backend = it;
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/*
+ * Check if the selected backend reads and writes the bytes of files as
+ * they are, so files can be copied without it.
+ */
+int hist_io_transparent(void)
+{
+   return backend->open != open_gzip;
+}
+
+/*
+ * Open path like fopen() with mode "r", "w" or "a", through the selected
+ * I/O backend. If I/O limits are set, reads and writes of the stream are
+ * throttled; with page cache policy drop its pages are dropped. Path "-"
+ * is stdin or stdout, read and written with stdio (they may be pipes);
+ * closing the stream leaves them open.
+ * Returns the stream or NULL if failed (errno is set).
+ */
+FILE* hist_io_open
+ (
+   const char *path,
+   const char *mode
+ )
+{
+   int flags;
+   int fd;
+
+   switch (mode[0]) {
+      case 'r':
+         flags = O_RDONLY;
+         break;
+      case 'w':
+         flags = O_WRONLY | O_CREAT | O_TRUNC;
+         break;
+      case 'a':
+         flags = O_WRONLY | O_CREAT | O_APPEND;
+         break;
+      default:
+         errno = EINVAL;
+         return NULL;
+   }
+
+   if (! strcmp(path, "-")) {
+      if (mode[0] != 'r')
+         fflush(stdout);
+      if ((fd = dup(mode[0] == 'r' ? STDIN_FILENO : STDOUT_FILENO)) == -1)
+         return NULL;
+      return open_stdio(path, fd, mode);
+   }
+
+   if ((fd = open(path, flags, 0666)) == -1)
+      return NULL;
+
+   // backends own fd, also when they fail
+   return backend->open(path, fd, mode);
+}
+
+/*
+ * Check if the selected backend writes output files through writable
+ * mappings (see hist_io_map_open()) when their size is known upfront.
+ */
+int hist_io_maps_output(void)
+{
+   return backend->open == open_mmap;
+}
+
+/*
+ * Create path with size bytes allocated on disk and map it writable
+ * into map->data.
+ * Returns 1 on success or 0 on error (errno is set).
+ */
+int hist_io_map_open
+ (
+   struct hist_io_map *map,
+   const char *path,
+   uint64_t size
+ )
+{
+   int error;
+
+   map->size = size;
+   map->data = NULL;
+
+   if ((map->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1)
+      return 0;
+
+   // empty files can not be mapped
+   if (! size)
+      return 1;
+
+   // reserve the blocks now, so running out of space is an error here
+   // and not a SIGBUS while copying
+   if ((error = posix_fallocate(map->fd, 0, size))) {
+      close(map->fd);
+      errno = error;
+      return 0;
+   }
+
+   map->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+   if (map->data == MAP_FAILED) {
+      error = errno;
+      close(map->fd);
+      errno = error;
+      return 0;
+   }
+
+   return 1;
+}
+
+/*
+ * Unmap and close a file mapped by hist_io_map_open(). The pages are
+ * written back by the kernel, counted against the write limit here.
+ * Returns 1 on success or 0 on error (errno is set).
+ */
+int hist_io_map_close
+ (
+   struct hist_io_map *map
+ )
+{
+   struct hist_io_pages pages;
+   int status = 1;
+
+   if (map->data) {
+      take_tokens(&iops_bucket, 1);
+      take_tokens(&write_bucket, map->size);
+
+      if (munmap(map->data, map->size) == -1)
+         status = 0;
+   }
+
+   pages_open(&pages, map->fd, "w");
+   pages_close(&pages);
+
+   if (close(map->fd) == -1)
+      status = 0;
+
+   return status;
+}
+
+/*
+ * Select how written files are made durable by name:
+ *   none      write files in place, leave syncing to the kernel
+ *   per-file  write a temporary file, sync and rename it over the file
+ *   batched   write temporary files, sync their filesystems once and
+ *             rename all of them in hist_io_commit()
+ * Returns 1 on success or 0 if there is no such policy.
+ */
+int hist_io_durability
+ (
+   const char *name
+ )
+{
+   if (! strcmp(name, "none"))
+      durability = HIST_IO_SYNC_NONE;
+   else if (! strcmp(name, "per-file"))
+      durability = HIST_IO_SYNC_PER_FILE;
+   else if (! strcmp(name, "batched"))
+      durability = HIST_IO_SYNC_BATCHED;
+   else
+      return 0;
+
+   return 1;
+}
+
+/*
+ * Select what happens to the page cache by name:
+ *   keep  leave pages of read and written files to the kernel
+ *   drop  read and write sequentially, drop the pages of files behind
+ *         the cursor unless they were cached before (written pages are
+ *         written back first), so files streamed through once do not
+ *         evict the pages of other programs
+ * Covers hist_io_open() streams, hist_io_map_close() and
+ * hist_io_sendfile().
+ * Returns 1 on success or 0 if there is no such policy.
+ */
+int hist_io_page_cache
+ (
+   const char *name
+ )
+{
+   if (! strcmp(name, "keep"))
+      drop_pages = 0;
+   else if (! strcmp(name, "drop"))
+      drop_pages = 1;
+   else
+      return 0;
+
+   return 1;
+}
+
+/*
+ * Check if written files only replace their destination in
+ * hist_io_commit()
+ */
+int hist_io_deferred(void)
+{
+   return durability == HIST_IO_SYNC_BATCHED;
+}
+
+/*
+ * Returns the path to write the new version of path to, path itself
+ * or a temporary file next to it, depending on the durability policy.
+ * Hand it to hist_io_finish() when done.
+ * Returns the allocated path or NULL if failed.
+ */
+char* hist_io_temp_path
+ (
+   const char *path
+ )
+{
+   const char *name = strrchr(path, '/');
+   char *temp;
+
+   if (durability == HIST_IO_SYNC_NONE || ! strcmp(path, "-")) {
+      if (! (temp = strdup(path)))
+         perror("strdup");
+      return temp;
+   }
+
+   name = name ? name + 1 : path;
+   if (! (temp = malloc(strlen(path) + 64))) {
+      perror("malloc");
+      return NULL;
+   }
+
+   // hidden, in the same directory so it can be renamed
+   sprintf(temp, "%.*s.%s.%ld.%lu.tmp", (int) (name - path), path, name, (long) getpid(),
+      __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED));
+   return temp;
+}
+
+/*
+ * Check if name is the file name of a temporary file of
+ * hist_io_temp_path() (.name.pid.counter.tmp), as a run that was killed
+ * leaves them behind
+ */
+int hist_io_is_temp
+ (
+   const char *name
+ )
+{
+   size_t len = strlen(name);
+   const char *end;
+
+   if (name[0] != '.' || len < 4 || strcmp(name + len - 4, ".tmp"))
+      return 0;
+   end = name + len - 4;
+
+   // counter and pid, each behind a dot
+   for (int i = 0; i < 2; ++i) {
+      const char *start = end;
+
+      while (start > name && isdigit((unsigned char) start[-1]))
+         --start;
+      if (start == end || start - name < 2 || start[-1] != '.')
+         return 0;
+      end = start - 1;
+   }
+
+   return end - name > 1;
+}
+
+/*
+ * Flush the data of path to disk, or the whole filesystem of path if
+ * whole_fs is set.
+ * Returns 1 on success or 0 on error (errno is set).
+ */
+static int sync_path
+ (
+   const char *path,
+   int whole_fs
+ )
+{
+   int fd, status;
+
+   if ((fd = open(path, O_RDONLY)) == -1)
+      return 0;
+
+   status = (whole_fs ? syncfs(fd) : fdatasync(fd)) != -1;
+
+   int saved_errno = errno;
+   close(fd);
+   errno = saved_errno;
+   return status;
+}
+
+/*
+ * Sync the directory holding path, so a rename in it is durable
+ * Returns 1 on success or 0 on error (errno is set).
+ */
+static int sync_dir
+ (
+   const char *path
+ )
+{
+   const char *name = strrchr(path, '/');
+   char *dir;
+   int status;
+
+   if (! name)
+      return sync_path(".", 0);
+
+   if (! (dir = strndup(path, name - path + 1)))
+      return 0;
+
+   status = sync_path(dir, 0);
+   free(dir);
+   return status;
+}
+
+/*
+ * Finish writing temp, returned by hist_io_temp_path() for path. If
+ * status is set it replaces path according to the durability policy,
+ * else it is removed. temp is freed.
+ * Returns 1 on success or 0 on error.
+ */
+int hist_io_finish
+ (
+   const char *path,
+   char *temp,
+   int status
+ )
+{
+   if (! strcmp(path, temp)) {
+      free(temp);
+      return status;
+   }
+
+   if (! status) {
+      unlink(temp);
+      free(temp);
+      return 0;
+   }
+
+   if (durability == HIST_IO_SYNC_PER_FILE) {
+      if (! sync_path(temp, 0) || rename(temp, path) == -1 || ! sync_dir(path)) {
+         perror(path);
+         unlink(temp);
+         status = 0;
+      }
+      free(temp);
+      return status;
+   }
+
+   pthread_mutex_lock(&renames_lock);
+
+   if (n_renames == renames_size) {
+      size_t size = renames_size ? renames_size * 2 : 64;
+      struct hist_io_rename *new_renames = realloc(renames, size * sizeof(struct hist_io_rename));
+      if (new_renames) {
+         renames = new_renames;
+         renames_size = size;
+      }
+   }
+
+   if (n_renames < renames_size && (renames[n_renames].path = strdup(path))) {
+      renames[n_renames++].temp = temp;
+   }
+   else {
+      perror("malloc");
+      unlink(temp);
+      free(temp);
+      status = 0;
+   }
+
+   pthread_mutex_unlock(&renames_lock);
+   return status;
+}
+
+/*
+ * Commit all files finished under the batched durability policy: sync
+ * each filesystem holding one of them once, then rename them over their
+ * destinations.
+ * Returns 1 on success or 0 on error.
+ */
+int hist_io_commit(void)
+{
+   dev_t *devices;
+   size_t n_devices = 0;
+   struct stat statbuf;
+   int status = 1;
+
+   pthread_mutex_lock(&renames_lock);
+
+   if (! (devices = malloc((n_renames + 1) * sizeof(dev_t)))) {
+      perror("malloc");
+      status = 0;
+   }
+
+   for (size_t i = 0; status && i < n_renames; ++i) {
+      size_t d = 0;
+
+      if (stat(renames[i].temp, &statbuf) == -1) {
+         perror(renames[i].temp);
+         status = 0;
+         break;
+      }
+
+      while (d < n_devices && devices[d] != statbuf.st_dev)
+         ++d;
+      if (d < n_devices)
+         continue;
+
+      devices[n_devices++] = statbuf.st_dev;
+      if (! sync_path(renames[i].temp, 1)) {
+         perror(renames[i].temp);
+         status = 0;
+      }
+   }
+
+   // nothing is replaced unless all of it made it to disk
+   for (size_t i = 0; i < n_renames; ++i) {
+      if (status && rename(renames[i].temp, renames[i].path) == -1) {
+         perror(renames[i].path);
+         status = 0;
+      }
+      if (! status)
+         unlink(renames[i].temp);
+
+      free(renames[i].temp);
+      free(renames[i].path);
+   }
+
+   n_renames = 0;
+   pthread_mutex_unlock(&renames_lock);
+
+   free(devices);
+   return status;
+}
+
+/*
+ * Copy size bytes from in_fd to out_fd with sendfile(), throttled
+ * and dropping pages like hist_io_open() streams.
+ * Returns 1 on success or 0 on error (errno is set).
+ */
+int hist_io_sendfile
+ (
+   int out_fd,
+   int in_fd,
+   uint64_t size
+ )
+{
+   int throttled = read_bucket.rate || write_bucket.rate || iops_bucket.rate;
+   struct hist_io_pages in_pages, out_pages;
+   int status = 1;
+   int error = 0;
+
+   pages_open(&in_pages, in_fd, "r");
+   pages_open(&out_pages, out_fd, "a");
+
+   while (size > 0) {
+      size_t chunk = size;
+
+      // pages are dropped behind the cursors between chunks
+      if (in_pages.fd != -1 && chunk > HIST_IO_DROP_STEP)
+         chunk = HIST_IO_DROP_STEP;
+
+      if (throttled) {
+         if (chunk > HIST_IO_CHUNK_SIZE)
+            chunk = HIST_IO_CHUNK_SIZE;
+
+         take_tokens(&iops_bucket, 2);
+         take_tokens(&read_bucket, chunk);
+         take_tokens(&write_bucket, chunk);
+      }
+
+      ssize_t sent = sendfile(out_fd, in_fd, NULL, chunk);
+      if (sent == -1) {
+         error = errno;
+         status = 0;
+         break;
+      }
+
+      // file shrunk while copying
+      if (! sent)
+         break;
+
+      size -= sent;
+      pages_seek(&in_pages, in_pages.pos + sent);
+      pages_seek(&out_pages, out_pages.pos + sent);
+   }
+
+   pages_close(&in_pages);
+   pages_close(&out_pages);
+
+   if (! status)
+      errno = error;
+   return status;
+}
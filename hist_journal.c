@@ -0,0 +1,588 @@
+/*
+ * libmcabberhist - progress journal of directory merges
+ * Copyright (C) 2016 Benjamin Abendroth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "mcabberhist.h"
+
+/*
+ * The journal is a text file, one line per finished output file:
+ *
+ *   sig1 sig2 sigO options<TAB>file1<TAB>file2<TAB>fileO
+ *
+ * A sig is "size:seconds.nanoseconds" of the modification time taken
+ * after the file was written, "-" and an empty path stand for a missing
+ * input. options is a hash of the merge options the file was written
+ * with, in hex. Lines are only appended, a torn last line is ignored.
+ * When most lines are outdated by later ones, the journal is compacted
+ * on open.
+ */
+
+// Compact journals of at least this many lines, if they have more than
+// twice as many lines as output files
+#define HIST_JOURNAL_COMPACT_LINES 1024
+
+/*
+ * Size and modification time of a file
+ */
+struct hist_journal_sig
+{
+   long long size;
+   long long sec;
+   long nsec;
+};
+
+/*
+ * Finished output file
+ */
+struct hist_journal_record
+{
+   // Holds file1, file2 and fileO, each null-terminated
+   char *paths;
+   const char *file2;
+   const char *fileO;
+
+   struct hist_journal_sig sig1;
+   struct hist_journal_sig sig2;
+   struct hist_journal_sig sigO;
+
+   // Hash of the merge options fileO was written with
+   uint64_t options;
+};
+
+/*
+ * Journal of a directory merge
+ */
+struct hist_journal
+{
+   int fd;
+   pthread_mutex_t lock;
+
+   // Hash of the merge options of this run
+   uint64_t options;
+
+   // Open addressing hash table of records by fileO, size is a power
+   // of two. Only holds the records of earlier runs.
+   struct hist_journal_record *records;
+   size_t size;
+   size_t used;
+};
+
+/*
+ * Hash function for paths (FNV-1a)
+ */
+static uint64_t hash_path
+ (
+   const char *path
+ )
+{
+   uint64_t hash = 14695981039346656037ULL;
+
+   for (; *path; ++path) {
+      hash ^= (unsigned char) *path;
+      hash *= 1099511628211ULL;
+   }
+
+   return hash;
+}
+
+/*
+ * Hash the options of opts that change what a merge writes: filters,
+ * collapsing, archive output and a compressing I/O backend
+ */
+static uint64_t hash_options
+ (
+   const struct hist_options *opts
+ )
+{
+   char options[256];
+
+   snprintf(options, sizeof(options), "%s\n%s\n%ld\n%d\n%d\n%d",
+      opts->types ? opts->types : "-", opts->drop_types ? opts->drop_types : "-",
+      opts->collapse_status, opts->archive, opts->archive && opts->compress,
+      ! hist_io_transparent());
+
+   return hash_path(options);
+}
+
+/*
+ * Get the sig of path, a missing file (or path NULL) has size -1.
+ * Returns 1 on success or 0 on error.
+ */
+static int get_sig
+ (
+   const char *path,
+   struct hist_journal_sig *sig
+ )
+{
+   struct stat statbuf;
+
+   memset(sig, 0, sizeof(*sig));
+   sig->size = -1;
+
+   if (! path)
+      return 1;
+
+   if (stat(path, &statbuf) == -1)
+      return errno == ENOENT;
+
+   sig->size = statbuf.st_size;
+   sig->sec = statbuf.st_mtim.tv_sec;
+   sig->nsec = statbuf.st_mtim.tv_nsec;
+   return 1;
+}
+
+/*
+ * Parse a sig at *pos, advancing it behind the sig.
+ * Returns 1 on success or 0 if malformed.
+ */
+static int parse_sig
+ (
+   char **pos,
+   struct hist_journal_sig *sig
+ )
+{
+   int n = 0;
+
+   memset(sig, 0, sizeof(*sig));
+   sig->size = -1;
+
+   if (**pos == '-') {
+      ++*pos;
+      return 1;
+   }
+
+   if (sscanf(*pos, "%lld:%lld.%ld%n", &sig->size, &sig->sec, &sig->nsec, &n) != 3 || ! n)
+      return 0;
+
+   *pos += n;
+   return 1;
+}
+
+/*
+ * Compare two sigs
+ */
+static int eq_sig
+ (
+   const struct hist_journal_sig *a,
+   const struct hist_journal_sig *b
+ )
+{
+   return a->size == b->size && a->sec == b->sec && a->nsec == b->nsec;
+}
+
+/*
+ * Find the slot of fileO in the records of journal
+ */
+static struct hist_journal_record* find_record
+ (
+   struct hist_journal *journal,
+   const char *fileO
+ )
+{
+   size_t i = hash_path(fileO) & (journal->size - 1);
+
+   for (; journal->records[i].paths; i = (i + 1) & (journal->size - 1))
+      if (! strcmp(journal->records[i].fileO, fileO))
+         break;
+
+   return &journal->records[i];
+}
+
+/*
+ * Double the hash table of journal.
+ * Returns 1 on success or 0 on error.
+ */
+static int grow_records
+ (
+   struct hist_journal *journal
+ )
+{
+   size_t size = journal->size * 2;
+   struct hist_journal_record *records = calloc(size, sizeof(struct hist_journal_record));
+   if (! records) {
+      perror("calloc");
+      return 0;
+   }
+
+   for (size_t i = 0; i < journal->size; ++i) {
+      struct hist_journal_record *record = &journal->records[i];
+      if (! record->paths)
+         continue;
+
+      size_t j = hash_path(record->fileO) & (size - 1);
+      while (records[j].paths)
+         j = (j + 1) & (size - 1);
+      records[j] = *record;
+   }
+
+   free(journal->records);
+   journal->records = records;
+   journal->size = size;
+   return 1;
+}
+
+/*
+ * Parse a journal line and add it to the records, replacing an older
+ * record of the same output file. Malformed lines are skipped.
+ * Returns 1 on success or 0 on error.
+ */
+static int add_record
+ (
+   struct hist_journal *journal,
+   char *line
+ )
+{
+   struct hist_journal_record new_record, *record;
+   char *pos = line, *file2, *fileO;
+
+   int n = 0;
+
+   if (! parse_sig(&pos, &new_record.sig1) || *pos++ != ' ' ||
+       ! parse_sig(&pos, &new_record.sig2) || *pos++ != ' ' ||
+       ! parse_sig(&pos, &new_record.sigO) || *pos++ != ' ' ||
+       sscanf(pos, "%16" SCNx64 "%n", &new_record.options, &n) != 1 || ! n)
+      return 1;
+
+   pos += n;
+   if (*pos++ != '\t')
+      return 1;
+
+   if (! (file2 = strchr(pos, '\t')) || ! (fileO = strchr(file2 + 1, '\t')))
+      return 1;
+   *file2++ = 0;
+   *fileO++ = 0;
+
+   // paths are stored back to back
+   size_t len = fileO + strlen(fileO) + 1 - pos;
+   if (! (new_record.paths = malloc(len))) {
+      perror("malloc");
+      return 0;
+   }
+   memcpy(new_record.paths, pos, len);
+   new_record.file2 = new_record.paths + (file2 - pos);
+   new_record.fileO = new_record.paths + (fileO - pos);
+
+   if (2 * (journal->used + 1) > journal->size && ! grow_records(journal)) {
+      free(new_record.paths);
+      return 0;
+   }
+
+   record = find_record(journal, new_record.fileO);
+   if (record->paths)
+      free(record->paths);
+   else
+      ++journal->used;
+
+   *record = new_record;
+   return 1;
+}
+
+/*
+ * Format the journal line of record, len is set to its length.
+ * Returns the line (to be freed) or NULL if failed.
+ */
+static char* format_line
+ (
+   const struct hist_journal_record *record,
+   size_t *len
+ )
+{
+   const struct hist_journal_sig *sigs[3] = { &record->sig1, &record->sig2, &record->sigO };
+   char sig_str[3][64];
+   char *line;
+
+   for (int i = 0; i < 3; ++i) {
+      if (sigs[i]->size == -1)
+         strcpy(sig_str[i], "-");
+      else
+         snprintf(sig_str[i], sizeof(sig_str[i]), "%lld:%lld.%09ld",
+            sigs[i]->size, sigs[i]->sec, sigs[i]->nsec);
+   }
+
+   *len = strlen(sig_str[0]) + strlen(sig_str[1]) + strlen(sig_str[2]) + 16 + 4 +
+          strlen(record->paths) + strlen(record->file2) + strlen(record->fileO) + 3;
+   if (! (line = malloc(*len + 1))) {
+      perror("malloc");
+      return NULL;
+   }
+
+   sprintf(line, "%s %s %s %016" PRIx64 "\t%s\t%s\t%s\n", sig_str[0], sig_str[1], sig_str[2],
+      record->options, record->paths, record->file2, record->fileO);
+   return line;
+}
+
+/*
+ * Rewrite the journal at path with only the latest line of every output
+ * file and append to the new one. If that fails before the new journal
+ * is in place, the old one is kept.
+ * Returns 1 on success or 0 on error.
+ */
+static int compact
+ (
+   struct hist_journal *journal,
+   const char *path
+ )
+{
+   char *temp = malloc(strlen(path) + sizeof(".XXXXXX"));
+   FILE *temp_fh;
+   int fd = -1;
+   int status = 1;
+
+   if (! temp) {
+      perror("malloc");
+      return 1;
+   }
+   sprintf(temp, "%s.XXXXXX", path);
+
+   if ((fd = mkstemp(temp)) == -1 || ! (temp_fh = fdopen(fd, "w"))) {
+      perror(temp);
+      if (fd != -1) {
+         close(fd);
+         unlink(temp);
+      }
+      free(temp);
+      return 1;
+   }
+
+   for (size_t i = 0; status && i < journal->size; ++i) {
+      char *line;
+      size_t len;
+
+      if (! journal->records[i].paths)
+         continue;
+
+      if ((line = format_line(&journal->records[i], &len)))
+         status = fwrite(line, 1, len, temp_fh) == len;
+      else
+         status = 0;
+      free(line);
+   }
+
+   status &= fclose(temp_fh) != EOF;
+
+   // readers see the old journal or the new one
+   if (! status || rename(temp, path) == -1) {
+      perror(temp);
+      unlink(temp);
+      free(temp);
+      return 1;
+   }
+   free(temp);
+
+   close(journal->fd);
+   if ((journal->fd = open(path, O_RDWR | O_APPEND)) == -1) {
+      perror(path);
+      return 0;
+   }
+
+   return 1;
+}
+
+/*
+ * Open the journal at path, creating it if it does not exist, and
+ * read the records of earlier runs. Only records written with the same
+ * merge options as opts count as done. Unless planning a dry run, a
+ * journal mostly holding outdated lines is compacted.
+ * Returns pointer to hist_journal or NULL if failed.
+ */
+struct hist_journal* hist_journal_open
+ (
+   const char *path,
+   const struct hist_options *opts
+ )
+{
+   struct hist_journal *journal = calloc(1, sizeof(struct hist_journal));
+   FILE *journal_fh;
+   char *line = NULL;
+   size_t line_size = 0;
+   ssize_t line_len;
+   size_t n_lines = 0;
+   int torn = 0;
+   int status = 1;
+
+   if (! journal) {
+      perror("calloc");
+      return NULL;
+   }
+
+   pthread_mutex_init(&journal->lock, NULL);
+   journal->options = hash_options(opts);
+   journal->size = 1024;
+   if (! (journal->records = calloc(journal->size, sizeof(struct hist_journal_record)))) {
+      perror("calloc");
+      free(journal);
+      return NULL;
+   }
+
+   if ((journal->fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600)) == -1 ||
+       ! (journal_fh = fdopen(dup(journal->fd), "r"))) {
+      perror(path);
+      if (journal->fd != -1)
+         close(journal->fd);
+      free(journal->records);
+      free(journal);
+      return NULL;
+   }
+
+   while (status && (line_len = getline(&line, &line_size, journal_fh)) != -1) {
+      torn = line[line_len - 1] != '\n';
+      if (! torn) {
+         line[line_len - 1] = 0;
+         status = add_record(journal, line);
+      }
+      ++n_lines;
+   }
+
+   // a run that was killed may have left a torn line behind
+   if (status && torn && ! opts->dry_run && write(journal->fd, "\n", 1) != 1) {
+      perror(path);
+      status = 0;
+   }
+
+   free(line);
+   fclose(journal_fh);
+
+   if (status && ! opts->dry_run && n_lines >= HIST_JOURNAL_COMPACT_LINES &&
+         n_lines > 2 * journal->used)
+      status = compact(journal, path);
+
+   if (! status) {
+      hist_journal_close(journal);
+      return NULL;
+   }
+
+   return journal;
+}
+
+/*
+ * Check if the merge of file1 and file2 (one of them may be NULL) into
+ * fileO has been finished by an earlier run and none of the files has
+ * changed since.
+ */
+int hist_journal_done
+ (
+   struct hist_journal *journal,
+   const char *file1,
+   const char *file2,
+   const char *fileO
+ )
+{
+   struct hist_journal_record *record = find_record(journal, fileO);
+   struct hist_journal_sig sig;
+
+   if (! record->paths || record->options != journal->options ||
+         strcmp(record->file2, file2 ? file2 : ""))
+      return 0;
+
+   // merging inplace, file1 may have been copied from file2 before,
+   // it is the output file then
+   if (file1 && ! strcmp(file1, fileO))
+      return (! *record->paths || ! strcmp(record->paths, file1)) &&
+             get_sig(file2, &sig) && eq_sig(&sig, &record->sig2) &&
+             get_sig(fileO, &sig) && eq_sig(&sig, &record->sigO);
+
+   if (strcmp(record->paths, file1 ? file1 : ""))
+      return 0;
+
+   return get_sig(file1, &sig) && eq_sig(&sig, &record->sig1) &&
+          get_sig(file2, &sig) && eq_sig(&sig, &record->sig2) &&
+          get_sig(fileO, &sig) && eq_sig(&sig, &record->sigO);
+}
+
+/*
+ * Record that the merge of file1 and file2 (one of them may be NULL)
+ * into fileO has been finished. May be called from several threads.
+ * Returns 1 on success or 0 on error.
+ */
+int hist_journal_add
+ (
+   struct hist_journal *journal,
+   const char *file1,
+   const char *file2,
+   const char *fileO
+ )
+{
+   struct hist_journal_record record;
+   struct hist_journal_sig *sigs[3] = { &record.sig1, &record.sig2, &record.sigO };
+   const char *paths[3] = { file1, file2, fileO };
+   char *line;
+   size_t len;
+
+   // such paths could not be read back, the file is merged again
+   for (int i = 0; i < 3; ++i)
+      if (paths[i] && strpbrk(paths[i], "\t\n"))
+         return 1;
+
+   for (int i = 0; i < 3; ++i) {
+      if (! get_sig(paths[i], sigs[i])) {
+         perror(paths[i]);
+         return 0;
+      }
+   }
+
+   record.paths = (char *) (file1 ? file1 : "");
+   record.file2 = file2 ? file2 : "";
+   record.fileO = fileO;
+   record.options = journal->options;
+
+   if (! (line = format_line(&record, &len)))
+      return 0;
+
+   // one write per line, so lines of several threads do not mix
+   pthread_mutex_lock(&journal->lock);
+   ssize_t written = write(journal->fd, line, len);
+   pthread_mutex_unlock(&journal->lock);
+
+   free(line);
+
+   if (written != (ssize_t) len) {
+      perror("journal");
+      return 0;
+   }
+
+   return 1;
+}
+
+/*
+ * Close journal and free all records
+ */
+void hist_journal_close
+ (
+   struct hist_journal *journal
+ )
+{
+   for (size_t i = 0; i < journal->size; ++i)
+      free(journal->records[i].paths);
+
+   close(journal->fd);
+   pthread_mutex_destroy(&journal->lock);
+   free(journal->records);
+   free(journal);
+}
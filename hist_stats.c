@@ -0,0 +1,590 @@
+/*
+ * libmcabberhist - message statistics over history files
+ * Copyright (C) 2016 Benjamin Abendroth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include "mcabberhist.h"
+
+/*
+ * Counts of one contact or day
+ */
+struct hist_stats_row
+{
+   // Contact (file path below the directory given) or day (YYYYMMDD),
+   // NULL for empty slots
+   char *key;
+
+   uint64_t sent;
+   uint64_t received;
+   uint64_t sent_bytes;
+   uint64_t received_bytes;
+
+   // Timestamp keys of the first and last entry
+   uint64_t first;
+   uint64_t last;
+};
+
+/*
+ * Open addressing hash table of rows, size is a power of two
+ */
+struct hist_stats_table
+{
+   struct hist_stats_row *rows;
+   size_t size;
+   size_t used;
+};
+
+/*
+ * Files to count, shared by all workers
+ */
+struct hist_stats_job
+{
+   char **paths;
+   size_t n_paths;
+
+   // Contact of every path: its name below the directory it was found
+   // in, so the same contact of two accounts stays apart
+   char **contacts;
+
+   // Next file to hand out
+   size_t next;
+   pthread_mutex_t lock;
+
+   const struct hist_options *opts;
+};
+
+/*
+ * Partial counts of one thread
+ */
+struct hist_stats_worker
+{
+   pthread_t thread;
+   struct hist_stats_job *job;
+
+   struct hist_stats_table contacts;
+   struct hist_stats_table days;
+   int status;
+};
+
+/*
+ * Hash function for row keys (FNV-1a)
+ */
+static uint64_t hash_key
+ (
+   const char *key,
+   size_t len
+ )
+{
+   uint64_t hash = 14695981039346656037ULL;
+
+   for (size_t i = 0; i < len; ++i) {
+      hash ^= (unsigned char) key[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return hash;
+}
+
+/*
+ * Double the hash table, or create it if it is empty.
+ * Returns 1 on success or 0 on error.
+ */
+static int grow_table
+ (
+   struct hist_stats_table *table
+ )
+{
+   size_t size = table->size ? table->size * 2 : 256;
+   struct hist_stats_row *rows = calloc(size, sizeof(struct hist_stats_row));
+   if (! rows) {
+      perror("calloc");
+      return 0;
+   }
+
+   for (size_t i = 0; i < table->size; ++i) {
+      struct hist_stats_row *row = &table->rows[i];
+      if (! row->key)
+         continue;
+
+      size_t j = hash_key(row->key, strlen(row->key)) & (size - 1);
+      while (rows[j].key)
+         j = (j + 1) & (size - 1);
+      rows[j] = *row;
+   }
+
+   free(table->rows);
+   table->rows = rows;
+   table->size = size;
+   return 1;
+}
+
+/*
+ * Find the row of key in table, adding an empty one if needed.
+ * Returns pointer to the row or NULL if failed.
+ */
+static struct hist_stats_row* find_row
+ (
+   struct hist_stats_table *table,
+   const char *key,
+   size_t len
+ )
+{
+   size_t i;
+
+   if (2 * (table->used + 1) > table->size && ! grow_table(table))
+      return NULL;
+
+   i = hash_key(key, len) & (table->size - 1);
+   for (; table->rows[i].key; i = (i + 1) & (table->size - 1))
+      if (! strncmp(table->rows[i].key, key, len) && ! table->rows[i].key[len])
+         return &table->rows[i];
+
+   if (! (table->rows[i].key = strndup(key, len))) {
+      perror("strndup");
+      return NULL;
+   }
+
+   table->rows[i].first = UINT64_MAX;
+   ++table->used;
+   return &table->rows[i];
+}
+
+/*
+ * Add the counts of src to row
+ */
+static void add_row
+ (
+   struct hist_stats_row *row,
+   const struct hist_stats_row *src
+ )
+{
+   row->sent += src->sent;
+   row->received += src->received;
+   row->sent_bytes += src->sent_bytes;
+   row->received_bytes += src->received_bytes;
+
+   if (src->first < row->first)
+      row->first = src->first;
+   if (src->last > row->last)
+      row->last = src->last;
+}
+
+/*
+ * Count entry into row
+ */
+static void count_entry
+ (
+   struct hist_stats_row *row,
+   const struct hist_entry *entry,
+   uint64_t key
+ )
+{
+   if (! strcmp(entry->type, "MS")) {
+      ++row->sent;
+      row->sent_bytes += entry->body_len;
+   }
+   else if (! strcmp(entry->type, "MR")) {
+      ++row->received;
+      row->received_bytes += entry->body_len;
+   }
+
+   if (key < row->first)
+      row->first = key;
+   if (key > row->last)
+      row->last = key;
+}
+
+/*
+ * Count all entries of the file at path into the tables of worker, as
+ * those of contact.
+ * Returns 1 on success or 0 on error.
+ */
+static int count_file
+ (
+   struct hist_stats_worker *worker,
+   const char *path,
+   const char *contact
+ )
+{
+   const struct hist_options *opts = worker->job->opts;
+   struct hist_stats_row file_row = { NULL, 0, 0, 0, 0, UINT64_MAX, 0 };
+   struct hist_stats_row *row;
+   struct hist_reader *reader;
+   struct hist_entry *entry;
+   int status = 1;
+
+   // no pool, bodies are only looked at once
+   if (! (reader = hist_reader_open(path, NULL)))
+      return 0;
+
+   hist_reader_set_types(reader, opts->types, opts->drop_types);
+
+   while (status && (entry = hist_reader_next(reader))) {
+      if (! entry->passthrough) {
+         uint64_t key = hist_timestamp_key(entry->timestamp);
+
+         count_entry(&file_row, entry, key);
+
+         if ((row = find_row(&worker->days, entry->timestamp, 8)))
+            count_entry(row, entry, key);
+         else
+            status = 0;
+      }
+
+      free_hist_entry(entry);
+   }
+
+   if (hist_reader_error(reader)) {
+      fprintf(stderr, "%s: Read error\n", path);
+      status = 0;
+   }
+   hist_reader_close(reader);
+
+   if (! (row = find_row(&worker->contacts, contact, strlen(contact))))
+      return 0;
+
+   add_row(row, &file_row);
+   return status;
+}
+
+/*
+ * Thread function, counts files until none are left
+ */
+static void* run_worker
+ (
+   void *arg
+ )
+{
+   struct hist_stats_worker *worker = arg;
+   struct hist_stats_job *job = worker->job;
+
+   for (;;) {
+      pthread_mutex_lock(&job->lock);
+      size_t i = job->next++;
+      pthread_mutex_unlock(&job->lock);
+
+      if (i >= job->n_paths)
+         break;
+
+      worker->status &= count_file(worker, job->paths[i], job->contacts[i]);
+   }
+
+   return NULL;
+}
+
+/*
+ * Add all rows of src to table.
+ * Returns 1 on success or 0 on error.
+ */
+static int merge_table
+ (
+   struct hist_stats_table *table,
+   const struct hist_stats_table *src
+ )
+{
+   struct hist_stats_row *row;
+
+   for (size_t i = 0; i < src->size; ++i) {
+      if (! src->rows[i].key)
+         continue;
+
+      if (! (row = find_row(table, src->rows[i].key, strlen(src->rows[i].key))))
+         return 0;
+
+      add_row(row, &src->rows[i]);
+   }
+
+   return 1;
+}
+
+/*
+ * Frees all rows of table
+ */
+static void free_table
+ (
+   struct hist_stats_table *table
+ )
+{
+   for (size_t i = 0; i < table->size; ++i)
+      free(table->rows[i].key);
+   free(table->rows);
+}
+
+/*
+ * Compare function for qsort on rows, empty slots go last
+ */
+static int cmp_row(const void *a, const void *b)
+{
+   const struct hist_stats_row *row_a = a;
+   const struct hist_stats_row *row_b = b;
+
+   if (! row_a->key || ! row_b->key)
+      return ! row_a->key - ! row_b->key;
+
+   return strcmp(row_a->key, row_b->key);
+}
+
+/*
+ * Print a timestamp key like the timestamps of history files
+ */
+static void print_key
+ (
+   FILE *out_stream,
+   uint64_t key
+ )
+{
+   char digits[21];
+
+   snprintf(digits, sizeof(digits), "%014llu", (unsigned long long) key);
+   fprintf(out_stream, "%.8sT%.2s:%.2s:%.2sZ", digits, digits + 8, digits + 10, digits + 12);
+}
+
+/*
+ * Print all rows of table sorted by key, below a header line
+ */
+static void print_table
+ (
+   FILE *out_stream,
+   const char *title,
+   struct hist_stats_table *table
+ )
+{
+   qsort(table->rows, table->size, sizeof(struct hist_stats_row), cmp_row);
+
+   fprintf(out_stream, "%s\tsent\treceived\tsent_bytes\treceived_bytes\tfirst\tlast\n", title);
+
+   for (size_t i = 0; i < table->used; ++i) {
+      struct hist_stats_row *row = &table->rows[i];
+
+      fprintf(out_stream, "%s\t%llu\t%llu\t%llu\t%llu\t", row->key,
+         (unsigned long long) row->sent, (unsigned long long) row->received,
+         (unsigned long long) row->sent_bytes, (unsigned long long) row->received_bytes);
+
+      if (row->last) {
+         print_key(out_stream, row->first);
+         fputc('\t', out_stream);
+         print_key(out_stream, row->last);
+      }
+      else {
+         fputs("-\t-", out_stream);
+      }
+      fputc('\n', out_stream);
+   }
+}
+
+/*
+ * Add path to the list of files to count, as the file of contact
+ * Returns 1 on success or 0 on error.
+ */
+static int add_path
+ (
+   struct hist_stats_job *job,
+   size_t *size,
+   const char *path,
+   const char *contact
+ )
+{
+   if (job->n_paths == *size) {
+      size_t new_size = *size ? *size * 2 : 64;
+      char **paths = realloc(job->paths, new_size * sizeof(char *));
+      if (! paths) {
+         perror("realloc");
+         return 0;
+      }
+      job->paths = paths;
+
+      char **contacts = realloc(job->contacts, new_size * sizeof(char *));
+      if (! contacts) {
+         perror("realloc");
+         return 0;
+      }
+      job->contacts = contacts;
+      *size = new_size;
+   }
+
+   if (! (job->paths[job->n_paths] = strdup(path))) {
+      perror("strdup");
+      return 0;
+   }
+
+   if (! (job->contacts[job->n_paths] = strdup(contact))) {
+      perror("strdup");
+      free(job->paths[job->n_paths]);
+      return 0;
+   }
+
+   ++job->n_paths;
+   return 1;
+}
+
+/*
+ * Job and capacity of its paths while collecting files
+ */
+struct hist_stats_collect
+{
+   struct hist_stats_job *job;
+   size_t *size;
+};
+
+/*
+ * hist_walk() callback adding every file of a directory tree
+ */
+static int collect_file
+ (
+   const char *path,
+   const char *name,
+   int is_dir,
+   void *arg
+ )
+{
+   struct hist_stats_collect *collect = arg;
+
+   if (is_dir)
+      return 1;
+
+   return add_path(collect->job, collect->size, path, name) ? 1 : -1;
+}
+
+/*
+ * Collect path, or all files below it if it is a directory.
+ * Returns 1 on success or 0 on error.
+ */
+static int collect_path
+ (
+   struct hist_stats_job *job,
+   size_t *size,
+   const char *path
+ )
+{
+   struct hist_stats_collect collect = { job, size };
+   struct stat statbuf;
+
+   if (stat(path, &statbuf) == -1) {
+      perror(path);
+      return 0;
+   }
+
+   // a single file is a contact of its own
+   if (! S_ISDIR(statbuf.st_mode)) {
+      const char *contact = strrchr(path, '/');
+      return add_path(job, size, path, contact ? contact + 1 : path);
+   }
+
+   return hist_walk(path, collect_file, &collect);
+}
+
+/*
+ * Count sent and received messages, their bytes and the first and last
+ * timestamp per contact and per day over all files in paths (files or
+ * directory trees) and print them to out_stream.
+ * Files are read by opts->jobs threads in parallel, each one counting
+ * into its own tables, which are combined at the end.
+ * Returns 1 on success, 0 on failure.
+ */
+int hist_stats
+ (
+   const char **paths,
+   int n_paths,
+   const struct hist_options *opts,
+   FILE *out_stream
+ )
+{
+   struct hist_stats_job job = { NULL, 0, NULL, 0, PTHREAD_MUTEX_INITIALIZER, NULL };
+   struct hist_stats_worker *workers;
+   struct hist_options default_opts;
+   size_t size = 0;
+   int n_workers;
+   int status = 1;
+
+   if (! opts) {
+      hist_options_init(&default_opts);
+      opts = &default_opts;
+   }
+   job.opts = opts;
+
+   for (int i = 0; status && i < n_paths; ++i)
+      status = collect_path(&job, &size, paths[i]);
+
+   n_workers = opts->jobs > 0 ? opts->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+   if (n_workers < 1)
+      n_workers = 1;
+   if ((size_t) n_workers > job.n_paths)
+      n_workers = job.n_paths ? job.n_paths : 1;
+
+   if (! status || ! (workers = calloc(n_workers, sizeof(struct hist_stats_worker)))) {
+      if (status)
+         perror("calloc");
+      for (size_t i = 0; i < job.n_paths; ++i) {
+         free(job.paths[i]);
+         free(job.contacts[i]);
+      }
+      free(job.paths);
+      free(job.contacts);
+      return 0;
+   }
+
+   for (int i = 0; i < n_workers; ++i) {
+      workers[i].job = &job;
+      workers[i].status = 1;
+
+      // the first worker runs in this thread
+      if (i && pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+         perror("pthread_create");
+         n_workers = i;
+         break;
+      }
+   }
+
+   run_worker(&workers[0]);
+
+   for (int i = 0; i < n_workers; ++i) {
+      if (i)
+         pthread_join(workers[i].thread, NULL);
+
+      status &= workers[i].status;
+      if (i) {
+         status &= merge_table(&workers[0].contacts, &workers[i].contacts);
+         status &= merge_table(&workers[0].days, &workers[i].days);
+         free_table(&workers[i].contacts);
+         free_table(&workers[i].days);
+      }
+   }
+
+   print_table(out_stream, "contact", &workers[0].contacts);
+   fputc('\n', out_stream);
+   print_table(out_stream, "day", &workers[0].days);
+
+   free_table(&workers[0].contacts);
+   free_table(&workers[0].days);
+   free(workers);
+   for (size_t i = 0; i < job.n_paths; ++i) {
+      free(job.paths[i]);
+      free(job.contacts[i]);
+   }
+   free(job.paths);
+   free(job.contacts);
+
+   return status;
+}
@@ -0,0 +1,1306 @@
+/*
+ * libmcabberhist - sync of two history trees over a byte stream
+ * Copyright (C) 2016 Benjamin Abendroth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "mcabberhist.h"
+
+/*
+ * Both sides walk their tree and take turns on the stream, the client
+ * (the side that started the sync) writes every phase first:
+ *
+ *   hello      protocol version
+ *   summaries  path and digest of every file, then end
+ *   chunks     chunk hashes of every file both sides have with
+ *              different digests, then end
+ *   data       entries of the chunks the other side lacks as text,
+ *              files it does not have at all, then end
+ *   status     server only, once it has merged what it received
+ *
+ * The sorted entries of a file are cut into chunks behind every entry
+ * whose hash has its top HIST_SYNC_CHUNK_BITS bits clear, so entries
+ * added anywhere only change the chunks around them. Data is only
+ * merged after it was sent, so a side sends its files as they were.
+ *
+ * A message is a type byte, the payload length (4 bytes, big endian)
+ * and the payload. Numbers in payloads are big endian, too.
+ */
+
+#define HIST_SYNC_VERSION "mcabberhist-sync 1"
+
+// Chunks hold 2^HIST_SYNC_CHUNK_BITS entries on average
+#define HIST_SYNC_CHUNK_BITS 6
+
+// Longest message accepted, data is sent in messages of at most
+// HIST_SYNC_DATA_SIZE bytes of entries
+#define HIST_SYNC_MAX_MESSAGE (64 * 1024 * 1024)
+#define HIST_SYNC_DATA_SIZE (1024 * 1024)
+
+// Message types
+#define HIST_SYNC_HELLO 'H'
+#define HIST_SYNC_SUMMARY 'F'
+#define HIST_SYNC_CHUNKS 'C'
+#define HIST_SYNC_DATA 'D'
+#define HIST_SYNC_END 'E'
+#define HIST_SYNC_STATUS 'S'
+
+/*
+ * File of the local tree
+ */
+struct hist_sync_file
+{
+   // Path relative to the tree
+   char *path;
+
+   // Hash of all chunk hashes, and the chunk hashes in order
+   uint64_t digest;
+   uint64_t *chunks;
+   size_t n_chunks;
+
+   // Digest of the file on the other side, if it has it
+   int peer_has;
+   uint64_t peer_digest;
+
+   // Sorted chunk hashes of the other side if the digests differ
+   uint64_t *peer_chunks;
+   size_t n_peer_chunks;
+};
+
+/*
+ * Entry of a local file with its hash
+ */
+struct hist_sync_entry
+{
+   struct hist_entry *entry;
+   uint64_t hash;
+};
+
+/*
+ * Entries received for a file, collected in a temporary file next to it
+ */
+struct hist_sync_incoming
+{
+   char *path;
+   char *temp;
+};
+
+/*
+ * One side of a sync
+ */
+struct hist_sync
+{
+   const char *root;
+   FILE *in;
+   FILE *out;
+
+   // Reading and merging, without filters
+   struct hist_options opts;
+
+   // Files of the local tree, sorted by path
+   struct hist_sync_file *files;
+   size_t n_files;
+   size_t files_size;
+
+   struct hist_sync_incoming *incoming;
+   size_t n_incoming;
+   size_t incoming_size;
+   FILE *incoming_fh;
+
+   // Last received message
+   int type;
+   char *buf;
+   size_t len;
+   size_t buf_size;
+
+   uint64_t sent;
+   uint64_t received;
+
+   // Cleared when a file could not be synced
+   int status;
+};
+
+/*
+ * Continue an FNV-1a hash over len bytes of data
+ */
+static uint64_t hash_bytes
+ (
+   uint64_t hash,
+   const void *data,
+   size_t len
+ )
+{
+   for (size_t i = 0; i < len; ++i) {
+      hash ^= ((const unsigned char *) data)[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return hash;
+}
+
+/*
+ * Hash all fields of entry
+ */
+static uint64_t hash_entry
+ (
+   const struct hist_entry *entry
+ )
+{
+   uint64_t hash = 14695981039346656037ULL;
+
+   hash = hash_bytes(hash, entry->type, strlen(entry->type) + 1);
+   hash = hash_bytes(hash, entry->timestamp, strlen(entry->timestamp) + 1);
+   hash = hash_bytes(hash, entry->follow_lines, strlen(entry->follow_lines) + 1);
+   hash = hash_bytes(hash, &entry->passthrough, sizeof(entry->passthrough));
+   return hash_bytes(hash, hist_entry_body(entry), entry->body_len);
+}
+
+/*
+ * Find the end of the chunk of entries starting at start and its hash.
+ * Returns the index behind the last entry of the chunk.
+ */
+static int next_chunk
+ (
+   const struct hist_sync_entry *entries,
+   int n_entries,
+   int start,
+   uint64_t *hash
+ )
+{
+   *hash = 14695981039346656037ULL;
+
+   while (start < n_entries) {
+      uint64_t entry_hash = entries[start++].hash;
+
+      *hash = hash_bytes(*hash, &entry_hash, sizeof(entry_hash));
+      if (! (entry_hash >> (64 - HIST_SYNC_CHUNK_BITS)))
+         break;
+   }
+
+   return start;
+}
+
+/*
+ * Store v big endian at buf
+ */
+static void put_u64
+ (
+   unsigned char *buf,
+   uint64_t v
+ )
+{
+   for (int i = 7; i >= 0; --i, v >>= 8)
+      buf[i] = v & 0xff;
+}
+
+/*
+ * Get a big endian number at buf
+ */
+static uint64_t get_u64
+ (
+   const unsigned char *buf
+ )
+{
+   uint64_t v = 0;
+
+   for (int i = 0; i < 8; ++i)
+      v = (v << 8) | buf[i];
+
+   return v;
+}
+
+/*
+ * Compare function for qsort and bsearch on chunk hashes
+ */
+static int cmp_hash(const void *a, const void *b)
+{
+   uint64_t hash_a = *(const uint64_t *) a, hash_b = *(const uint64_t *) b;
+
+   return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+/*
+ * Compare function for qsort on entries by timestamp, then hash
+ */
+static int cmp_sync_entry(const void *a, const void *b)
+{
+   const struct hist_sync_entry *entry_a = a, *entry_b = b;
+   int ts_cmp = strcmp(entry_a->entry->timestamp, entry_b->entry->timestamp);
+
+   if (ts_cmp)
+      return ts_cmp;
+   return cmp_hash(&entry_a->hash, &entry_b->hash);
+}
+
+/*
+ * Compare function for qsort and bsearch on files by path
+ */
+static int cmp_sync_file(const void *a, const void *b)
+{
+   return strcmp(((const struct hist_sync_file *) a)->path,
+                 ((const struct hist_sync_file *) b)->path);
+}
+
+/*
+ * Check if path, received from the other side, stays inside the tree:
+ * relative, no empty, hidden, "." or ".." components
+ */
+static int valid_path
+ (
+   const char *path
+ )
+{
+   const char *component = path;
+
+   for (;;) {
+      const char *end = strchr(component, '/');
+
+      if (! end)
+         end = component + strlen(component);
+
+      if (end == component || *component == '.')
+         return 0;
+      if (! *end)
+         return 1;
+
+      component = end + 1;
+   }
+}
+
+/*
+ * Join the tree and a relative path.
+ * Returns the allocated path or NULL if failed.
+ */
+static char* tree_path
+ (
+   const char *root,
+   const char *path
+ )
+{
+   char *full = malloc(strlen(root) + 1 + strlen(path) + 1);
+
+   if (! full) {
+      perror("malloc");
+      return NULL;
+   }
+
+   sprintf(full, "%s/%s", root, path);
+   return full;
+}
+
+/*
+ * Send a message of type with payload part1 followed by part2
+ * Returns 1 on success, 0 on failure.
+ */
+static int send_message
+ (
+   struct hist_sync *sync,
+   int type,
+   const void *part1,
+   size_t len1,
+   const void *part2,
+   size_t len2
+ )
+{
+   size_t len = len1 + len2;
+   unsigned char header[5] = { type, len >> 24, len >> 16, len >> 8, len };
+
+   if (fwrite(header, sizeof(header), 1, sync->out) != 1 ||
+         (len1 && fwrite(part1, len1, 1, sync->out) != 1) ||
+         (len2 && fwrite(part2, len2, 1, sync->out) != 1)) {
+      perror("sync");
+      return 0;
+   }
+
+   sync->sent += sizeof(header) + len;
+   return 1;
+}
+
+/*
+ * Send the end of a phase and hand the stream to the other side
+ * Returns 1 on success, 0 on failure.
+ */
+static int send_end
+ (
+   struct hist_sync *sync
+ )
+{
+   if (! send_message(sync, HIST_SYNC_END, NULL, 0, NULL, 0))
+      return 0;
+
+   if (fflush(sync->out) == EOF) {
+      perror("sync");
+      return 0;
+   }
+
+   return 1;
+}
+
+/*
+ * Receive the next message into sync->type, sync->buf and sync->len
+ * Returns 1 on success, 0 on failure.
+ */
+static int recv_message
+ (
+   struct hist_sync *sync
+ )
+{
+   unsigned char header[5];
+   size_t len;
+
+   if (fread(header, sizeof(header), 1, sync->in) != 1) {
+      warnx("sync: Connection closed by the other side");
+      return 0;
+   }
+
+   len = (size_t) header[1] << 24 | header[2] << 16 | header[3] << 8 | header[4];
+   if (len > HIST_SYNC_MAX_MESSAGE) {
+      warnx("sync: Message too long");
+      return 0;
+   }
+
+   // one more for a terminating null byte
+   if (len + 1 > sync->buf_size) {
+      char *buf = realloc(sync->buf, len + 1);
+      if (! buf) {
+         perror("realloc");
+         return 0;
+      }
+      sync->buf = buf;
+      sync->buf_size = len + 1;
+   }
+
+   if (len && fread(sync->buf, len, 1, sync->in) != 1) {
+      warnx("sync: Connection closed by the other side");
+      return 0;
+   }
+
+   sync->buf[len] = 0;
+   sync->type = header[0];
+   sync->len = len;
+   sync->received += sizeof(header) + len;
+   return 1;
+}
+
+/*
+ * Receive a message that has to be of type
+ * Returns 1 on success, 0 on failure.
+ */
+static int expect_message
+ (
+   struct hist_sync *sync,
+   int type
+ )
+{
+   if (! recv_message(sync))
+      return 0;
+
+   if (sync->type != type) {
+      warnx("sync: Unexpected message '%c'", sync->type);
+      return 0;
+   }
+
+   return 1;
+}
+
+/*
+ * Check the protocol version in the hello message of the other side
+ */
+static int check_version
+ (
+   struct hist_sync *sync
+ )
+{
+   if (strcmp(sync->buf, HIST_SYNC_VERSION)) {
+      warnx("sync: The other side speaks '%s', not '%s'", sync->buf, HIST_SYNC_VERSION);
+      return 0;
+   }
+
+   return 1;
+}
+
+/*
+ * Get the path at the start of the payload of the last message, ended
+ * by a null byte, and the data behind it.
+ * Returns the path or NULL if the message is malformed.
+ */
+static const char* message_path
+ (
+   struct hist_sync *sync,
+   const char **data,
+   size_t *len
+ )
+{
+   size_t path_len = strnlen(sync->buf, sync->len);
+
+   if (path_len == sync->len || ! valid_path(sync->buf)) {
+      warnx("sync: Malformed path");
+      return NULL;
+   }
+
+   *data = sync->buf + path_len + 1;
+   *len = sync->len - path_len - 1;
+   return sync->buf;
+}
+
+/*
+ * Find the local file with path
+ */
+static struct hist_sync_file* find_file
+ (
+   struct hist_sync *sync,
+   const char *path
+ )
+{
+   struct hist_sync_file key = { (char *) path };
+
+   return bsearch(&key, sync->files, sync->n_files, sizeof(struct hist_sync_file),
+                  cmp_sync_file);
+}
+
+/*
+ * Read the entries of the local file at path. sorted gets the n_sorted
+ * distinct ones in an order both sides agree on for the same entries: by
+ * timestamp, entries of the same time by hash. sorted is to be freed.
+ * Returns the entries as read or NULL if failed.
+ */
+static struct hist_entry** read_file
+ (
+   struct hist_sync *sync,
+   const char *path,
+   struct hist_pool *pool,
+   int *n_entries,
+   struct hist_sync_entry **sorted,
+   int *n_sorted
+ )
+{
+   char *full = tree_path(sync->root, path);
+   struct hist_entry **entries;
+
+   if (! full)
+      return NULL;
+
+   entries = read_hist_file(full, pool, &sync->opts, n_entries, NULL, NULL);
+   free(full);
+
+   if (! entries)
+      return NULL;
+
+   if (! (*sorted = malloc((*n_entries ? *n_entries : 1) * sizeof(struct hist_sync_entry)))) {
+      perror("malloc");
+      free_hist_entries(entries, *n_entries);
+      return NULL;
+   }
+
+   for (int i = 0; i < *n_entries; ++i) {
+      (*sorted)[i].entry = entries[i];
+      (*sorted)[i].hash = hash_entry(entries[i]);
+   }
+   qsort(*sorted, *n_entries, sizeof(struct hist_sync_entry), cmp_sync_entry);
+
+   // a file repeating an entry has the same entries as one that does not
+   *n_sorted = 0;
+   for (int i = 0; i < *n_entries; ++i)
+      if (! *n_sorted || cmp_sync_entry(&(*sorted)[*n_sorted - 1], &(*sorted)[i]))
+         (*sorted)[(*n_sorted)++] = (*sorted)[i];
+
+   return entries;
+}
+
+/*
+ * Compute the chunk hashes and the digest of file.
+ * Returns 1 on success, 0 on failure.
+ */
+static int scan_file
+ (
+   struct hist_sync *sync,
+   struct hist_sync_file *file
+ )
+{
+   struct hist_pool *pool;
+   struct hist_entry **entries;
+   struct hist_sync_entry *sorted;
+   int n_entries, n_sorted;
+
+   if (! (pool = hist_pool_new()))
+      return 0;
+
+   if (! (entries = read_file(sync, file->path, pool, &n_entries, &sorted, &n_sorted))) {
+      hist_pool_free(pool);
+      return 0;
+   }
+
+   // at most one chunk per entry
+   if (! (file->chunks = malloc((n_sorted ? n_sorted : 1) * sizeof(uint64_t)))) {
+      perror("malloc");
+      free(sorted);
+      free_hist_entries(entries, n_entries);
+      hist_pool_free(pool);
+      return 0;
+   }
+
+   file->digest = 14695981039346656037ULL;
+   for (int i = 0; i < n_sorted; ) {
+      i = next_chunk(sorted, n_sorted, i, &file->chunks[file->n_chunks]);
+      file->digest = hash_bytes(file->digest, &file->chunks[file->n_chunks++], sizeof(uint64_t));
+   }
+
+   free(sorted);
+   free_hist_entries(entries, n_entries);
+   hist_pool_free(pool);
+   return 1;
+}
+
+/*
+ * hist_walk() callback adding every file of the tree to sync. Hidden
+ * files and directories (temporary files) are left out.
+ */
+static int collect_file
+ (
+   const char *path,
+   const char *name,
+   int is_dir,
+   void *arg
+ )
+{
+   struct hist_sync *sync = arg;
+   const char *base = strrchr(name, '/');
+
+   if ((base ? base + 1 : name)[0] == '.')
+      return 0;
+
+   if (is_dir)
+      return 1;
+
+   if (sync->n_files == sync->files_size) {
+      size_t size = sync->files_size ? sync->files_size * 2 : 64;
+      struct hist_sync_file *files = realloc(sync->files, size * sizeof(struct hist_sync_file));
+      if (! files) {
+         perror("realloc");
+         return -1;
+      }
+      sync->files = files;
+      sync->files_size = size;
+   }
+
+   memset(&sync->files[sync->n_files], 0, sizeof(struct hist_sync_file));
+   if (! (sync->files[sync->n_files].path = strdup(name))) {
+      perror("strdup");
+      return -1;
+   }
+
+   ++sync->n_files;
+   return 1;
+}
+
+/*
+ * Walk the local tree and compute the chunks of every file. Files that
+ * can not be read are left out of the sync.
+ * Returns 1 on success, 0 on failure.
+ */
+static int scan_tree
+ (
+   struct hist_sync *sync
+ )
+{
+   size_t kept = 0;
+
+   if (! hist_walk(sync->root, collect_file, sync))
+      return 0;
+
+   for (size_t i = 0; i < sync->n_files; ++i) {
+      if (scan_file(sync, &sync->files[i])) {
+         sync->files[kept++] = sync->files[i];
+      }
+      else {
+         warnx("%s/%s: Not synced", sync->root, sync->files[i].path);
+         free(sync->files[i].path);
+         free(sync->files[i].chunks);
+         sync->status = 0;
+      }
+   }
+   sync->n_files = kept;
+
+   qsort(sync->files, sync->n_files, sizeof(struct hist_sync_file), cmp_sync_file);
+   return 1;
+}
+
+/*
+ * Send path and digest of every local file
+ * Returns 1 on success, 0 on failure.
+ */
+static int send_summaries
+ (
+   struct hist_sync *sync
+ )
+{
+   unsigned char digest[8];
+
+   for (size_t i = 0; i < sync->n_files; ++i) {
+      put_u64(digest, sync->files[i].digest);
+      if (! send_message(sync, HIST_SYNC_SUMMARY, digest, sizeof(digest),
+                         sync->files[i].path, strlen(sync->files[i].path)))
+         return 0;
+   }
+
+   return send_end(sync);
+}
+
+/*
+ * Receive the summaries of the other side and note which local files
+ * it has, with which digest
+ * Returns 1 on success, 0 on failure.
+ */
+static int recv_summaries
+ (
+   struct hist_sync *sync
+ )
+{
+   struct hist_sync_file *file;
+
+   while (recv_message(sync)) {
+      if (sync->type == HIST_SYNC_END)
+         return 1;
+
+      if (sync->type != HIST_SYNC_SUMMARY || sync->len < 8 ||
+            strlen(sync->buf + 8) != sync->len - 8 || ! valid_path(sync->buf + 8)) {
+         warnx("sync: Malformed summary");
+         return 0;
+      }
+
+      if ((file = find_file(sync, sync->buf + 8))) {
+         file->peer_has = 1;
+         file->peer_digest = get_u64((unsigned char *) sync->buf);
+      }
+   }
+
+   return 0;
+}
+
+/*
+ * Check if file exists on both sides with different entries
+ */
+static int differs
+ (
+   const struct hist_sync_file *file
+ )
+{
+   return file->peer_has && file->peer_digest != file->digest;
+}
+
+/*
+ * Send the chunk hashes of every file that differs
+ * Returns 1 on success, 0 on failure.
+ */
+static int send_chunks
+ (
+   struct hist_sync *sync
+ )
+{
+   for (size_t i = 0; i < sync->n_files; ++i) {
+      struct hist_sync_file *file = &sync->files[i];
+      unsigned char *hashes;
+      int status;
+
+      if (! differs(file))
+         continue;
+
+      if (! (hashes = malloc((file->n_chunks ? file->n_chunks : 1) * 8))) {
+         perror("malloc");
+         return 0;
+      }
+
+      for (size_t j = 0; j < file->n_chunks; ++j)
+         put_u64(hashes + 8 * j, file->chunks[j]);
+
+      status = send_message(sync, HIST_SYNC_CHUNKS, file->path, strlen(file->path) + 1,
+                            hashes, file->n_chunks * 8);
+      free(hashes);
+
+      if (! status)
+         return 0;
+   }
+
+   return send_end(sync);
+}
+
+/*
+ * Receive the chunk hashes of the files that differ
+ * Returns 1 on success, 0 on failure.
+ */
+static int recv_chunks
+ (
+   struct hist_sync *sync
+ )
+{
+   struct hist_sync_file *file;
+   const char *path, *data;
+   size_t len;
+
+   while (recv_message(sync)) {
+      if (sync->type == HIST_SYNC_END)
+         return 1;
+
+      if (sync->type != HIST_SYNC_CHUNKS || ! (path = message_path(sync, &data, &len)))
+         return 0;
+
+      if (! (file = find_file(sync, path)) || ! differs(file) || file->peer_chunks ||
+            len % 8) {
+         warnx("sync: Unexpected chunks of %s", path);
+         return 0;
+      }
+
+      file->n_peer_chunks = len / 8;
+      if (! (file->peer_chunks = malloc((len ? len / 8 : 1) * sizeof(uint64_t)))) {
+         perror("malloc");
+         return 0;
+      }
+
+      for (size_t i = 0; i < file->n_peer_chunks; ++i)
+         file->peer_chunks[i] = get_u64((const unsigned char *) data + 8 * i);
+      qsort(file->peer_chunks, file->n_peer_chunks, sizeof(uint64_t), cmp_hash);
+   }
+
+   return 0;
+}
+
+/*
+ * Send the entries of file the other side lacks: all of them if it does
+ * not have the file, else those of the chunks it does not have.
+ * Returns 1 on success, 0 on failure, -1 if the file can not be read.
+ */
+static int send_file
+ (
+   struct hist_sync *sync,
+   struct hist_sync_file *file
+ )
+{
+   struct hist_pool *pool;
+   struct hist_entry **entries;
+   struct hist_sync_entry *sorted;
+   int n_entries, n_sorted;
+   char *data = NULL;
+   size_t len = 0;
+   FILE *data_fh;
+   int status = 1;
+
+   if (! (pool = hist_pool_new()))
+      return 0;
+
+   if (! (entries = read_file(sync, file->path, pool, &n_entries, &sorted, &n_sorted))) {
+      hist_pool_free(pool);
+      return -1;
+   }
+
+   if (! (data_fh = open_memstream(&data, &len))) {
+      perror("open_memstream");
+      free(sorted);
+      free_hist_entries(entries, n_entries);
+      hist_pool_free(pool);
+      return 0;
+   }
+
+   for (int start = 0, end; start < n_sorted; start = end) {
+      uint64_t hash;
+
+      end = next_chunk(sorted, n_sorted, start, &hash);
+
+      if (file->peer_has &&
+            bsearch(&hash, file->peer_chunks, file->n_peer_chunks, sizeof(uint64_t), cmp_hash))
+         continue;
+
+      for (int i = start; i < end; ++i)
+         write_entry(sorted[i].entry, data_fh);
+   }
+
+   if (fclose(data_fh) == EOF) {
+      perror("open_memstream");
+      status = 0;
+   }
+
+   if (status && sync->opts.verbose && len)
+      printf("Sending: %s (%zu bytes)\n", file->path, len);
+
+   for (size_t sent = 0; status && sent < len; sent += HIST_SYNC_DATA_SIZE)
+      status = send_message(sync, HIST_SYNC_DATA, file->path, strlen(file->path) + 1,
+                            data + sent, len - sent < HIST_SYNC_DATA_SIZE ? len - sent
+                                                                         : HIST_SYNC_DATA_SIZE);
+
+   free(data);
+   free(sorted);
+   free_hist_entries(entries, n_entries);
+   hist_pool_free(pool);
+   return status;
+}
+
+/*
+ * Send the entries the other side lacks of all files
+ * Returns 1 on success, 0 on failure.
+ */
+static int send_data
+ (
+   struct hist_sync *sync
+ )
+{
+   for (size_t i = 0; i < sync->n_files; ++i) {
+      struct hist_sync_file *file = &sync->files[i];
+      int status;
+
+      if (file->peer_has && ! differs(file))
+         continue;
+
+      // changed since it was scanned, the rest goes on
+      if ((status = send_file(sync, file)) == -1) {
+         warnx("%s/%s: Not synced", sync->root, file->path);
+         sync->status = 0;
+      }
+      else if (! status) {
+         return 0;
+      }
+   }
+
+   return send_end(sync);
+}
+
+/*
+ * Create the missing parent directories of path in the tree
+ * Returns 1 on success, 0 on failure.
+ */
+static int make_parents
+ (
+   const char *root,
+   const char *path
+ )
+{
+   char *full = tree_path(root, path);
+   int status = 1;
+
+   if (! full)
+      return 0;
+
+   for (char *slash = full + strlen(root) + 1; status && (slash = strchr(slash, '/')); ++slash) {
+      *slash = 0;
+      if (mkdir(full, 0700) == -1 && errno != EEXIST) {
+         perror(full);
+         status = 0;
+      }
+      *slash = '/';
+   }
+
+   free(full);
+   return status;
+}
+
+/*
+ * Start collecting the received entries of path in a new temporary
+ * file next to it
+ * Returns 1 on success, 0 on failure.
+ */
+static int add_incoming
+ (
+   struct hist_sync *sync,
+   const char *path
+ )
+{
+   struct hist_sync_incoming *incoming;
+   const char *name = strrchr(path, '/');
+   int fd;
+
+   if (sync->n_incoming == sync->incoming_size) {
+      size_t size = sync->incoming_size ? sync->incoming_size * 2 : 64;
+      struct hist_sync_incoming *new_incoming =
+         realloc(sync->incoming, size * sizeof(struct hist_sync_incoming));
+      if (! new_incoming) {
+         perror("realloc");
+         return 0;
+      }
+      sync->incoming = new_incoming;
+      sync->incoming_size = size;
+   }
+
+   if (! make_parents(sync->root, path))
+      return 0;
+
+   incoming = &sync->incoming[sync->n_incoming];
+   incoming->path = strdup(path);
+   incoming->temp = malloc(strlen(sync->root) + strlen(path) + sizeof("/.sync.XXXXXX") + 1);
+   if (! incoming->path || ! incoming->temp) {
+      perror("malloc");
+      free(incoming->path);
+      free(incoming->temp);
+      return 0;
+   }
+
+   // hidden, so it is not synced itself
+   name = name ? name + 1 : path;
+   sprintf(incoming->temp, "%s/%.*s.%s.sync.XXXXXX", sync->root, (int) (name - path), path, name);
+
+   if ((fd = mkstemp(incoming->temp)) == -1 || ! (sync->incoming_fh = fdopen(fd, "w"))) {
+      perror(incoming->temp);
+      if (fd != -1) {
+         close(fd);
+         unlink(incoming->temp);
+      }
+      free(incoming->path);
+      free(incoming->temp);
+      return 0;
+   }
+
+   ++sync->n_incoming;
+   return 1;
+}
+
+/*
+ * Finish the temporary file received entries are written to
+ * Returns 1 on success, 0 on failure.
+ */
+static int close_incoming
+ (
+   struct hist_sync *sync
+ )
+{
+   int status = 1;
+
+   if (sync->incoming_fh && fclose(sync->incoming_fh) == EOF) {
+      perror(sync->incoming[sync->n_incoming - 1].temp);
+      status = 0;
+   }
+
+   sync->incoming_fh = NULL;
+   return status;
+}
+
+/*
+ * Receive the entries the other side sends into temporary files
+ * Returns 1 on success, 0 on failure.
+ */
+static int recv_data
+ (
+   struct hist_sync *sync
+ )
+{
+   struct hist_sync_incoming *last;
+   const char *path, *data;
+   size_t len;
+
+   while (recv_message(sync)) {
+      if (sync->type == HIST_SYNC_END)
+         return close_incoming(sync);
+
+      if (sync->type != HIST_SYNC_DATA || ! (path = message_path(sync, &data, &len)))
+         return 0;
+
+      // the entries of a file come in a row
+      last = sync->n_incoming ? &sync->incoming[sync->n_incoming - 1] : NULL;
+      if (! last || ! sync->incoming_fh || strcmp(last->path, path)) {
+         if (! close_incoming(sync) || ! add_incoming(sync, path))
+            return 0;
+         last = &sync->incoming[sync->n_incoming - 1];
+      }
+
+      if (fwrite(data, 1, len, sync->incoming_fh) != len) {
+         perror(last->temp);
+         return 0;
+      }
+   }
+
+   return 0;
+}
+
+/*
+ * Drop the received entries of incoming that the local file at full
+ * (NULL if there is none) has already, wherever they are in it. Chunks
+ * hold more than the missing entries and the merge only skips entries
+ * equal to the one of the same time it is at.
+ * Returns the count of entries left or -1 if failed.
+ */
+static int filter_incoming
+ (
+   struct hist_sync *sync,
+   struct hist_sync_incoming *incoming,
+   const char *full
+ )
+{
+   struct hist_pool *pool;
+   struct hist_reader *reader;
+   struct hist_entry **local = NULL, **received = NULL;
+   uint64_t *hashes = NULL;
+   int n_local = 0, n_received = 0, n_kept = -1;
+   FILE *temp_fh;
+
+   if (! (pool = hist_pool_new()))
+      return -1;
+
+   // the temporary file is read without the cache
+   if ((reader = hist_reader_open(incoming->temp, pool))) {
+      received = read_hist(reader, &n_received);
+      hist_reader_close(reader);
+   }
+
+   if (! received ||
+         (full && ! (local = read_hist_file(full, pool, &sync->opts, &n_local, NULL, NULL))) ||
+         ! (hashes = malloc((n_local ? n_local : 1) * sizeof(uint64_t))))
+      goto out;
+
+   for (int i = 0; i < n_local; ++i)
+      hashes[i] = hash_entry(local[i]);
+   qsort(hashes, n_local, sizeof(uint64_t), cmp_hash);
+
+   if (! (temp_fh = fopen(incoming->temp, "w"))) {
+      perror(incoming->temp);
+      goto out;
+   }
+
+   n_kept = 0;
+   for (int i = 0; i < n_received; ++i) {
+      uint64_t hash = hash_entry(received[i]);
+
+      if (! bsearch(&hash, hashes, n_local, sizeof(uint64_t), cmp_hash)) {
+         write_entry(received[i], temp_fh);
+         ++n_kept;
+      }
+   }
+
+   if (ferror(temp_fh) | (fclose(temp_fh) == EOF)) {
+      perror(incoming->temp);
+      n_kept = -1;
+   }
+
+out:
+   if (n_kept == -1)
+      warnx("%s/%s: Received entries not merged", sync->root, incoming->path);
+
+   free(hashes);
+   if (received)
+      free_hist_entries(received, n_received);
+   if (local)
+      free_hist_entries(local, n_local);
+   hist_pool_free(pool);
+   return n_kept;
+}
+
+/*
+ * Merge the new received entries into the local files, files the tree
+ * does not have yet are created. The temporary files are removed. An
+ * index is loaded and saved once for all of them.
+ * Returns 1 on success, 0 on failure.
+ */
+static int merge_incoming
+ (
+   struct hist_sync *sync
+ )
+{
+   struct hist_index *index = NULL;
+   struct stat statbuf;
+   int status = 1;
+
+   if (sync->opts.index && ! (index = hist_index_load(sync->opts.index)))
+      return 0;
+
+   for (size_t i = 0; i < sync->n_incoming; ++i) {
+      struct hist_sync_incoming *incoming = &sync->incoming[i];
+      char *full = tree_path(sync->root, incoming->path);
+      int exists, n_new;
+
+      if (! full) {
+         status = 0;
+         continue;
+      }
+
+      exists = stat(full, &statbuf) != -1;
+      n_new = filter_incoming(sync, incoming, exists ? full : NULL);
+
+      if (n_new > 0 && sync->opts.verbose)
+         printf("Receiving: %s (%d new entries)\n", incoming->path, n_new);
+
+      // verbose output of the merge would show the temporary file
+      struct hist_options opts = sync->opts;
+      opts.verbose = 0;
+      opts.index = NULL;
+
+      if (n_new < 0)
+         status = 0;
+      else if (n_new && ! (exists ? merge_files(full, incoming->temp, full, &opts) :
+                                    merge_files(incoming->temp, NULL, full, &opts)))
+         status = 0;
+      else if (n_new && index)
+         status &= hist_index_add_file(index, full, 1);
+
+      unlink(incoming->temp);
+      free(full);
+   }
+
+   if (index) {
+      status &= hist_index_save(index);
+      hist_index_free(index);
+   }
+
+   return status;
+}
+
+/*
+ * Run one side of a sync of the tree at root over in_fd and out_fd
+ * Returns 1 on success, 0 on failure.
+ */
+static int run_sync
+ (
+   const char *root,
+   int in_fd,
+   int out_fd,
+   int client,
+   const struct hist_options *opts
+ )
+{
+   struct hist_sync sync;
+   int status = 1;
+   int fd;
+
+   memset(&sync, 0, sizeof(sync));
+   sync.root = root;
+   sync.status = 1;
+
+   if (opts)
+      sync.opts = *opts;
+   else
+      hist_options_init(&sync.opts);
+
+   // whole histories are synced
+   sync.opts.types = NULL;
+   sync.opts.drop_types = NULL;
+   sync.opts.collapse_status = -1;
+   sync.opts.dry_run = 0;
+
+   if ((fd = dup(in_fd)) == -1 || ! (sync.in = fdopen(fd, "r"))) {
+      perror("sync");
+      if (fd != -1)
+         close(fd);
+      return 0;
+   }
+
+   if ((fd = dup(out_fd)) == -1 || ! (sync.out = fdopen(fd, "w"))) {
+      perror("sync");
+      if (fd != -1)
+         close(fd);
+      fclose(sync.in);
+      return 0;
+   }
+
+   // the phases, in turns
+   if (client) {
+      status = send_message(&sync, HIST_SYNC_HELLO, HIST_SYNC_VERSION,
+                            strlen(HIST_SYNC_VERSION), NULL, 0) && send_end(&sync) &&
+               expect_message(&sync, HIST_SYNC_HELLO) && check_version(&sync) &&
+               expect_message(&sync, HIST_SYNC_END) &&
+               scan_tree(&sync) &&
+               send_summaries(&sync) && recv_summaries(&sync) &&
+               send_chunks(&sync) && recv_chunks(&sync) &&
+               send_data(&sync) && recv_data(&sync);
+
+      // the server merges meanwhile and reports how that went
+      if (status) {
+         status = merge_incoming(&sync);
+         status &= expect_message(&sync, HIST_SYNC_STATUS) && ! strcmp(sync.buf, "1");
+      }
+   }
+   else {
+      status = expect_message(&sync, HIST_SYNC_HELLO) && check_version(&sync) &&
+               expect_message(&sync, HIST_SYNC_END) &&
+               send_message(&sync, HIST_SYNC_HELLO, HIST_SYNC_VERSION,
+                            strlen(HIST_SYNC_VERSION), NULL, 0) && send_end(&sync) &&
+               scan_tree(&sync) &&
+               recv_summaries(&sync) && send_summaries(&sync) &&
+               recv_chunks(&sync) && send_chunks(&sync) &&
+               recv_data(&sync) && send_data(&sync);
+
+      if (status) {
+         status = merge_incoming(&sync) && sync.status;
+         status &= send_message(&sync, HIST_SYNC_STATUS, status ? "1" : "0", 1, NULL, 0) &&
+                   fflush(sync.out) != EOF;
+      }
+   }
+
+   status &= sync.status;
+
+   if (sync.opts.verbose)
+      printf("Sent %llu bytes, received %llu bytes\n", (unsigned long long) sync.sent,
+         (unsigned long long) sync.received);
+
+   // whatever was not merged
+   close_incoming(&sync);
+   for (size_t i = 0; i < sync.n_incoming; ++i) {
+      unlink(sync.incoming[i].temp);
+      free(sync.incoming[i].path);
+      free(sync.incoming[i].temp);
+   }
+   free(sync.incoming);
+
+   for (size_t i = 0; i < sync.n_files; ++i) {
+      free(sync.files[i].path);
+      free(sync.files[i].chunks);
+      free(sync.files[i].peer_chunks);
+   }
+   free(sync.files);
+   free(sync.buf);
+
+   fclose(sync.in);
+   fclose(sync.out);
+   return status;
+}
+
+/*
+ * Sync the history tree at root with the tree of a hist_sync_serve()
+ * at the other end of in_fd and out_fd (the same socket, or pipes to
+ * a remote command). Both sides exchange the entries the
+ * other one lacks and merge them into their files with merge_files(),
+ * files only on one side are created on the other one. Filters of opts
+ * do not apply, its index, cache and output options do.
+ * Returns 1 if both sides succeeded, 0 on failure.
+ */
+int hist_sync
+ (
+   const char *root,
+   int in_fd,
+   int out_fd,
+   const struct hist_options *opts
+ )
+{
+   return run_sync(root, in_fd, out_fd, 1, opts);
+}
+
+/*
+ * Serve the history tree at root to a hist_sync() on in_fd and out_fd
+ * Returns 1 on success, 0 on failure.
+ */
+int hist_sync_serve
+ (
+   const char *root,
+   int in_fd,
+   int out_fd,
+   const struct hist_options *opts
+ )
+{
+   return run_sync(root, in_fd, out_fd, 0, opts);
+}
@@ -0,0 +1,1276 @@
+/*
+ * hist_verify - differential check of the merge engines
+ * Copyright (C) 2016 Benjamin Abendroth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// nftw(), open_memstream(), getline()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "mcabberhist.h"
+
+// Every this many cases one has many entries, so inputs and outputs
+// cross the buffer sizes of the backends
+#define HIST_VERIFY_BIG_EVERY 64
+#define HIST_VERIFY_BIG_ENTRIES 20000
+#define HIST_VERIFY_MAX_ENTRIES 400
+
+// Backends every case is merged with
+static const char *verify_backends[] = { "stdio", "mmap", "pread", "memory", "gzip", NULL };
+
+static const char *verify_types[] = { "MR", "MS", "MI", "SO", "SA", "SN", "SD", "SX" };
+
+static const char *verify_words[] = {
+   "hi", "hello there", "online", "away", "see you", "ok",
+   "f\xc3\xbcr sch\xc3\xb6ne Gr\xc3\xbc\xc3\x9f" "e", "http://example.org/a?b=c",
+};
+
+/*
+ * Entry as the original merge_entries() read it: the header fields and
+ * the raw lines
+ */
+struct baseline_entry
+{
+   char type[3];
+   char timestamp[19];
+   char follow_lines[4];
+
+   // NULL-terminated array, like argv
+   char **lines;
+
+   // Position in the file, the original bubble sort was stable
+   int index;
+};
+
+/*
+ * State of one verification run
+ */
+struct hist_verify
+{
+   // Work directory, inputs of all cases are kept below it
+   char dir[PATH_MAX];
+
+   // xorshift64* state of the current case
+   uint64_t random;
+
+   // Command run as 'reference file1 file2 outfile', NULL for none
+   const char *reference;
+
+   FILE *report;
+   unsigned long n_differences;
+
+   // Options of the current case as given on command line, for reports
+   char options[64];
+
+   // stderr while the engines run, which warn about damaged input
+   int stderr_fd;
+};
+
+/*
+ * Next number of the pseudo random sequence (xorshift64*)
+ */
+static uint64_t next_random
+ (
+   struct hist_verify *verify
+ )
+{
+   verify->random ^= verify->random >> 12;
+   verify->random ^= verify->random << 25;
+   verify->random ^= verify->random >> 27;
+   return verify->random * 2685821657736338717ULL;
+}
+
+/*
+ * Pseudo random number in [0, n)
+ */
+static uint64_t random_below
+ (
+   struct hist_verify *verify,
+   uint64_t n
+ )
+{
+   return next_random(verify) % n;
+}
+
+/*
+ * Write a random body line to stream, ending in " #tag" unless tag is
+ * negative. Clean bodies have no leading or trailing white space, as
+ * the reference script strips it.
+ */
+static void random_line
+ (
+   struct hist_verify *verify,
+   FILE *stream,
+   int clean,
+   int tag
+ )
+{
+   size_t len;
+
+   switch (random_below(verify, 6)) {
+      case 0:
+         // longer than an inline body, often equal in both files
+         len = HIST_INLINE_BODY - 8 + random_below(verify, 4) * 8;
+         for (size_t i = 0; i < len; ++i)
+            fputc('a' + (i * 7 + len) % 26, stream);
+         break;
+      case 1:
+         len = 1 + random_below(verify, 200);
+         for (size_t i = 0; i < len; ++i) {
+            int c = ' ' + random_below(verify, 95);
+            fputc(clean && (i == 0 || i == len - 1) && c == ' ' ? '_' : c, stream);
+         }
+         break;
+      case 2:
+         if (! clean) {
+            fputs(random_below(verify, 2) ? "\t tabs and spaces \t" : "", stream);
+            break;
+         }
+         // fall through
+      default:
+         fputs(verify_words[random_below(verify, sizeof(verify_words) / sizeof(char *))], stream);
+   }
+
+   if (tag >= 0)
+      fprintf(stream, " #%d", tag);
+   fputc('\n', stream);
+}
+
+/*
+ * Write a random entry with timestamp t to stream, tag is passed to
+ * random_line() for its first line
+ */
+static void random_entry
+ (
+   struct hist_verify *verify,
+   FILE *stream,
+   time_t t,
+   int clean,
+   int tag
+ )
+{
+   char timestamp[32];
+   struct tm tm;
+   int follow_lines = random_below(verify, 8) ? 0 : 1 + random_below(verify, 3);
+
+   gmtime_r(&t, &tm);
+   strftime(timestamp, sizeof(timestamp), "%Y%m%dT%H:%M:%SZ", &tm);
+
+   fprintf(stream, "%s %s %03d ",
+      verify_types[random_below(verify, sizeof(verify_types) / sizeof(char *))],
+      timestamp, follow_lines);
+
+   for (int i = 0; i <= follow_lines; ++i)
+      random_line(verify, stream, clean, i ? -1 : tag);
+}
+
+/*
+ * Damage a generated history in place: truncate it, overwrite bytes or
+ * insert malformed lines.
+ */
+static void mutate
+ (
+   struct hist_verify *verify,
+   char **data,
+   size_t *len
+ )
+{
+   static const char *garbage[] = {
+      "garbage\n", "\n", "MR 2016 broken header\n",
+      "MR 20100901T13:39:14Z 999 more lines than there are\n",
+      "MS 20100901T13:39:14Z 00x bad count\n", "\r\n",
+   };
+   int n_mutations = 1 + random_below(verify, 3);
+
+   for (int m = 0; m < n_mutations && *len; ++m) {
+      size_t pos = random_below(verify, *len);
+
+      switch (random_below(verify, 4)) {
+         case 0:
+            *len = pos;
+            break;
+         case 1: {
+            static const char bytes[] = { '\n', '\r', '\0', ' ', 'Z', '\xff' };
+            (*data)[pos] = bytes[random_below(verify, sizeof(bytes))];
+            break;
+         }
+         case 2:
+            if ((*data)[*len - 1] == '\n')
+               --*len;
+            break;
+         default: {
+            const char *line = garbage[random_below(verify, sizeof(garbage) / sizeof(char *))];
+            size_t line_len = strlen(line);
+            char *new_data = realloc(*data, *len + line_len);
+            if (! new_data)
+               break;
+
+            // at the start of a line
+            while (pos && new_data[pos - 1] != '\n')
+               --pos;
+
+            memmove(new_data + pos + line_len, new_data + pos, *len - pos);
+            memcpy(new_data + pos, line, line_len);
+            *data = new_data;
+            *len += line_len;
+         }
+      }
+   }
+}
+
+/*
+ * Write len bytes of data to path.
+ * Returns 1 on success, 0 on failure.
+ */
+static int write_data
+ (
+   const char *path,
+   const char *data,
+   size_t len
+ )
+{
+   FILE *file_fh = fopen(path, "w");
+   int status;
+
+   if (! file_fh) {
+      perror(path);
+      return 0;
+   }
+
+   status = fwrite(data, 1, len, file_fh) == len;
+   status &= fclose(file_fh) != EOF;
+
+   if (! status)
+      perror(path);
+   return status;
+}
+
+/*
+ * Read the whole file at path as it is, without the I/O backend, into
+ * *data (to be freed) of *len bytes.
+ * Returns 1 on success, 0 on failure.
+ */
+static int read_data
+ (
+   const char *path,
+   char **data,
+   size_t *len
+ )
+{
+   FILE *file_fh = fopen(path, "r");
+   size_t size = 0;
+   int status;
+
+   *data = NULL;
+   *len = 0;
+
+   if (! file_fh) {
+      perror(path);
+      return 0;
+   }
+
+   for (size_t n = 1; n; *len += n) {
+      if (*len == size) {
+         char *new_data = realloc(*data, size = size ? size * 2 : 65536);
+         if (! new_data) {
+            perror("realloc");
+            free(*data);
+            *data = NULL;
+            fclose(file_fh);
+            return 0;
+         }
+         *data = new_data;
+      }
+      n = fread(*data + *len, 1, size - *len, file_fh);
+   }
+
+   status = ! ferror(file_fh);
+   fclose(file_fh);
+   if (! status) {
+      perror(path);
+      free(*data);
+      *data = NULL;
+   }
+
+   return status;
+}
+
+/*
+ * Copy the file source to dest as it is, without the I/O backend.
+ * Returns 1 on success, 0 on failure.
+ */
+static int copy_data
+ (
+   const char *source,
+   const char *dest
+ )
+{
+   char *data;
+   size_t len;
+   int status;
+
+   status = read_data(source, &data, &len) && write_data(dest, data, len);
+   free(data);
+   return status;
+}
+
+/*
+ * Generate the two inputs of a case, sharing most of their entries
+ * (the second one often a subset of the first one or the first one
+ * grown by newer entries), slightly out of
+ * order or concatenated from two exports and, unless clean, damaged.
+ * Returns 1 on success, 0 on failure.
+ */
+static int generate_case
+ (
+   struct hist_verify *verify,
+   const char *file1,
+   const char *file2,
+   int big,
+   int clean
+ )
+{
+   const char *paths[2] = { file1, file2 };
+   char *data[2] = { NULL, NULL };
+   size_t len[2] = { 0, 0 };
+   FILE *streams[2];
+   int n_entries = big ? HIST_VERIFY_BIG_ENTRIES : random_below(verify, HIST_VERIFY_MAX_ENTRIES);
+   time_t t = 1262304000 + random_below(verify, 300000000);
+   int subset = ! random_below(verify, 4);
+   int grown = ! subset && ! random_below(verify, 4);
+   int cut = grown ? random_below(verify, n_entries + 1) : n_entries;
+   int concatenated = ! random_below(verify, 8);
+   time_t start = t;
+   int status = 1;
+
+   for (int i = 0; i < 2; ++i) {
+      if (! (streams[i] = open_memstream(&data[i], &len[i]))) {
+         perror("open_memstream");
+         if (i)
+            fclose(streams[0]);
+         free(data[0]);
+         return 0;
+      }
+   }
+
+   for (int n = 0; n < n_entries; ++n) {
+      // two exports one after the other
+      if (concatenated && n == n_entries / 2)
+         t = start + random_below(verify, 3600);
+
+      // equal timestamps are common, so is mcabber's wrong order of
+      // status entries
+      if (random_below(verify, 4))
+         t += random_below(verify, 600);
+      time_t entry_t = random_below(verify, subset || grown ? 1024 : 32) ? t :
+                       t - random_below(verify, 3600);
+
+      // the reference script takes entries of equal time and body but
+      // different type for the same, clean entries of one file differ
+      int tag = clean ? n : -1;
+
+      // entries written to the second file after the first one was taken
+      if (n >= cut) {
+         random_entry(verify, streams[1], entry_t, clean, tag);
+         continue;
+      }
+
+      switch (random_below(verify, 10)) {
+         case 0:
+            random_entry(verify, streams[0], entry_t, clean, tag);
+            break;
+         case 1:
+            // often the second file has nothing new
+            random_entry(verify, streams[subset ? 0 : 1], entry_t, clean, tag);
+            break;
+         default: {
+            long start = ftell(streams[0]);
+            random_entry(verify, streams[0], entry_t, clean, -1);
+            fflush(streams[0]);
+
+            // the same entry, sometimes missing in the second file
+            if (random_below(verify, 8))
+               fwrite(data[0] + start, 1, len[0] - start, streams[1]);
+         }
+      }
+   }
+
+   for (int i = 0; i < 2; ++i) {
+      if (fclose(streams[i]) == EOF) {
+         perror("open_memstream");
+         status = 0;
+      }
+   }
+
+   for (int i = 0; status && i < 2; ++i) {
+      if (! clean && random_below(verify, 2))
+         mutate(verify, &data[i], &len[i]);
+      status = write_data(paths[i], data[i], len[i]);
+   }
+
+   free(data[0]);
+   free(data[1]);
+   return status;
+}
+
+/*
+ * Read the entries of path, sorted.
+ * Returns the entries or NULL if failed.
+ */
+static struct hist_entry** read_reference
+ (
+   const char *path,
+   struct hist_pool *pool,
+   const struct hist_options *opts,
+   int *n_entries
+ )
+{
+   struct hist_reader *reader;
+   struct hist_entry **entries;
+
+   if (! (reader = hist_reader_open(path, pool)))
+      return NULL;
+
+   hist_reader_set_types(reader, opts->types, opts->drop_types);
+   entries = read_hist(reader, n_entries);
+   hist_reader_close(reader);
+   return entries;
+}
+
+/*
+ * Merge file1 and file2 the plain way: both read with stdio into one
+ * pool (equal long bodies compare by pointer), merged by
+ * merge_entries() into memory.
+ * Returns 1 on success, 0 on failure.
+ */
+static int merge_reference
+ (
+   const char *file1,
+   const char *file2,
+   const struct hist_options *opts,
+   char **data,
+   size_t *len
+ )
+{
+   struct hist_pool *pool = hist_pool_new();
+   struct hist_entry **hist1 = NULL, **hist2 = NULL;
+   int n_hist1, n_hist2;
+   struct hist_merge merge;
+   struct hist_entry *entry;
+   FILE *stream = NULL;
+   int status = 0;
+
+   hist_io_backend("stdio");
+
+   if (pool &&
+         (hist1 = read_reference(file1, pool, opts, &n_hist1)) &&
+         (hist2 = read_reference(file2, pool, opts, &n_hist2)) &&
+         (stream = open_memstream(data, len))) {
+      if (opts->collapse_status < 0) {
+         merge_entries(hist1, n_hist1, hist2, n_hist2, stream);
+      }
+      else {
+         hist_merge_init(&merge, hist1, n_hist1, hist2, n_hist2);
+         hist_merge_collapse_status(&merge, opts->collapse_status);
+         while (entry = hist_merge_next(&merge))
+            write_entry(entry, stream);
+      }
+      status = fclose(stream) != EOF;
+   }
+
+   if (hist1)
+      free_hist_entries(hist1, n_hist1);
+   if (hist2)
+      free_hist_entries(hist2, n_hist2);
+   if (pool)
+      hist_pool_free(pool);
+   return status;
+}
+
+/*
+ * Free n baseline entries and the array holding them
+ */
+static void free_baseline_entries
+ (
+   struct baseline_entry *entries,
+   int n
+ )
+{
+   for (int i = 0; i < n; ++i) {
+      for (char **it = entries[i].lines; *it; ++it)
+         free(*it);
+      free(entries[i].lines);
+   }
+   free(entries);
+}
+
+/*
+ * Read one entry the way the original read_entry() did.
+ * Returns 1 if an entry was read, 0 at the end of the entries.
+ */
+static int read_baseline_entry
+ (
+   struct baseline_entry *entry,
+   FILE *hist_fh
+ )
+{
+   memset(entry, 0, sizeof(*entry));
+
+   if (! fgets(entry->type, sizeof(entry->type), hist_fh) || strlen(entry->type) != 2)
+      return 0;
+
+   fgetc(hist_fh);
+   fgets(entry->timestamp, sizeof(entry->timestamp), hist_fh);
+   fgetc(hist_fh);
+   fgets(entry->follow_lines, sizeof(entry->follow_lines), hist_fh);
+   fgetc(hist_fh);
+
+   int follow_lines = atoi(entry->follow_lines);
+   if (! (entry->lines = calloc(2 + follow_lines, sizeof(char *))))
+      return 0;
+
+   for (int i = 0; i <= follow_lines; ++i) {
+      size_t line_size = 0;
+
+      if (getline(&entry->lines[i], &line_size, hist_fh) == -1) {
+         for (char **it = entry->lines; *it; ++it)
+            free(*it);
+         free(entry->lines);
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+/*
+ * Compare function for qsort on entries by timestamp, then position
+ */
+static int cmp_baseline_entry(const void *a, const void *b)
+{
+   const struct baseline_entry *entry_a = a, *entry_b = b;
+   int ts_cmp = strcmp(entry_a->timestamp, entry_b->timestamp);
+
+   return ts_cmp ? ts_cmp : entry_a->index - entry_b->index;
+}
+
+/*
+ * Read the entries of path and sort them stably by timestamp, like the
+ * original read_hist(). An empty file has no entries, it is no error.
+ * Returns the entries or NULL if failed.
+ */
+static struct baseline_entry* read_baseline
+ (
+   const char *path,
+   int *n_entries
+ )
+{
+   struct baseline_entry *entries = NULL;
+   int size = 0;
+   FILE *hist_fh = fopen(path, "r");
+
+   *n_entries = 0;
+   if (! hist_fh) {
+      perror(path);
+      return NULL;
+   }
+
+   for (;;) {
+      if (*n_entries == size) {
+         struct baseline_entry *new_entries =
+            realloc(entries, (size = size ? size * 2 : 1024) * sizeof(struct baseline_entry));
+         if (! new_entries) {
+            perror("realloc");
+            free_baseline_entries(entries, *n_entries);
+            fclose(hist_fh);
+            return NULL;
+         }
+         entries = new_entries;
+      }
+
+      entries[*n_entries].index = *n_entries;
+      if (! read_baseline_entry(&entries[*n_entries], hist_fh))
+         break;
+      ++*n_entries;
+   }
+
+   fclose(hist_fh);
+   qsort(entries, *n_entries, sizeof(struct baseline_entry), cmp_baseline_entry);
+   return entries;
+}
+
+/*
+ * Fully compare two baseline entries like the original eq_hist_entry()
+ */
+static int eq_baseline_entry
+ (
+   const struct baseline_entry *a,
+   const struct baseline_entry *b
+ )
+{
+   if (strcmp(a->type, b->type) || strcmp(a->timestamp, b->timestamp) ||
+         strcmp(a->follow_lines, b->follow_lines))
+      return 0;
+
+   for (char **a_it = a->lines, **b_it = b->lines; *a_it || *b_it; ++a_it, ++b_it)
+      if (! *a_it || ! *b_it || strcmp(*a_it, *b_it))
+         return 0;
+
+   return 1;
+}
+
+/*
+ * Write a baseline entry like the original write_entry()
+ */
+static void write_baseline_entry
+ (
+   const struct baseline_entry *entry,
+   FILE *out_stream
+ )
+{
+   fprintf(out_stream, "%s %s %s ", entry->type, entry->timestamp, entry->follow_lines);
+
+   for (char **it = entry->lines; *it; ++it)
+      fputs(*it, out_stream);
+}
+
+/*
+ * Merge file1 and file2 with the parser, sort and merge_entries() this
+ * program had before libmcabberhist, into memory. Only defined for
+ * well-formed, unfiltered inputs.
+ * Returns 1 on success, 0 on failure.
+ */
+static int merge_baseline
+ (
+   const char *file1,
+   const char *file2,
+   char **data,
+   size_t *len
+ )
+{
+   struct baseline_entry *a = NULL, *b = NULL;
+   int n_a, n_b, i_a = 0, i_b = 0;
+   FILE *stream = NULL;
+   int status = 0;
+
+   if ((a = read_baseline(file1, &n_a)) && (b = read_baseline(file2, &n_b)) &&
+         (stream = open_memstream(data, len))) {
+      while (i_a < n_a && i_b < n_b) {
+         int ts_cmp = strcmp(a[i_a].timestamp, b[i_b].timestamp);
+
+         if (ts_cmp <= 0) {
+            // exactly same, skip b, write a
+            if (ts_cmp == 0 && eq_baseline_entry(&a[i_a], &b[i_b]))
+               ++i_b;
+
+            write_baseline_entry(&a[i_a++], stream);
+         }
+         else {
+            write_baseline_entry(&b[i_b++], stream);
+         }
+      }
+
+      while (i_a < n_a)
+         write_baseline_entry(&a[i_a++], stream);
+
+      while (i_b < n_b)
+         write_baseline_entry(&b[i_b++], stream);
+
+      status = fclose(stream) != EOF;
+   }
+
+   if (a)
+      free_baseline_entries(a, n_a);
+   if (b)
+      free_baseline_entries(b, n_b);
+   return status;
+}
+
+/*
+ * Send stderr to /dev/null until unsilence() is called
+ */
+static void silence
+ (
+   struct hist_verify *verify
+ )
+{
+   int null_fd = open("/dev/null", O_WRONLY);
+
+   fflush(stderr);
+   verify->stderr_fd = dup(STDERR_FILENO);
+   if (null_fd != -1) {
+      dup2(null_fd, STDERR_FILENO);
+      close(null_fd);
+   }
+}
+
+/*
+ * Give stderr back after silence()
+ */
+static void unsilence
+ (
+   struct hist_verify *verify
+ )
+{
+   fflush(stderr);
+   if (verify->stderr_fd != -1) {
+      dup2(verify->stderr_fd, STDERR_FILENO);
+      close(verify->stderr_fd);
+   }
+}
+
+/*
+ * Report that engine failed on a case
+ */
+static void report_failure
+ (
+   struct hist_verify *verify,
+   unsigned long n_case,
+   const char *engine
+ )
+{
+   ++verify->n_differences;
+   fprintf(verify->report, "case %lu%s: %s: merge failed\n", n_case,
+      verify->options, engine);
+}
+
+/*
+ * Compare len bytes of data with the reference output and report a
+ * difference.
+ * Returns 1 if they are identical, else 0.
+ */
+static int compare_data
+ (
+   struct hist_verify *verify,
+   unsigned long n_case,
+   const char *engine,
+   const char *data,
+   size_t len,
+   const char *ref,
+   size_t ref_len
+ )
+{
+   size_t pos = 0;
+
+   while (pos < len && pos < ref_len && data[pos] == ref[pos])
+      ++pos;
+
+   if (pos == len && pos == ref_len)
+      return 1;
+
+   ++verify->n_differences;
+   fprintf(verify->report, "case %lu%s: %s: differs from the reference at byte %zu\n",
+      n_case, verify->options, engine, pos);
+   return 0;
+}
+
+/*
+ * Compare the file at path, read through the selected backend, with
+ * the reference output and report a difference.
+ * Returns 1 if they are identical, else 0.
+ */
+static int compare_output
+ (
+   struct hist_verify *verify,
+   unsigned long n_case,
+   const char *engine,
+   const char *path,
+   const char *ref,
+   size_t ref_len
+ )
+{
+   FILE *file_fh = hist_io_open(path, "r");
+   size_t pos = 0;
+   int c = EOF;
+
+   if (file_fh) {
+      while ((c = getc(file_fh)) != EOF && pos < ref_len && c == (unsigned char) ref[pos])
+         ++pos;
+      fclose(file_fh);
+   }
+
+   if (file_fh && c == EOF && pos == ref_len)
+      return 1;
+
+   ++verify->n_differences;
+   if (! file_fh)
+      fprintf(verify->report, "case %lu%s: %s: %s: %s\n", n_case, verify->options,
+         engine, path, strerror(errno));
+   else
+      fprintf(verify->report, "case %lu%s: %s: differs from the reference at byte %zu\n",
+         n_case, verify->options, engine, pos);
+   return 0;
+}
+
+/*
+ * Run the external reference on file1 and file2 and compare its output.
+ * Returns 1 if identical, else 0.
+ */
+static int run_reference
+ (
+   struct hist_verify *verify,
+   unsigned long n_case,
+   const char *file1,
+   const char *file2,
+   const char *fileO,
+   const char *ref,
+   size_t ref_len
+ )
+{
+   size_t len = strlen(verify->reference) + strlen(file1) + strlen(file2) + strlen(fileO) + 32;
+   char *command = malloc(len);
+   int status;
+
+   if (! command) {
+      perror("malloc");
+      return 0;
+   }
+
+   // paths are below the work directory and contain no quotes
+   snprintf(command, len, "%s '%s' '%s' '%s' >/dev/null", verify->reference, file1, file2, fileO);
+   unlink(fileO);
+   silence(verify);
+   status = system(command);
+   unsilence(verify);
+   free(command);
+
+   if (status) {
+      ++verify->n_differences;
+      fprintf(verify->report, "case %lu%s: reference: command failed, not run any more\n",
+         n_case, verify->options);
+      verify->reference = NULL;
+      return 0;
+   }
+
+   hist_io_backend("stdio");
+   return compare_output(verify, n_case, "reference", fileO, ref, ref_len);
+}
+
+/*
+ * Build the path of a file of the work directory
+ */
+static void verify_path
+ (
+   struct hist_verify *verify,
+   char *path,
+   const char *sub,
+   unsigned long n_case
+ )
+{
+   snprintf(path, PATH_MAX, "%s/%s/%lu", verify->dir, sub, n_case);
+}
+
+/*
+ * Generate and check one case against all engines.
+ * Returns 1 on success (differences are counted, not failures), 0 on
+ * failure.
+ */
+static int verify_case
+ (
+   struct hist_verify *verify,
+   unsigned long n_case,
+   uint64_t seed
+ )
+{
+   char file1[PATH_MAX], file2[PATH_MAX], fileO[PATH_MAX], ref_path[PATH_MAX];
+   char archive1[PATH_MAX], archive2[PATH_MAX], archiveO[PATH_MAX], cache[PATH_MAX];
+   char inplace[PATH_MAX], gzipped[PATH_MAX], engine[64];
+   struct hist_options opts, convert_opts, cache_opts;
+   char *ref = NULL, *plain = NULL;
+   size_t ref_len = 0, plain_len = 0;
+   int filtered, clean, status, merged;
+
+   // one independent sequence per case, so a case can be run alone
+   verify->random = (seed + n_case) * 0x9e3779b97f4a7c15ULL | 1;
+
+   hist_options_init(&opts);
+   filtered = ! random_below(verify, 4);
+   clean = random_below(verify, 2);
+
+   *verify->options = 0;
+   if (filtered) {
+      switch (random_below(verify, 3)) {
+         case 0:
+            opts.types = "MR,MS";
+            strcpy(verify->options, " (--types=MR,MS)");
+            break;
+         case 1:
+            opts.drop_types = "S";
+            strcpy(verify->options, " (--drop-types=S)");
+            break;
+         default:
+            opts.collapse_status = random_below(verify, 600);
+            snprintf(verify->options, sizeof(verify->options), " (--collapse-status=%ld)",
+               opts.collapse_status);
+      }
+   }
+
+   // filtered cases are not part of the directory merge
+   verify_path(verify, file1, filtered ? "1f" : "1", n_case);
+   verify_path(verify, file2, filtered ? "2f" : "2", n_case);
+   verify_path(verify, ref_path, "ref", n_case);
+   snprintf(fileO, PATH_MAX, "%s/out", verify->dir);
+   snprintf(archive1, PATH_MAX, "%s/1.mha", verify->dir);
+   snprintf(archive2, PATH_MAX, "%s/2.mha", verify->dir);
+   snprintf(archiveO, PATH_MAX, "%s/out.mha", verify->dir);
+   snprintf(cache, PATH_MAX, "%s/cache", verify->dir);
+   snprintf(inplace, PATH_MAX, "%s/inplace", verify->dir);
+   snprintf(gzipped, PATH_MAX, "%s/1.gz", verify->dir);
+
+   if (! generate_case(verify, file1, file2, n_case % HIST_VERIFY_BIG_EVERY == HIST_VERIFY_BIG_EVERY - 1, clean))
+      return 0;
+
+   silence(verify);
+   status = merge_reference(file1, file2, &opts, &ref, &ref_len);
+   unsilence(verify);
+
+   if (! status) {
+      fprintf(verify->report, "case %lu%s: reference merge failed\n", n_case, verify->options);
+      free(ref);
+      return 0;
+   }
+
+   // well-formed unfiltered cases are held to the merge this program had
+   // before libmcabberhist, the plain merge of the library included
+   if (clean && ! filtered) {
+      char *merged_data = ref;
+      size_t merged_len = ref_len;
+
+      ref = NULL;
+      ref_len = 0;
+      if (! merge_baseline(file1, file2, &ref, &ref_len)) {
+         fprintf(verify->report, "case %lu: baseline merge failed\n", n_case);
+         free(merged_data);
+         free(ref);
+         return 0;
+      }
+
+      compare_data(verify, n_case, "merge_entries", merged_data, merged_len, ref, ref_len);
+      free(merged_data);
+   }
+
+   status = filtered || write_data(ref_path, ref, ref_len);
+
+   for (const char **backend = verify_backends; status && *backend; ++backend) {
+      hist_io_backend(*backend);
+      silence(verify);
+      merged = merge_files(file1, file2, fileO, &opts);
+      unsilence(verify);
+
+      if (merged)
+         compare_output(verify, n_case, *backend, fileO, ref, ref_len);
+      else
+         report_failure(verify, n_case, *backend);
+
+      // into a plain text file1, where grown cases append to it
+      snprintf(engine, sizeof(engine), "%s inplace", *backend);
+      status = copy_data(file1, inplace);
+
+      silence(verify);
+      merged = status && merge_files(inplace, file2, inplace, &opts);
+      unsilence(verify);
+
+      if (merged)
+         compare_output(verify, n_case, engine, inplace, ref, ref_len);
+      else if (status)
+         report_failure(verify, n_case, engine);
+   }
+
+   // the first run fills the cache, the second one reads from it
+   hist_io_backend("stdio");
+   cache_opts = opts;
+   cache_opts.cache = cache;
+   for (int run = 0; status && run < 2; ++run) {
+      silence(verify);
+      merged = merge_files(file1, file2, fileO, &cache_opts);
+      unsilence(verify);
+
+      if (merged)
+         compare_output(verify, n_case, "cache", fileO, ref, ref_len);
+      else
+         report_failure(verify, n_case, "cache");
+   }
+
+   // a table cached through gzip holds decompressed entries, stdio reads
+   // the compressed bytes of the same file and must not be served it
+   hist_io_backend("gzip");
+   silence(verify);
+   status = status && merge_files(file1, NULL, gzipped, &opts);
+   merged = status && merge_files(gzipped, file2, fileO, &cache_opts);
+   hist_io_backend("stdio");
+   merged = merged && merge_files(gzipped, file2, fileO, &opts) &&
+            read_data(fileO, &plain, &plain_len) &&
+            merge_files(gzipped, file2, fileO, &cache_opts);
+   unsilence(verify);
+
+   if (merged)
+      compare_output(verify, n_case, "cache gzip to stdio", fileO, plain, plain_len);
+   else if (status)
+      report_failure(verify, n_case, "cache gzip to stdio");
+   free(plain);
+
+   // archives: both inputs, and mixed with text
+   hist_io_backend("stdio");
+   hist_options_init(&convert_opts);
+   convert_opts.archive = 1;
+   convert_opts.compress = n_case & 1;
+
+   silence(verify);
+   status = status && convert_file(file1, archive1, &convert_opts) &&
+                      convert_file(file2, archive2, &convert_opts);
+   merged = status && merge_files(archive1, archive2, archiveO, &opts) &&
+            convert_file(archiveO, fileO, NULL);
+   unsilence(verify);
+
+   if (merged)
+      compare_output(verify, n_case, "archive", fileO, ref, ref_len);
+   else if (status)
+      report_failure(verify, n_case, "archive");
+
+   silence(verify);
+   merged = status && merge_files(file1, archive2, fileO, &opts);
+   unsilence(verify);
+
+   if (merged)
+      compare_output(verify, n_case, "mixed", fileO, ref, ref_len);
+   else if (status)
+      report_failure(verify, n_case, "mixed");
+
+   // the reference script strips white space and knows no malformed entries
+   if (status && verify->reference && clean && ! filtered)
+      run_reference(verify, n_case, file1, file2, fileO, ref, ref_len);
+
+   free(ref);
+   return status;
+}
+
+/*
+ * Compare every output of the directory merge of all unfiltered cases
+ * with its reference.
+ * Returns 1 on success, 0 on failure.
+ */
+static int verify_dirs
+ (
+   struct hist_verify *verify,
+   unsigned long n_cases
+ )
+{
+   char dir1[PATH_MAX], dir2[PATH_MAX], dirO[PATH_MAX];
+   char fileO[PATH_MAX], ref_path[PATH_MAX], loop[PATH_MAX];
+   struct hist_options opts;
+   struct stat statbuf;
+   int status = 1;
+
+   snprintf(dir1, PATH_MAX, "%s/1", verify->dir);
+   snprintf(dir2, PATH_MAX, "%s/2", verify->dir);
+   snprintf(dirO, PATH_MAX, "%s/dir", verify->dir);
+
+   // a link back up to the root must not be walked forever
+   snprintf(loop, PATH_MAX, "%s/loop", dir1);
+   if (mkdir(loop, 0700) == -1) {
+      perror(loop);
+      return 0;
+   }
+   snprintf(loop, PATH_MAX, "%s/loop/up", dir1);
+   if (symlink("..", loop) == -1) {
+      perror(loop);
+      return 0;
+   }
+
+   hist_options_init(&opts);
+   opts.order = HIST_ORDER_EXTENT;
+   *verify->options = 0;
+   hist_io_backend("stdio");
+
+   silence(verify);
+   status = merge_dirs(dir1, dir2, dirO, &opts);
+   unsilence(verify);
+
+   if (! status) {
+      ++verify->n_differences;
+      fprintf(verify->report, "directories: merge failed\n");
+      return 1;
+   }
+
+   snprintf(loop, PATH_MAX, "%s/loop/up", dirO);
+   if (lstat(loop, &statbuf) != -1) {
+      ++verify->n_differences;
+      fprintf(verify->report, "directories: link to the root walked\n");
+   }
+
+   for (unsigned long n_case = 0; status && n_case < n_cases; ++n_case) {
+      char *ref = NULL;
+      size_t ref_len = 0, ref_size = 0;
+      FILE *ref_fh;
+
+      verify_path(verify, ref_path, "ref", n_case);
+      verify_path(verify, fileO, "dir", n_case);
+
+      if (! (ref_fh = fopen(ref_path, "r"))) {
+         if (errno == ENOENT)
+            continue;
+         perror(ref_path);
+         return 0;
+      }
+
+      for (size_t n = 1; n; ref_len += n) {
+         if (ref_len == ref_size) {
+            char *new_ref = realloc(ref, ref_size = ref_size ? ref_size * 2 : 65536);
+            if (! new_ref) {
+               perror("realloc");
+               status = 0;
+               break;
+            }
+            ref = new_ref;
+         }
+         n = fread(ref + ref_len, 1, ref_size - ref_len, ref_fh);
+      }
+      fclose(ref_fh);
+
+      if (status)
+         compare_output(verify, n_case, "directories", fileO, ref, ref_len);
+      free(ref);
+   }
+
+   return status;
+}
+
+/*
+ * nftw() callback removing everything
+ */
+static int remove_entry
+ (
+   const char *path,
+   const struct stat *statbuf,
+   int flag,
+   struct FTW *ftw
+ )
+{
+   if (remove(path) == -1)
+      perror(path);
+   return 0;
+}
+
+/*
+ * Merge n_cases generated pairs of histories, half of them damaged,
+ * with every backend, from the cache of entry tables, through binary
+ * archives and as one directory tree in parallel, and compare all
+ * outputs byte for byte with the original merge (well-formed unfiltered
+ * cases) or the plain merge of merge_entries() (the others).
+ * If reference is given, it is run as 'reference file1 file2 outfile'
+ * on the undamaged cases and compared too (e.g. "perl
+ * mcabber_merge_history.pl").
+ * Case n is generated from seed + n, so it can be reproduced alone.
+ * Differences are printed to report, the work directory is then kept.
+ * Returns 1 if all outputs are identical, 0 otherwise.
+ */
+static int run_cases
+ (
+   unsigned long n_cases,
+   unsigned long seed,
+   const char *reference,
+   FILE *report
+ )
+{
+   struct hist_verify verify;
+   const char *tmp = getenv("TMPDIR");
+   const char *subdirs[] = { "1", "2", "1f", "2f", "ref" };
+   int status = 1;
+
+   memset(&verify, 0, sizeof(verify));
+   verify.reference = reference;
+   verify.report = report;
+
+   snprintf(verify.dir, PATH_MAX, "%s/mcabberhist-verify.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+   if (! mkdtemp(verify.dir)) {
+      perror(verify.dir);
+      return 0;
+   }
+
+   for (int i = 0; status && i < sizeof(subdirs) / sizeof(char *); ++i) {
+      char path[PATH_MAX];
+      snprintf(path, PATH_MAX, "%s/%s", verify.dir, subdirs[i]);
+      if (mkdir(path, 0700) == -1) {
+         perror(path);
+         status = 0;
+      }
+   }
+
+   for (unsigned long n_case = 0; status && n_case < n_cases; ++n_case)
+      status = verify_case(&verify, n_case, seed);
+
+   status = status && verify_dirs(&verify, n_cases);
+   hist_io_backend("stdio");
+
+   if (! status || verify.n_differences) {
+      fprintf(report, "%lu difference(s), cases kept in %s\n", verify.n_differences, verify.dir);
+      return 0;
+   }
+
+   fprintf(report, "%lu cases, all outputs identical\n", n_cases);
+   nftw(verify.dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+   return 1;
+}
+
+/*
+ * Parse a number given on command line
+ */
+static unsigned long parse_number
+ (
+   const char *what,
+   const char *arg
+ )
+{
+   char *end;
+   unsigned long number = strtoul(arg, &end, 10);
+
+   if (! *arg || *end || *arg == '-')
+      errx(2, "Invalid %s '%s'", what, arg);
+
+   return number;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *reference = NULL;
+   int arg = 1;
+
+   if (arg < argc && ! strncmp(argv[arg], "--reference=", 12))
+      reference = argv[arg++] + 12;
+
+   if (argc - arg > 2 || (arg < argc && *argv[arg] == '-')) {
+      fprintf(stderr, "Usage: %s [--reference=COMMAND] [cases [seed]]\n", argv[0]);
+      return 2;
+   }
+
+   return ! run_cases(arg < argc ? parse_number("cases", argv[arg]) : 1000,
+                      arg + 1 < argc ? parse_number("seed", argv[arg + 1]) : 1,
+                      reference, stdout);
+}
@@ -21,532 +21,703 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <err.h>
-#include <error.h>
-#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
 #include <sys/stat.h>
-#include <sys/sendfile.h>
-#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
-/*
- * Mcabber history entry
- */
-struct hist_entry
-{
-   // Holds message type (MR, MS)
-   char type[3];
-
-   // Holds timestamp (20100901T13:39:14Z)
-   char timestamp[19];
-
-   // Holds count of following lines (000, 001, ...)
-   char follow_lines[4];
+#include "mcabberhist.h"
 
-   // Holds all lines belonging to this message.
-   // NULL-terminated array, like argv.
-   char **lines;
-};
+void help(const char *prg)
+{
+   fprintf(stderr,
+    "Merge mcabber history files\n\n"
+    "Usage:\n"
+    "\t%s [options] directory1 directory2 [outdir]\n"
+    "\t%s [options] file1 file2 [outfile]\n"
+    "\t%s [options] --segmented store directory\n"
+    "\t%s [options] --segmented segdir file\n"
+    "\t%s --flatten store outdir\n"
+    "\t%s --flatten segdir outfile\n"
+    "\t%s [options] --export|--import source dest\n"
+    "\t%s --index=FILE index file|directory...\n"
+    "\t%s --index=FILE [--from=TIME] [--to=TIME] search word...\n"
+    "\t%s [options] stats file|directory...\n"
+    "\t%s [options] sync directory COMMAND\n"
+    "\t%s [options] serve directory\n\n"
+    "If 'outdir' or 'outfile' are missing this program works inplace on the first argument,\n"
+    "meaning '%s arg1 arg2' is the same as '%s arg1 arg2 arg1'.\n"
+    "A file argument of '-' reads stdin or writes stdout.\n"
+    "Directories are merged recursively (e.g. one subdirectory per account), all files\n"
+    "of the tree are merged in parallel.\n\n"
+    "A segment directory (segdir) holds the history of one contact split into one file\n"
+    "per month (YYYYMM); a store holds one segment directory per contact, in the same\n"
+    "subdirectories as the flat files. Merging into segments only rewrites the months\n"
+    "that gain entries from the new data.\n\n"
+    "--export converts text histories (files or directories) into compact binary archives,\n"
+    "--import converts them back into the same text. Archives can be merged like text files.\n\n"
+    "'index' adds history files to a full-text index, merges given --index keep it up to date.\n"
+    "'search' prints file, offset and first line of all entries containing every word.\n"
+    "TIME is a prefix of YYYYMMDDhhmmss, other characters are ignored (2016-03-01).\n\n"
+    "'stats' prints sent and received messages, their bytes and the first and last\n"
+    "timestamp per contact and per day, reading files in parallel.\n\n"
+    "'sync' runs COMMAND (e.g. 'ssh host %s serve dir') and syncs directory with the\n"
+    "tree of its 'serve': both sides exchange digests and chunk hashes of their files,\n"
+    "send each other only the entries the other side lacks and merge them locally.\n\n"
+    "Options:\n"
+    "\t--types=LIST       Only keep entries of these types (e.g. MR,MS)\n"
+    "\t--drop-types=LIST  Drop entries of these types (e.g. S for all status entries)\n"
+    "\t--collapse-status[=SECONDS]\n"
+    "\t                   Of status entries at most SECONDS apart only keep the last one (default 60)\n"
+    "\t--segmented        Merge into a segment directory or store, inplace\n"
+    "\t--flatten          Rebuild flat history files out of segments\n"
+    "\t--export           Convert text histories into binary archives\n"
+    "\t--import           Convert binary archives into text histories\n"
+    "\t--archive          Write merge results as binary archives\n"
+    "\t--compress         Compress written binary archives\n"
+    "\t--index=FILE       Full-text index to update or search\n"
+    "\t--from=TIME        Only search entries not older than TIME\n"
+    "\t--to=TIME          Only search entries not newer than TIME\n"
+    "\t--max-read-rate=RATE, --max-write-rate=RATE\n"
+    "\t                   Limit reads or writes to RATE bytes per second (suffixes K, M, G)\n"
+    "\t--max-iops=N       Limit reads and writes to N calls per second\n"
+    "\t--io=BACKEND       Read and write files with stdio (default), mmap, pread, memory\n"
+    "\t                   or gzip (compressed files)\n"
+    "\t--durability=POLICY\n"
+    "\t                   none (default): write files in place; per-file: write a temporary\n"
+    "\t                   file, sync and rename it; batched: sync all temporary files at once\n"
+    "\t                   at the end, then rename them\n"
+    "\t--page-cache=POLICY\n"
+    "\t                   keep (default): leave the page cache to the kernel; drop: drop the\n"
+    "\t                   pages of files read or written once, unless they were cached before\n"
+    "\t--journal=FILE     Record finished files of directory merges, skip them when run again\n"
+    "\t--order=ORDER      Merge the files of directories in readdir (default), inode or\n"
+    "\t                   extent order, the latter two read cold disks more sequentially\n"
+    "\t--dry-run          Print whether each file would be skipped, copied, appended to or\n"
+    "\t                   rewritten and the entries and bytes it gains, write nothing\n"
+    "\t--cache=DIR        Keep the parsed and sorted entries of input files in DIR, unchanged\n"
+    "\t                   files are not read again\n"
+    "\t--cache-size=SIZE  Delete the least recently used cache files beyond SIZE bytes, with\n"
+    "\t                   an optional K, M or G suffix (default: 1G)\n"
+    "\t-j, --jobs=N       Merge or read N files at a time (default: one per CPU)\n"
+    "\t-h, --help         Show this help\n"
+   ,prg,prg,prg,prg,prg,prg,prg,prg,prg,prg,prg,prg,prg,prg,prg);
+      
+   exit(1);
+}
 
 /*
- * Frees an hist_entry
+ * Check a comma separated list of entry types given on command line
  */
-void free_hist_entry
+void check_types
  (
-   struct hist_entry *entry
+   const char *option,
+   const char *list
  )
 {
-   for (char **it = entry->lines; *it; ++it)
-      free(*it);
-   free(entry->lines);
-   free(entry);
+   for (const char *it = list; *it; ) {
+      size_t len = strcspn(it, ",");
+
+      if (len < 1 || len > 2)
+         errx(1, "%s: Invalid entry type list '%s'", option, list);
+
+      it += len;
+      if (*it)
+         ++it;
+   }
 }
 
 /*
- * Frees an array of entries
+ * Parse a non-negative count of seconds given on command line
  */
-void free_hist_entries
+long parse_seconds
  (
-   struct hist_entry **entries,
-   int size
+   const char *option,
+   const char *arg
  )
 {
-   for (int i = 0; i < size; ++i)
-      free_hist_entry(entries[i]);
-   free(entries);
-}
+   char *end;
+   long seconds = strtol(arg, &end, 10);
+
+   if (! *arg || *end || seconds < 0)
+      errx(1, "%s: Invalid count of seconds '%s'", option, arg);
 
+   return seconds;
+}
 
 /*
- * Generic bubble sort algorithm
+ * Parse a search time bound given on command line into a timestamp key.
+ * Missing digits are filled with fill ('0' for --from, '9' for --to).
  */
-void bubble_sort
+uint64_t parse_time
  (
-   void **array,
-   size_t size,
-   int (*compare)(const void*, const void*)
+   const char *option,
+   const char *arg,
+   char fill
  )
 {
-   int n = size;
+   char digits[15];
+   int n = 0;
+
+   for (const char *it = arg; *it; ++it) {
+      if (*it < '0' || *it > '9')
+         continue;
+      if (n == 14)
+         errx(1, "%s: Invalid time '%s'", option, arg);
+      digits[n++] = *it;
+   }
 
-   do {
-      int new_n = 1;
+   if (! n)
+      errx(1, "%s: Invalid time '%s'", option, arg);
 
-      for (int i = 0; i < n - 1; ++i) {
-         if (compare(array[i], array[i+1]) > 0) {
-            void *tmp = array[i];
-            array[i] = array[i+1];
-            array[i+1] = tmp;
+   memset(digits + n, fill, 14 - n);
+   digits[14] = 0;
 
-            new_n = i + 1;
-         }
-      }
-      n = new_n;
-   }
-   while (n > 1);
+   return strtoull(digits, NULL, 10);
 }
 
 /*
- * Compare function for bubblesort
+ * Index and status of the index subcommand
  */
-int cmp_hist_entry_timestamp(const void* a, const void* b)
+struct index_walk
 {
-   return strcmp(
-      ((struct hist_entry*) a)->timestamp,
-      ((struct hist_entry*) b)->timestamp
-   );
-}
+   struct hist_index *index;
+   int status;
+};
 
 /*
- * Fully compare two hist entries
+ * hist_walk() callback adding every file of a directory tree to the
+ * index
  */
-//inline
-int eq_hist_entry
+int index_file
  (
-  const struct hist_entry *a,
-  const struct hist_entry *b
+   const char *path,
+   const char *name,
+   int is_dir,
+   void *arg
  )
 {
-   if (
-         strcmp(a->type, b->type) ||
-         strcmp(a->timestamp, b->timestamp) ||
-         strcmp(a->follow_lines, b->follow_lines)
-      )
-         return 0;
+   struct index_walk *walk = arg;
 
-   for (char **a_it = a->lines, **b_it = b->lines; *a_it || *b_it; ++a_it, ++b_it)
-      if (strcmp(*a_it, *b_it))
-         return 0;
+   if (! is_dir)
+      walk->status &= hist_index_add_file(walk->index, path, 0);
 
    return 1;
 }
 
 /*
- * Write out original mcabber history line
+ * Run the index subcommand: add files and directory trees to the index
  */
-//inline
-void write_entry
+int run_index
  (
-   struct hist_entry *entry,
-   FILE *out_stream
+   int argc,
+   char **argv,
+   const char *index_path
  )
 {
-   fputs(entry->type, out_stream);
-   fputc(' ', out_stream);
-   fputs(entry->timestamp, out_stream);
-   fputc(' ', out_stream);
-   fputs(entry->follow_lines, out_stream);
-   fputc(' ', out_stream);
-   
-   for (char **it = entry->lines; *it; ++it)
-      fputs(*it, out_stream);
-}
+   struct index_walk walk = { NULL, 1 };
+   struct stat statbuf;
 
+   if (! (walk.index = hist_index_load(index_path)))
+      return 1;
+
+   for (int i = 2; i < argc; ++i) {
+      if (stat(argv[i], &statbuf) == -1) {
+         perror(argv[i]);
+         walk.status = 0;
+      }
+      else if (! S_ISDIR(statbuf.st_mode)) {
+         walk.status &= hist_index_add_file(walk.index, argv[i], 0);
+      }
+      else {
+         walk.status &= hist_walk(argv[i], index_file, &walk);
+      }
+   }
+
+   hist_index_prune(walk.index);
+   walk.status &= hist_index_save(walk.index);
+   hist_index_free(walk.index);
+
+   return ! walk.status;
+}
 
 /*
- * Create a hist_entry struct by reading file stream.
- * Returns pointer to hist_entry or NULL if failed.
+ * Run the search subcommand
  */
-struct hist_entry* read_entry
+int run_search
  (
-   FILE *hist_fh
+   int argc,
+   char **argv,
+   const char *index_path,
+   uint64_t from,
+   uint64_t to
  )
 {
-   struct hist_entry *entry = calloc(1, sizeof(struct hist_entry));
-   if (! entry) {
-      perror("malloc");
-      return NULL;
-   }
+   long hits = hist_index_search(index_path, (const char **) argv + 2, argc - 2,
+      from, to, stdout);
 
-   fgets(entry->type, sizeof(entry->type), hist_fh);
-   if (strlen(entry->type) != 2) {
-      free(entry);
-      return NULL;
-   }
-
-   fgetc(hist_fh);
-   fgets(entry->timestamp, sizeof(entry->timestamp), hist_fh);
-   fgetc(hist_fh);
-   fgets(entry->follow_lines, sizeof(entry->follow_lines), hist_fh);
-   fgetc(hist_fh);
+   if (hits == -1)
+      return 2;
 
-   int follow_lines = atoi(entry->follow_lines);
-   entry->lines = calloc((2 + follow_lines), sizeof(char *));
+   return ! hits;
+}
 
-   for (int i = 0; i <= follow_lines; ++i) {
-      size_t line_size = 0;
+/*
+ * Parse a positive count given on command line
+ */
+int parse_count
+ (
+   const char *option,
+   const char *arg
+ )
+{
+   char *end;
+   long count = strtol(arg, &end, 10);
 
-      if (getline(&entry->lines[i], &line_size, hist_fh) == -1) {
-         warn("Missing lines!");
-         free_hist_entry(entry);
-         return NULL;
-      }
-   }
+   if (! *arg || *end || count < 1 || count > 4096)
+      errx(1, "%s: Invalid count '%s'", option, arg);
 
-   return entry;
+   return count;
 }
 
+
 /*
- * Insert hist_entry pointer.
- * Returns 1 on success or 0 on error.
+ * Parse a rate given on command line, with an optional binary suffix
+ * (K, M, G)
  */
-int insert_hist_entry
+uint64_t parse_rate
  (
-   struct hist_entry ***entries,
-   int *size,
-   struct hist_entry *entry,
-   int pre_alloc_size
+   const char *option,
+   const char *arg
  )
 {
-   struct hist_entry **new_entries;
-   
-   if (! *size) {
-      new_entries = realloc(*entries, pre_alloc_size * sizeof(struct hist_entry *));
-   }
-   else if (*size % pre_alloc_size) {
-      (*entries)[ (*size)++ ] = entry;
-      return 1;
-   }
-   else {
-      new_entries = realloc(*entries, ((*size)+pre_alloc_size) * sizeof(struct hist_entry *));
+   char *end;
+   unsigned long long rate = strtoull(arg, &end, 10);
+
+   switch (*end) {
+      case 'G': case 'g':
+         rate *= 1024;
+         // fall through
+      case 'M': case 'm':
+         rate *= 1024;
+         // fall through
+      case 'K': case 'k':
+         rate *= 1024;
+         ++end;
    }
 
-   if (! new_entries) {
-      perror("realloc");
-      return 0;
-   }
+   if (! *arg || *arg == '-' || *end || ! rate)
+      errx(1, "%s: Invalid rate '%s'", option, arg);
 
-   new_entries[ (*size)++ ] = entry;
-   *entries = new_entries;
-
-   return 1;
+   return rate;
 }
 
 /*
- * Create an array of hist_entry pointers out of file stream.
+ * stat() a file argument, "-" (stdin or stdout) counts as file
+ * Returns 0 on success or -1 if failed.
  */
-struct hist_entry** read_hist
+int stat_arg
  (
-   FILE *hist_fh,
-   int *n_entries
+   const char *path,
+   struct stat *statbuf
  )
 {
-   *n_entries = 0;
-   struct hist_entry **entries = NULL;
-   struct hist_entry *entry;
-
-   while (entry = read_entry(hist_fh)) {
-      if (! insert_hist_entry(&entries, n_entries, entry, 1000)) {
-         perror("realloc");
-         free_hist_entries(entries, *n_entries);
-         return NULL;
-      }
+   if (! strcmp(path, "-")) {
+      memset(statbuf, 0, sizeof(*statbuf));
+      statbuf->st_mode = S_IFIFO;
+      return 0;
    }
 
-   bubble_sort((void **) entries, *n_entries, cmp_hist_entry_timestamp);
-   return entries;
+   return stat(path, statbuf);
 }
 
 /*
- * Merge two list of entries and write the result to file stream.
+ * Run --segmented or --flatten on the remaining arguments
  */
-void merge_entries
+int run_segments
  (
-   struct hist_entry **entries_a,
-   int n_entries_a,
-   struct hist_entry **entries_b,
-   int n_entries_b,
-   FILE *out_stream
+   int flatten,
+   int argc,
+   char **argv,
+   const struct hist_options *opts
  )
 {
-   int i_a = 0;
-   int i_b = 0;
-   int ts_cmp;
-
-   while (i_a < n_entries_a && i_b < n_entries_b) {
-      ts_cmp = strcmp(entries_a[i_a]->timestamp, entries_b[i_b]->timestamp);
+   struct stat statbuf;
+   int is_dir;
 
-      if (ts_cmp <= 0) {
-         // exactly same, skip b, write a
-         if (ts_cmp == 0 && eq_hist_entry(entries_a[i_a], entries_b[i_b])) {
-            ++i_b;
-         }
+   if (argc == 4 && strcmp(argv[1], argv[3]))
+      errx(1, "Segmented merges work inplace on the first argument");
 
-         write_entry(entries_a[i_a++], out_stream);
-      }
-      else {
-         write_entry(entries_b[i_b++], out_stream);
+   if (stat(argv[2], &statbuf) == -1) {
+      // the flat output file does not need to exist
+      if (! flatten) {
+         perror(argv[2]);
+         return 1;
       }
+      statbuf.st_mode = 0;
    }
-
-   while (i_a < n_entries_a)
-      write_entry(entries_a[i_a++], out_stream);
-
-   while (i_b < n_entries_b)
-      write_entry(entries_b[i_b++], out_stream);
+   is_dir = S_ISDIR(statbuf.st_mode);
+
+   if (flatten)
+      return ! (is_dir ? flatten_segment_dirs(argv[1], argv[2], opts)
+                       : flatten_segments(argv[1], argv[2], opts));
+   else
+      return ! (is_dir ? merge_segment_dirs(argv[1], argv[2], opts)
+                       : merge_segments(argv[1], argv[2], opts));
 }
 
 /*
- * Merge two files into one outfile
- * Returns 1 on success, 0 on failure.
+ * Destination, options and status of --export or --import of a
+ * directory tree
  */
-int merge_files
+struct convert_walk
+{
+   const char *dest;
+   const struct hist_options *opts;
+   int status;
+};
+
+/*
+ * hist_walk() callback converting every file of a directory tree into
+ * the same place below the destination
+ */
+int convert_tree_file
  (
-   const char *file1,
-   const char *file2,
-   const char *fileO
+   const char *path,
+   const char *name,
+   int is_dir,
+   void *arg
  )
 {
-   FILE   *file_fh;
-   struct hist_entry **hist1, **hist2;
-   int    n_hist1, n_hist2;
+   struct convert_walk *walk = arg;
+   char *dest = malloc( strlen(walk->dest) + 2 + strlen(name) );
 
-   printf("Merging: %s + %s -> %s\n", file1, file2, fileO);
+   if (! dest)
+      err(1, "malloc");
+   sprintf(dest, "%s/%s", walk->dest, name);
 
-   if (! (file_fh = fopen(file1, "r"))) {
-      perror(file1);
-      return 0;
-   }
-   if (! (hist1 = read_hist(file_fh, &n_hist1))) {
-      warn("%s: Error reading history file", file1);
-      fclose(file_fh);
-      return 0;
-   }
-   
-   if (! (file_fh = freopen(file2, "r", file_fh))) {
-      perror(file2);
-      free_hist_entries(hist1, n_hist1);
-      return 0;
-   }
-   if (! (hist2 = read_hist(file_fh, &n_hist2))) {
-      warn("%s: errors reading history file", file2);
-      free_hist_entries(hist1, n_hist1);
-      fclose(file_fh);
-      return 0;
+   if (! is_dir) {
+      walk->status &= convert_file(path, dest, walk->opts);
    }
-
-   if (! (file_fh = freopen(fileO, "w", file_fh))) {
-      perror(fileO);
-      free_hist_entries(hist1, n_hist1);
-      free_hist_entries(hist2, n_hist2);
-      return 0;
+   else if (mkdir(dest, 0700) == -1 && errno != EEXIST) {
+      perror(dest);
+      free(dest);
+      return -1;
    }
 
-   merge_entries(hist1, n_hist1, hist2, n_hist2, file_fh);
-   free_hist_entries(hist1, n_hist1);
-   free_hist_entries(hist2, n_hist2);
-   fclose(file_fh);
+   free(dest);
    return 1;
 }
 
 /*
- * Copies source to dest. If source and dest are the same file nothing
- * is done and 1 is returned.
- * Returns 1 on success, 0 on failure
+ * Run --export or --import on a file or on all files of a directory tree
  */
-int copy
+int run_convert
  (
-   const char *source,
-   const char *dest
+   int argc,
+   char **argv,
+   const struct hist_options *opts
  )
 {
-   FILE *source_fh, *dest_fh = NULL;
-
+   struct convert_walk walk = { argv[2], opts, 1 };
    struct stat statbuf;
-   if (stat(source, &statbuf) == -1) {
-      perror(source);
-      return 0;
-   }
 
-   int source_ino = statbuf.st_ino;
-   int size = statbuf.st_size;
+   if (argc != 3)
+      errx(1, "--export and --import need a source and a destination");
 
-   // file exists, check if is same file
-   if (stat(dest, &statbuf) != -1) {
-      if (source_ino == statbuf.st_ino) {
-         return 1;
-      }
-   }
-
-   if (! (source_fh = fopen(source, "r"))) {
-      perror(source);
-      return 0;
+   if (stat_arg(argv[1], &statbuf) == -1) {
+      perror(argv[1]);
+      return 1;
    }
 
-   if (! (dest_fh = fopen(dest, "w"))) {
-      fclose(source_fh);
-      perror(dest);
-      return 0;
-   }
+   if (! S_ISDIR(statbuf.st_mode))
+      return ! convert_file(argv[1], argv[2], opts);
 
-   if (sendfile(fileno(dest_fh), fileno(source_fh), NULL, size) == -1) {
-      fclose(source_fh);
-      fclose(dest_fh);
-      perror("copy");
-      return 0;
+   if (mkdir(argv[2], 0700) == -1 && errno != EEXIST) {
+      perror(argv[2]);
+      return 1;
    }
 
-   fclose(source_fh);
-   fclose(dest_fh);
-   return 1;
+   return ! (hist_walk(argv[1], convert_tree_file, &walk) && walk.status);
 }
 
-int merge_dirs
+/*
+ * Run 'serve directory' on stdin and stdout, or 'sync directory
+ * COMMAND' with COMMAND run by the shell on the other end of a socket
+ */
+int run_sync
  (
-   const char *dir1,
-   const char *dir2,
-   const char *dirO
+   int argc,
+   char **argv,
+   const struct hist_options *opts
  )
 {
-   int status = 1;
-   DIR *dir_fh;
-   struct dirent *file;
+   int sock[2];
+   int status;
+   int child_status;
+   pid_t pid;
 
-   dir_fh = opendir(dir1);
-   if (! dir_fh) {
-      perror(dir1);
-      return 0;
-   }
+   // a peer that went away is an error, not a signal
+   signal(SIGPIPE, SIG_IGN);
 
-   while (file = readdir(dir_fh)) {
+   if (! strcmp(argv[1], "serve")) {
+      // stdout carries the protocol, anything else goes to stderr
+      int out_fd = dup(STDOUT_FILENO);
+      if (out_fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+         err(1, "dup");
 
-      if (file->d_type == DT_DIR)
-         continue;
-      if (! strcmp(file->d_name, ".") || ! strcmp(file->d_name, ".."))
-         continue;
+      return ! hist_sync_serve(argv[2], STDIN_FILENO, out_fd, opts);
+   }
 
-      char *file1_path = malloc( strlen(dir1) + 2 + strlen(file->d_name) );
-      strcpy(file1_path, dir1);
-      strcat(file1_path, "/");
-      strcat(file1_path, file->d_name);
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) == -1)
+      err(1, "socketpair");
 
-      char *file2_path = malloc( strlen(dir2) + 2 + strlen(file->d_name) );
-      strcpy(file2_path, dir2);
-      strcat(file2_path, "/");
-      strcat(file2_path, file->d_name);
+   fflush(stdout);
+   if ((pid = fork()) == -1)
+      err(1, "fork");
 
-      char *fileO_path = malloc( strlen(dirO) + 2 + strlen(file->d_name) );
-      strcpy(fileO_path, dirO);
-      strcat(fileO_path, "/");
-      strcat(fileO_path, file->d_name);
+   if (! pid) {
+      if (dup2(sock[1], STDIN_FILENO) == -1 || dup2(sock[1], STDOUT_FILENO) == -1)
+         err(127, "dup2");
+      close(sock[0]);
+      close(sock[1]);
+      execl("/bin/sh", "sh", "-c", argv[3], (char *) NULL);
+      err(127, "/bin/sh");
+   }
 
-      if (access(file2_path, F_OK) != -1) {
-         status &= merge_files(file1_path, file2_path, fileO_path);
-      }
-      else {
-         status &= copy(file1_path, fileO_path);
-      }
+   close(sock[1]);
+   status = hist_sync(argv[2], sock[0], sock[0], opts);
+   close(sock[0]);
 
-      free(file1_path);
-      free(file2_path);
-      free(fileO_path);
+   if (waitpid(pid, &child_status, 0) == -1 || ! WIFEXITED(child_status) ||
+         WEXITSTATUS(child_status)) {
+      warnx("%s: Failed", argv[3]);
+      status = 0;
    }
-   closedir(dir_fh);
 
+   return ! status;
+}
 
-   dir_fh = opendir(dir1);
-   if (! dir_fh) {
-      perror(dir1);
-      return 0;
+int main(int argc, char **argv)
+{
+   struct stat statbuf;
+   struct hist_options opts;
+   int source1_is_dir = 0;
+   int segmented = 0;
+   int flatten = 0;
+   int convert = 0;
+   uint64_t from = 0;
+   uint64_t to = UINT64_MAX;
+   uint64_t read_rate = 0;
+   uint64_t write_rate = 0;
+   uint64_t iops = 0;
+   int opt;
+
+   static const struct option long_options[] = {
+      { "help",         no_argument,       NULL, 'h' },
+      { "types",        required_argument, NULL, 't' },
+      { "drop-types",   required_argument, NULL, 'T' },
+      { "collapse-status", optional_argument, NULL, 'c' },
+      { "segmented",    no_argument,       NULL, 's' },
+      { "flatten",      no_argument,       NULL, 'f' },
+      { "export",       no_argument,       NULL, 'e' },
+      { "import",       no_argument,       NULL, 'i' },
+      { "archive",      no_argument,       NULL, 'a' },
+      { "compress",     no_argument,       NULL, 'z' },
+      { "index",        required_argument, NULL, 'x' },
+      { "from",         required_argument, NULL, 'F' },
+      { "to",           required_argument, NULL, 'U' },
+      { "jobs",         required_argument, NULL, 'j' },
+      { "journal",      required_argument, NULL, 'J' },
+      { "max-read-rate",  required_argument, NULL, 'R' },
+      { "max-write-rate", required_argument, NULL, 'W' },
+      { "max-iops",     required_argument, NULL, 'O' },
+      { "io",           required_argument, NULL, 'I' },
+      { "durability",   required_argument, NULL, 'D' },
+      { "page-cache",   required_argument, NULL, 'P' },
+      { "order",        required_argument, NULL, 'o' },
+      { "cache",        required_argument, NULL, 'C' },
+      { "cache-size",   required_argument, NULL, 'S' },
+      { "dry-run",      no_argument,       NULL, 'n' },
+      { NULL,           0,                 NULL, 0   }
+   };
+
+   hist_options_init(&opts);
+   opts.verbose = 1;
+
+   while ((opt = getopt_long(argc, argv, "hj:", long_options, NULL)) != -1) {
+      switch (opt) {
+         case 't':
+            check_types("--types", optarg);
+            opts.types = optarg;
+            break;
+         case 'T':
+            check_types("--drop-types", optarg);
+            opts.drop_types = optarg;
+            break;
+         case 'c':
+            opts.collapse_status = optarg ? parse_seconds("--collapse-status", optarg) : 60;
+            break;
+         case 's':
+            segmented = 1;
+            break;
+         case 'f':
+            flatten = 1;
+            break;
+         case 'e':
+            convert = 1;
+            opts.archive = 1;
+            break;
+         case 'i':
+            convert = 1;
+            opts.archive = 0;
+            break;
+         case 'a':
+            opts.archive = 1;
+            break;
+         case 'z':
+            opts.compress = 1;
+            break;
+         case 'x':
+            opts.index = optarg;
+            break;
+         case 'F':
+            from = parse_time("--from", optarg, '0');
+            break;
+         case 'U':
+            to = parse_time("--to", optarg, '9');
+            break;
+         case 'j':
+            opts.jobs = parse_count("--jobs", optarg);
+            break;
+         case 'J':
+            opts.journal = optarg;
+            break;
+         case 'R':
+            read_rate = parse_rate("--max-read-rate", optarg);
+            break;
+         case 'W':
+            write_rate = parse_rate("--max-write-rate", optarg);
+            break;
+         case 'O':
+            iops = parse_rate("--max-iops", optarg);
+            break;
+         case 'I':
+            if (! hist_io_backend(optarg))
+               errx(1, "--io: Unknown backend '%s'", optarg);
+            break;
+         case 'o':
+            if (! strcmp(optarg, "readdir"))
+               opts.order = HIST_ORDER_READDIR;
+            else if (! strcmp(optarg, "inode"))
+               opts.order = HIST_ORDER_INODE;
+            else if (! strcmp(optarg, "extent"))
+               opts.order = HIST_ORDER_EXTENT;
+            else
+               errx(1, "--order: Unknown order '%s'", optarg);
+            break;
+         case 'C':
+            opts.cache = optarg;
+            break;
+         case 'S':
+            opts.cache_size = parse_rate("--cache-size", optarg);
+            break;
+         case 'n':
+            opts.dry_run = 1;
+            break;
+         case 'D':
+            if (! hist_io_durability(optarg))
+               errx(1, "--durability: Unknown policy '%s'", optarg);
+            break;
+         case 'P':
+            if (! hist_io_page_cache(optarg))
+               errx(1, "--page-cache: Unknown policy '%s'", optarg);
+            break;
+         default:
+            help(argv[0]);
+      }
    }
 
-   while (file = readdir(dir_fh)) {
+   hist_io_limit(read_rate, write_rate, iops);
 
-      if (file->d_type == DT_DIR)
-         continue;
-      if (! strcmp(file->d_name, ".") || ! strcmp(file->d_name, ".."))
-         continue;
+   const char *prg = argv[0];
+   argc -= optind - 1;
+   argv += optind - 1;
 
-      char *file1_path = malloc( strlen(dir1) + 2 + strlen(file->d_name) );
-      strcpy(file1_path, dir1);
-      strcat(file1_path, "/");
-      strcat(file1_path, file->d_name);
+   // subcommands, unless shadowed by a history file of that name
+   if (argc >= 3 && (! strcmp(argv[1], "index") || ! strcmp(argv[1], "search")) &&
+         stat(argv[1], &statbuf) == -1) {
+      if (! opts.index)
+         errx(1, "%s needs --index", argv[1]);
 
-      char *file2_path = malloc( strlen(dir2) + 2 + strlen(file->d_name) );
-      strcpy(file2_path, dir2);
-      strcat(file2_path, "/");
-      strcat(file2_path, file->d_name);
+      if (! strcmp(argv[1], "index"))
+         return run_index(argc, argv, opts.index);
+      else
+         return run_search(argc, argv, opts.index, from, to);
+   }
 
-      char *fileO_path = malloc( strlen(dirO) + 2 + strlen(file->d_name) );
-      strcpy(fileO_path, dirO);
-      strcat(fileO_path, "/");
-      strcat(fileO_path, file->d_name);
+   if (argc >= 3 && ! strcmp(argv[1], "stats") && stat(argv[1], &statbuf) == -1)
+      return ! hist_stats((const char **) argv + 2, argc - 2, &opts, stdout);
 
-      if (access(file1_path, F_OK) == -1) {
-         status &= copy(file2_path, fileO_path);
-      }
+   if (((argc == 3 && ! strcmp(argv[1], "serve")) || (argc == 4 && ! strcmp(argv[1], "sync"))) &&
+         stat(argv[1], &statbuf) == -1) {
+      if (opts.types || opts.drop_types || opts.collapse_status >= 0 || opts.dry_run)
+         errx(1, "%s syncs whole histories, filters and --dry-run do not apply", argv[1]);
 
-      free(file1_path);
-      free(file2_path);
-      free(fileO_path);
+      // the protocol runs on stdout
+      if (! strcmp(argv[1], "serve"))
+         opts.verbose = 0;
+      return run_sync(argc, argv, &opts);
    }
-   closedir(dir_fh);
 
-   return status;
-}
+   if (argc < 3 || argc > 4)
+      help(prg);
 
-void help(const char *prg)
-{
-   fprintf(stderr,
-    "Merge mcabber history files\n\n"
-    "Usage:\n"
-    "\t%s directory1 directory2 [outdir]\n"
-    "\t%s file1 file2 [outfile]\n\n"
-    "If 'outdir' or 'outfile' are missing this program works inplace on the first argument,\n"
-    "meaning '%s arg1 arg2' is the same as '%s arg1 arg2 arg1'.\n"
-   ,prg,prg,prg,prg);
-      
-   exit(1);
-}
+   if (segmented + flatten + convert > 1)
+      errx(1, "--segmented, --flatten, --export and --import can not be combined");
 
-int main(int argc, char **argv)
-{
-   struct stat statbuf;
-   int source1_is_dir = 0;
+   if (opts.dry_run && segmented + flatten + convert)
+      errx(1, "--dry-run only plans merges of files and directories");
 
-   if (argc < 3 || argc > 4)
-      help(argv[0]);
+   // the plan lines are the output
+   if (opts.dry_run)
+      opts.verbose = 0;
 
-   for (int i = 1; i < argc; ++i)
-      if (strcmp(argv[i], "--"))
-         break;
-      else if (strcmp(argv[i], "--help") || strcmp(argv[i], "-h"))
-         help(argv[0]);
+   if (convert) {
+      // keep the converted history on stdout clean
+      if (argc == 3 && ! strcmp(argv[2], "-"))
+         opts.verbose = 0;
+      return run_convert(argc, argv, &opts) | ! hist_io_commit();
+   }
+
+   if (segmented || flatten)
+      return run_segments(flatten, argc, argv, &opts) | ! hist_io_commit();
 
    // check first arg, determine type
-   if (stat(argv[1], &statbuf) == -1) {
+   if (stat_arg(argv[1], &statbuf) == -1) {
       perror(argv[1]);
       return 1;
    }
    source1_is_dir = S_ISDIR(statbuf.st_mode);
 
    // check second arg, check if type matches first arg
-   if (stat(argv[2], &statbuf) == -1) {
+   if (stat_arg(argv[2], &statbuf) == -1) {
       perror(argv[2]);
       return 1;
    }
    if (source1_is_dir != S_ISDIR(statbuf.st_mode))
       errx(1, "Both argumens must be of same type (directory or file)");
 
+   if (! strcmp(argv[1], "-") && ! strcmp(argv[2], "-"))
+      errx(1, "Only one input can be read from stdin");
+
+   // keep the merged history on stdout clean
+   if (! strcmp(argv[argc == 4 ? 3 : 1], "-"))
+      opts.verbose = 0;
+
    // we got third arg
    if (argc == 4) {
       // first two args were directories, the third one must be one, too
@@ -559,16 +730,16 @@ int main(int argc, char **argv)
             errx(1, "Destination has to be a directory");
          }
 
-         return ! merge_dirs(argv[1], argv[2], argv[3]);
+         return ! merge_dirs(argv[1], argv[2], argv[3], &opts);
       }
       else {
-         return ! merge_files(argv[1], argv[2], argv[3]);
+         return ! merge_files(argv[1], argv[2], argv[3], &opts);
       }
    }
    else if (source1_is_dir) {
-      return ! merge_dirs(argv[1], argv[2], argv[1]);
+      return ! merge_dirs(argv[1], argv[2], argv[1], &opts);
    }
    else {
-      return ! merge_files(argv[1], argv[2], argv[1]);
+      return ! merge_files(argv[1], argv[2], argv[1], &opts);
    }
 }
@@ -0,0 +1,3786 @@
+/*
+ * libmcabberhist - read, merge and write mcabber history files
+ * Copyright (C) 2016 Benjamin Abendroth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <error.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "mcabberhist.h"
+
+#define HIST_POOL_CHUNK_SIZE (64 * 1024)
+
+// Entries that some entry is HIST_SORT_MAX_DEPTH places or more out
+// of order are radix sorted, if there are at least HIST_SORT_RADIX_MIN
+#define HIST_SORT_MAX_DEPTH 16
+#define HIST_SORT_RADIX_MIN 256
+
+// Segment files are named by month (YYYYMM)
+#define HIST_SEGMENT_NAME_LEN 6
+
+/*
+ * Block of interned strings
+ */
+struct hist_pool_chunk
+{
+   struct hist_pool_chunk *next;
+   size_t size;
+   size_t used;
+   char data[];
+};
+
+/*
+ * Hash table slot of an interned string
+ */
+struct hist_pool_slot
+{
+   uint64_t hash;
+   size_t len;
+   const char *str;
+};
+
+/*
+ * Pool of interned strings
+ */
+struct hist_pool
+{
+   // Arena holding the strings, newest chunk first
+   struct hist_pool_chunk *chunks;
+
+   // Open addressing hash table, size is a power of two
+   struct hist_pool_slot *slots;
+   size_t size;
+   size_t used;
+};
+
+/*
+ * Binary archives start with this line, which is never a valid
+ * entry header
+ */
+#define HIST_ARCHIVE_MAGIC "\x89MHA\r\n\x1a\n"
+#define HIST_ARCHIVE_MAGIC_LEN 8
+#define HIST_ARCHIVE_VERSION 1
+
+// Archive flags
+#define HIST_ARCHIVE_COMPRESSED 0x01
+
+// Type codes of passthrough records in archives, other types start
+// at HIST_ARCHIVE_FIRST_TYPE
+#define HIST_ARCHIVE_RAW 0
+#define HIST_ARCHIVE_RAW_TS 1
+#define HIST_ARCHIVE_FIRST_TYPE 2
+
+/*
+ * Growable byte buffer
+ */
+struct hist_buf
+{
+   char *data;
+   size_t len;
+   size_t size;
+};
+
+/*
+ * Columns of a binary archive being written
+ */
+struct hist_archive_writer
+{
+   int compress;
+   uint64_t n_entries;
+
+   // Entry types seen so far, index + HIST_ARCHIVE_FIRST_TYPE is the code
+   char types[256 - HIST_ARCHIVE_FIRST_TYPE][2];
+   int n_types;
+
+   // Timestamp key of the previous entry, keys are delta-encoded
+   uint64_t last_key;
+
+   struct hist_buf codes;
+   struct hist_buf keys;
+   struct hist_buf follow;
+   struct hist_buf lens;
+   struct hist_buf bodies;
+};
+
+/*
+ * Binary archive being read, with one cursor per column
+ */
+struct hist_archive
+{
+   char *payload;
+   size_t payload_size;
+
+   uint64_t n_entries;
+   uint64_t i;
+
+   char types[256 - HIST_ARCHIVE_FIRST_TYPE][2];
+   int n_types;
+
+   uint64_t key;
+
+   const unsigned char *codes;
+   const unsigned char *keys;
+   const unsigned char *follow;
+   const unsigned char *lens;
+   const unsigned char *bodies;
+   const unsigned char *end;
+};
+
+/*
+ * Streaming reader over the entries of a history file
+ */
+struct hist_reader
+{
+   FILE *hist_fh;
+
+   // Whether hist_fh was opened by hist_reader_open()
+   int owns_fh;
+
+   // Pool the bodies of all entries are interned in
+   struct hist_pool *pool;
+
+   // Lookahead line, read but not yet consumed by read_entry()
+   char *line;
+   size_t line_size;
+   ssize_t line_len;
+
+   // Lines of the current entry, collected before interning
+   char *body;
+   size_t body_size;
+   size_t body_len;
+
+   // Timestamp of the last well-formed entry, given to passthrough
+   // records so sorting keeps them next to their neighbour
+   char last_timestamp[19];
+
+   // Count of passthrough records created for malformed input
+   int n_malformed;
+
+   // Comma separated entry types to keep or to drop, NULL for all
+   const char *types;
+   const char *drop_types;
+
+   // Set once the first line has been checked for an archive header
+   int started;
+
+   // Decoded binary archive, NULL when reading text
+   struct hist_archive *archive;
+
+   // Set when reading stopped because of an error, not end of file
+   int error;
+
+   // Set by read_hist() if the entries were already in order
+   int in_order;
+
+   // Position in the file after the lookahead line, and start of the
+   // entry returned last (its number when reading an archive)
+   long long pos;
+   long long entry_offset;
+};
+
+/*
+ * Fill options with the defaults
+ */
+void hist_options_init
+ (
+   struct hist_options *opts
+ )
+{
+   memset(opts, 0, sizeof(*opts));
+   opts->collapse_status = -1;
+   opts->cache_size = HIST_CACHE_SIZE;
+}
+
+/*
+ * Frees an hist_entry
+ */
+void free_hist_entry
+ (
+   struct hist_entry *entry
+ )
+{
+   // long bodies belong to the pool
+   free(entry);
+}
+
+/*
+ * Frees an array of entries
+ */
+void free_hist_entries
+ (
+   struct hist_entry **entries,
+   int size
+ )
+{
+   for (int i = 0; i < size; ++i)
+      free_hist_entry(entries[i]);
+   free(entries);
+}
+
+/*
+ * Hash function for interned strings (FNV-1a)
+ */
+static uint64_t hash_string
+ (
+   const char *str,
+   size_t len
+ )
+{
+   uint64_t hash = 14695981039346656037ULL;
+
+   for (size_t i = 0; i < len; ++i) {
+      hash ^= (unsigned char) str[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return hash;
+}
+
+/*
+ * Create an empty string pool.
+ * Returns pointer to hist_pool or NULL if failed.
+ */
+struct hist_pool* hist_pool_new
+ (
+   void
+ )
+{
+   struct hist_pool *pool = calloc(1, sizeof(struct hist_pool));
+   if (! pool) {
+      perror("malloc");
+      return NULL;
+   }
+
+   pool->size = 1024;
+   if (! (pool->slots = calloc(pool->size, sizeof(struct hist_pool_slot)))) {
+      perror("calloc");
+      free(pool);
+      return NULL;
+   }
+
+   return pool;
+}
+
+/*
+ * Frees a pool and every string interned in it
+ */
+void hist_pool_free
+ (
+   struct hist_pool *pool
+ )
+{
+   struct hist_pool_chunk *chunk, *next;
+
+   for (chunk = pool->chunks; chunk; chunk = next) {
+      next = chunk->next;
+      free(chunk);
+   }
+
+   free(pool->slots);
+   free(pool);
+}
+
+/*
+ * Copy len bytes into the arena of pool, followed by a null byte.
+ * Returns pointer to the copy or NULL if failed.
+ */
+static char* pool_store
+ (
+   struct hist_pool *pool,
+   const char *str,
+   size_t len
+ )
+{
+   struct hist_pool_chunk *chunk = pool->chunks;
+
+   if (! chunk || chunk->size - chunk->used < len + 1) {
+      size_t size = HIST_POOL_CHUNK_SIZE;
+
+      // big strings get a chunk of their own behind the current one
+      if (len + 1 > size / 4)
+         size = len + 1;
+
+      if (! (chunk = malloc(sizeof(struct hist_pool_chunk) + size))) {
+         perror("malloc");
+         return NULL;
+      }
+      chunk->size = size;
+      chunk->used = 0;
+
+      if (size == HIST_POOL_CHUNK_SIZE || ! pool->chunks) {
+         chunk->next = pool->chunks;
+         pool->chunks = chunk;
+      }
+      else {
+         chunk->next = pool->chunks->next;
+         pool->chunks->next = chunk;
+      }
+   }
+
+   char *copy = chunk->data + chunk->used;
+   memcpy(copy, str, len);
+   copy[len] = '\0';
+   chunk->used += len + 1;
+   return copy;
+}
+
+/*
+ * Double the hash table of pool.
+ * Returns 1 on success or 0 on error.
+ */
+static int pool_grow
+ (
+   struct hist_pool *pool
+ )
+{
+   size_t size = pool->size * 2;
+   struct hist_pool_slot *slots = calloc(size, sizeof(struct hist_pool_slot));
+   if (! slots) {
+      perror("calloc");
+      return 0;
+   }
+
+   for (size_t i = 0; i < pool->size; ++i) {
+      if (! pool->slots[i].str)
+         continue;
+
+      size_t j = pool->slots[i].hash & (size - 1);
+      while (slots[j].str)
+         j = (j + 1) & (size - 1);
+      slots[j] = pool->slots[i];
+   }
+
+   free(pool->slots);
+   pool->slots = slots;
+   pool->size = size;
+   return 1;
+}
+
+/*
+ * Intern len bytes of str. Equal strings interned in the same pool
+ * return the same pointer.
+ * Returns pointer to the interned string or NULL if failed.
+ */
+const char* hist_pool_intern
+ (
+   struct hist_pool *pool,
+   const char *str,
+   size_t len
+ )
+{
+   uint64_t hash = hash_string(str, len);
+   size_t i = hash & (pool->size - 1);
+
+   for (; pool->slots[i].str; i = (i + 1) & (pool->size - 1)) {
+      struct hist_pool_slot *slot = &pool->slots[i];
+
+      if (slot->hash == hash && slot->len == len && ! memcmp(slot->str, str, len))
+         return slot->str;
+   }
+
+   // keep the table at most half full
+   if (2 * (pool->used + 1) > pool->size) {
+      if (! pool_grow(pool))
+         return NULL;
+
+      i = hash & (pool->size - 1);
+      while (pool->slots[i].str)
+         i = (i + 1) & (pool->size - 1);
+   }
+
+   char *copy = pool_store(pool, str, len);
+   if (! copy)
+      return NULL;
+
+   pool->slots[i].hash = hash;
+   pool->slots[i].len = len;
+   pool->slots[i].str = copy;
+   ++pool->used;
+   return copy;
+}
+
+/*
+ * Generic bubble sort algorithm
+ */
+static void bubble_sort
+ (
+   void **array,
+   size_t size,
+   int (*compare)(const void*, const void*)
+ )
+{
+   int n = size;
+
+   do {
+      int new_n = 1;
+
+      for (int i = 0; i < n - 1; ++i) {
+         if (compare(array[i], array[i+1]) > 0) {
+            void *tmp = array[i];
+            array[i] = array[i+1];
+            array[i+1] = tmp;
+
+            new_n = i + 1;
+         }
+      }
+      n = new_n;
+   }
+   while (n > 1);
+}
+
+/*
+ * Compare function for bubblesort
+ */
+static int cmp_hist_entry_timestamp(const void* a, const void* b)
+{
+   return strcmp(
+      ((struct hist_entry*) a)->timestamp,
+      ((struct hist_entry*) b)->timestamp
+   );
+}
+
+/*
+ * Radix sort key of an entry, ordered like cmp_hist_entry_timestamp().
+ * Passthrough records before the first entry have an empty timestamp.
+ */
+static uint64_t entry_sort_key
+ (
+   const struct hist_entry *entry
+ )
+{
+   return entry->timestamp[0] ? hist_timestamp_key(entry->timestamp) + 1 : 0;
+}
+
+/*
+ * Check if entries are too far out of order for bubble_sort(): some
+ * entry is preceded by HIST_SORT_MAX_DEPTH greater ones, so it would
+ * take as many passes.
+ */
+static int is_disordered
+ (
+   struct hist_entry **entries,
+   int n_entries
+ )
+{
+   for (int i = 1; i < n_entries; ++i) {
+      if (cmp_hist_entry_timestamp(entries[i - 1], entries[i]) <= 0)
+         continue;
+
+      int depth = 1;
+      while (depth < HIST_SORT_MAX_DEPTH && depth < i &&
+             cmp_hist_entry_timestamp(entries[i - depth - 1], entries[i]) > 0)
+         ++depth;
+
+      if (depth == HIST_SORT_MAX_DEPTH)
+         return 1;
+   }
+
+   return 0;
+}
+
+/*
+ * Key and entry, sorted by radix_sort()
+ */
+struct hist_sort_item
+{
+   uint64_t key;
+   struct hist_entry *entry;
+};
+
+/*
+ * Stable LSD radix sort of entries by timestamp, one byte of the packed
+ * key per pass. Bytes equal in all keys (the century, mostly the year)
+ * need no pass.
+ * Returns 1 on success or 0 if out of memory (entries are unchanged).
+ */
+static int radix_sort
+ (
+   struct hist_entry **entries,
+   int n_entries
+ )
+{
+   struct hist_sort_item *items = malloc(2 * n_entries * sizeof(struct hist_sort_item));
+   struct hist_sort_item *from, *to, *tmp;
+   size_t (*counts)[256] = calloc(8, sizeof(*counts));
+
+   if (! items || ! counts) {
+      free(items);
+      free(counts);
+      return 0;
+   }
+
+   // one pass counts the digits of all bytes
+   for (int i = 0; i < n_entries; ++i) {
+      uint64_t key = entry_sort_key(entries[i]);
+
+      items[i].key = key;
+      items[i].entry = entries[i];
+      for (int byte = 0; byte < 8; ++byte)
+         ++counts[byte][(key >> (8 * byte)) & 0xff];
+   }
+
+   from = items;
+   to = items + n_entries;
+
+   for (int byte = 0; byte < 8; ++byte) {
+      size_t offset = 0;
+      int shift = 8 * byte;
+
+      if (counts[byte][(from[0].key >> shift) & 0xff] == (size_t) n_entries)
+         continue;
+
+      for (int digit = 0; digit < 256; ++digit) {
+         size_t count = counts[byte][digit];
+         counts[byte][digit] = offset;
+         offset += count;
+      }
+
+      for (int i = 0; i < n_entries; ++i)
+         to[counts[byte][(from[i].key >> shift) & 0xff]++] = from[i];
+
+      tmp = from;
+      from = to;
+      to = tmp;
+   }
+
+   for (int i = 0; i < n_entries; ++i)
+      entries[i] = from[i].entry;
+
+   free(items);
+   free(counts);
+   return 1;
+}
+
+/*
+ * Sort entries by timestamp, keeping the order of equal ones. Mostly
+ * sorted entries (mcabber writes some status entries late) take a few
+ * passes of bubble_sort(), radix_sort() handles the rest (e.g. several
+ * exports concatenated).
+ */
+static void sort_hist_entries
+ (
+   struct hist_entry **entries,
+   int n_entries
+ )
+{
+   if (n_entries >= HIST_SORT_RADIX_MIN && is_disordered(entries, n_entries) &&
+         radix_sort(entries, n_entries))
+      return;
+
+   bubble_sort((void **) entries, n_entries, cmp_hist_entry_timestamp);
+}
+
+/*
+ * Fully compare two hist entries.
+ * Both entries have to be read into the same pool.
+ */
+int eq_hist_entry
+ (
+  const struct hist_entry *a,
+  const struct hist_entry *b
+ )
+{
+   if (
+         strcmp(a->type, b->type) ||
+         strcmp(a->timestamp, b->timestamp) ||
+         strcmp(a->follow_lines, b->follow_lines) ||
+         a->body_len != b->body_len
+      )
+         return 0;
+
+   if (a->body_len <= HIST_INLINE_BODY)
+      return ! memcmp(a->inline_body, b->inline_body, a->body_len);
+
+   return a->body == b->body;
+}
+
+/*
+ * Write out original mcabber history line
+ */
+void write_entry
+ (
+   struct hist_entry *entry,
+   FILE *out_stream
+ )
+{
+   if (! entry->passthrough) {
+      fputs(entry->type, out_stream);
+      fputc(' ', out_stream);
+      fputs(entry->timestamp, out_stream);
+      fputc(' ', out_stream);
+      fputs(entry->follow_lines, out_stream);
+      fputc(' ', out_stream);
+   }
+
+   fwrite(hist_entry_body(entry), 1, entry->body_len, out_stream);
+}
+
+
+/*
+ * Check if line starts with a valid entry header
+ * ("MR 20100901T13:39:14Z 000 ").
+ */
+static int is_entry_header
+ (
+   const char *line,
+   ssize_t line_len
+ )
+{
+   static const char ts_format[] = "ddddddddTdd:dd:ddZ";
+
+   if (line_len < 26)
+      return 0;
+
+   if (line[0] < 'A' || line[0] > 'Z' || line[1] <= ' ' || line[1] > '~')
+      return 0;
+
+   if (line[2] != ' ' || line[21] != ' ' || line[25] != ' ')
+      return 0;
+
+   for (int i = 0; i < 18; ++i) {
+      if (ts_format[i] == 'd') {
+         if (line[3 + i] < '0' || line[3 + i] > '9')
+            return 0;
+      }
+      else if (line[3 + i] != ts_format[i])
+         return 0;
+   }
+
+   for (int i = 22; i < 25; ++i)
+      if (line[i] < '0' || line[i] > '9')
+         return 0;
+
+   return 1;
+}
+
+/*
+ * Make sure the reader holds a lookahead line.
+ * Returns 1 if a line is available, 0 on end of file.
+ */
+static int fetch_line
+ (
+   struct hist_reader *reader
+ )
+{
+   if (reader->line_len == -1) {
+      reader->line_len = getline(&reader->line, &reader->line_size, reader->hist_fh);
+
+      if (reader->line_len != -1)
+         reader->pos += reader->line_len;
+   }
+
+   return reader->line_len != -1;
+}
+
+/*
+ * Move the lookahead line to the end of the body buffer.
+ * Returns 1 on success or 0 on error.
+ */
+static int consume_line
+ (
+   struct hist_reader *reader
+ )
+{
+   size_t len = reader->line_len;
+
+   if (reader->body_len + len > reader->body_size) {
+      size_t size = 2 * (reader->body_len + len);
+      char *body = realloc(reader->body, size);
+      if (! body) {
+         perror("realloc");
+         return 0;
+      }
+      reader->body = body;
+      reader->body_size = size;
+   }
+
+   memcpy(reader->body + reader->body_len, reader->line, len);
+   reader->body_len += len;
+   reader->line_len = -1;
+   return 1;
+}
+
+/*
+ * Set the body of entry to len bytes of data. Short bodies are copied
+ * into the entry, longer ones are interned. Readers without pool point
+ * long bodies at data itself.
+ * Returns 1 on success or 0 on error.
+ */
+static int set_body
+ (
+   struct hist_reader *reader,
+   struct hist_entry *entry,
+   const char *data,
+   size_t len
+ )
+{
+   entry->body_len = len;
+
+   if (len <= HIST_INLINE_BODY) {
+      memcpy(entry->inline_body, data, len);
+      return 1;
+   }
+
+   if (! reader->pool) {
+      entry->body = data;
+      return 1;
+   }
+
+   entry->body = hist_pool_intern(reader->pool, data, len);
+   return entry->body != NULL;
+}
+
+/*
+ * Set the body of entry to the bytes of the body buffer, starting at
+ * offset.
+ * Returns 1 on success or 0 on error.
+ */
+static int intern_body
+ (
+   struct hist_reader *reader,
+   struct hist_entry *entry,
+   size_t offset
+ )
+{
+   return set_body(reader, entry, reader->body + offset, reader->body_len - offset);
+}
+
+/*
+ * Turn entry into a passthrough record holding the whole body buffer.
+ * Header fields are emptied, the record sorts with the last
+ * well-formed entry.
+ * Returns 1 on success or 0 on error.
+ */
+static int make_passthrough
+ (
+   struct hist_reader *reader,
+   struct hist_entry *entry
+ )
+{
+   entry->passthrough = 1;
+   entry->type[0] = '\0';
+   entry->follow_lines[0] = '\0';
+   strcpy(entry->timestamp, reader->last_timestamp);
+   ++reader->n_malformed;
+
+   return intern_body(reader, entry, 0);
+}
+
+/*
+ * Check if type is in a comma separated list of types.
+ * A single letter in the list matches all types starting with it.
+ */
+static int type_in_list
+ (
+   const char *type,
+   const char *list
+ )
+{
+   for (const char *it = list; *it; ) {
+      size_t len = strcspn(it, ",");
+
+      if (len == 1 && it[0] == type[0])
+         return 1;
+      if (len == 2 && it[0] == type[0] && it[1] == type[1])
+         return 1;
+
+      it += len;
+      if (*it)
+         ++it;
+   }
+
+   return 0;
+}
+
+/*
+ * Check if entries of type pass the filter of reader
+ */
+static int keep_type
+ (
+   const struct hist_reader *reader,
+   const char *type
+ )
+{
+   if (reader->types && ! type_in_list(type, reader->types))
+      return 0;
+   if (reader->drop_types && type_in_list(type, reader->drop_types))
+      return 0;
+   return 1;
+}
+
+/*
+ * Skip the entry whose header is the lookahead line. Its lines are
+ * collected in the body buffer, so an entry truncated by the end of
+ * the file can still be kept as is, like an unfiltered one.
+ * Returns 1 if skipped, 0 if truncated or on error (reader->error is
+ * set then).
+ */
+static int skip_entry
+ (
+   struct hist_reader *reader
+ )
+{
+   int follow_lines = atoi(reader->line + 22);
+   char timestamp[18];
+
+   memcpy(timestamp, reader->line + 3, 18);
+   reader->body_len = 0;
+
+   for (int i = 0; i <= follow_lines; ++i) {
+      if (i && ! fetch_line(reader))
+         return 0;
+
+      if (! consume_line(reader)) {
+         reader->error = 1;
+         return 0;
+      }
+   }
+
+   memcpy(reader->last_timestamp, timestamp, 18);
+   return 1;
+}
+
+/*
+ * Make sure buf has room for len more bytes.
+ * Returns 1 on success or 0 on error.
+ */
+static int buf_reserve
+ (
+   struct hist_buf *buf,
+   size_t len
+ )
+{
+   if (buf->len + len <= buf->size)
+      return 1;
+
+   size_t size = buf->size ? buf->size : 4096;
+   while (size < buf->len + len)
+      size *= 2;
+
+   char *data = realloc(buf->data, size);
+   if (! data) {
+      perror("realloc");
+      return 0;
+   }
+
+   buf->data = data;
+   buf->size = size;
+   return 1;
+}
+
+/*
+ * Append len bytes to buf.
+ * Returns 1 on success or 0 on error.
+ */
+static int buf_put
+ (
+   struct hist_buf *buf,
+   const void *data,
+   size_t len
+ )
+{
+   if (! buf_reserve(buf, len))
+      return 0;
+
+   memcpy(buf->data + buf->len, data, len);
+   buf->len += len;
+   return 1;
+}
+
+/*
+ * Append value to buf as LEB128 varint.
+ * Returns 1 on success or 0 on error.
+ */
+static int buf_put_varint
+ (
+   struct hist_buf *buf,
+   uint64_t value
+ )
+{
+   if (! buf_reserve(buf, 10))
+      return 0;
+
+   do {
+      unsigned char byte = value & 0x7f;
+      value >>= 7;
+      buf->data[buf->len++] = byte | (value ? 0x80 : 0);
+   }
+   while (value);
+
+   return 1;
+}
+
+/*
+ * Read a LEB128 varint at *pos, not reading past end.
+ * Returns 1 on success or 0 if the varint is truncated.
+ */
+static int get_varint
+ (
+   const unsigned char **pos,
+   const unsigned char *end,
+   uint64_t *value
+ )
+{
+   *value = 0;
+
+   for (int shift = 0; *pos < end && shift < 64; shift += 7) {
+      unsigned char byte = *(*pos)++;
+      *value |= (uint64_t) (byte & 0x7f) << shift;
+      if (! (byte & 0x80))
+         return 1;
+   }
+
+   return 0;
+}
+
+/*
+ * Skip n varints at *pos, not reading past end.
+ * Returns 1 on success or 0 if a varint is truncated.
+ */
+static int skip_varints
+ (
+   const unsigned char **pos,
+   const unsigned char *end,
+   uint64_t n
+ )
+{
+   uint64_t value;
+
+   for (uint64_t i = 0; i < n; ++i)
+      if (! get_varint(pos, end, &value))
+         return 0;
+
+   return 1;
+}
+
+/*
+ * Pack a timestamp (20100901T13:39:14Z) into an integer (20100901133914),
+ * ordered like the timestamp strings.
+ */
+uint64_t hist_timestamp_key
+ (
+   const char *ts
+ )
+{
+   uint64_t key = 0;
+
+   for (int i = 0; i < 18; ++i)
+      if (ts[i] >= '0' && ts[i] <= '9')
+         key = key * 10 + (ts[i] - '0');
+
+   return key;
+}
+
+/*
+ * Unpack a key made by hist_timestamp_key() into ts
+ */
+static void key_timestamp
+ (
+   uint64_t key,
+   char *ts
+ )
+{
+   snprintf(ts, 19, "%08lluT%02u:%02u:%02uZ",
+      (unsigned long long) (key / 1000000),
+      (unsigned) (key / 10000 % 100),
+      (unsigned) (key / 100 % 100),
+      (unsigned) (key % 100));
+}
+
+/*
+ * Create a writer collecting entries for a binary archive.
+ * Returns pointer to hist_archive_writer or NULL if failed.
+ */
+struct hist_archive_writer* hist_archive_writer_new
+ (
+   int compress
+ )
+{
+   struct hist_archive_writer *writer = calloc(1, sizeof(struct hist_archive_writer));
+   if (! writer) {
+      perror("calloc");
+      return NULL;
+   }
+
+   writer->compress = compress;
+   return writer;
+}
+
+/*
+ * Frees a writer and all collected entries
+ */
+void hist_archive_writer_free
+ (
+   struct hist_archive_writer *writer
+ )
+{
+   free(writer->codes.data);
+   free(writer->keys.data);
+   free(writer->follow.data);
+   free(writer->lens.data);
+   free(writer->bodies.data);
+   free(writer);
+}
+
+/*
+ * Add an entry to the archive. Entries are kept in the order added.
+ * Returns 1 on success or 0 on error.
+ */
+int hist_archive_add
+ (
+   struct hist_archive_writer *writer,
+   const struct hist_entry *entry
+ )
+{
+   unsigned char code;
+   uint64_t key = entry->timestamp[0] ? hist_timestamp_key(entry->timestamp) : writer->last_key;
+   int64_t delta = (int64_t) (key - writer->last_key);
+
+   if (entry->passthrough) {
+      code = entry->timestamp[0] ? HIST_ARCHIVE_RAW_TS : HIST_ARCHIVE_RAW;
+   }
+   else {
+      int i;
+
+      for (i = 0; i < writer->n_types; ++i)
+         if (! memcmp(writer->types[i], entry->type, 2))
+            break;
+
+      if (i == writer->n_types) {
+         if (i == 256 - HIST_ARCHIVE_FIRST_TYPE) {
+            warnx("Too many entry types for an archive");
+            return 0;
+         }
+         memcpy(writer->types[writer->n_types++], entry->type, 2);
+      }
+
+      code = i + HIST_ARCHIVE_FIRST_TYPE;
+   }
+
+   // zigzag, input order is kept, so keys may go backwards
+   if (! buf_put(&writer->codes, &code, 1) ||
+       ! buf_put_varint(&writer->keys, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63)) ||
+       ! buf_put_varint(&writer->follow, entry->passthrough ? 0 : atoi(entry->follow_lines)) ||
+       ! buf_put_varint(&writer->lens, entry->body_len) ||
+       ! buf_put(&writer->bodies, hist_entry_body(entry), entry->body_len))
+      return 0;
+
+   writer->last_key = key;
+   ++writer->n_entries;
+   return 1;
+}
+
+/*
+ * Write the collected entries as binary archive to out_stream.
+ * Returns 1 on success or 0 on error.
+ */
+int hist_archive_write
+ (
+   struct hist_archive_writer *writer,
+   FILE *out_stream
+ )
+{
+   struct hist_buf header = { 0 };
+   struct hist_buf payload = { 0 };
+   int status = 1;
+
+   status &= buf_put_varint(&payload, writer->n_types);
+   status &= buf_put(&payload, writer->types, 2 * writer->n_types);
+   status &= buf_put(&payload, writer->codes.data, writer->codes.len);
+   status &= buf_put(&payload, writer->keys.data, writer->keys.len);
+   status &= buf_put(&payload, writer->follow.data, writer->follow.len);
+   status &= buf_put(&payload, writer->lens.data, writer->lens.len);
+   status &= buf_put(&payload, writer->bodies.data, writer->bodies.len);
+
+   unsigned char version = HIST_ARCHIVE_VERSION;
+   unsigned char flags = writer->compress ? HIST_ARCHIVE_COMPRESSED : 0;
+
+   status &= buf_put(&header, HIST_ARCHIVE_MAGIC, HIST_ARCHIVE_MAGIC_LEN);
+   status &= buf_put(&header, &version, 1);
+   status &= buf_put(&header, &flags, 1);
+   status &= buf_put_varint(&header, writer->n_entries);
+   status &= buf_put_varint(&header, payload.len);
+
+   if (status && writer->compress) {
+      uLongf size = compressBound(payload.len);
+      char *compressed = malloc(size);
+
+      if (! compressed) {
+         perror("malloc");
+         status = 0;
+      }
+      else if (compress2((Bytef *) compressed, &size, (Bytef *) payload.data, payload.len,
+                         Z_DEFAULT_COMPRESSION) != Z_OK) {
+         warnx("Compressing archive failed");
+         free(compressed);
+         status = 0;
+      }
+      else {
+         free(payload.data);
+         payload.data = compressed;
+         payload.len = size;
+      }
+   }
+
+   if (status) {
+      fwrite(header.data, 1, header.len, out_stream);
+      fwrite(payload.data, 1, payload.len, out_stream);
+      status = ! ferror(out_stream);
+   }
+
+   free(header.data);
+   free(payload.data);
+   return status;
+}
+
+/*
+ * Check if line is the first line of a binary archive
+ */
+static int is_archive_magic
+ (
+   const char *line,
+   ssize_t line_len
+ )
+{
+   // the magic ends its own line after "\r\n"
+   return line_len == 6 && ! memcmp(line, HIST_ARCHIVE_MAGIC, 6);
+}
+
+/*
+ * Read the rest of the binary archive whose first line is the
+ * lookahead line and set up the column cursors.
+ * Returns 1 on success or 0 on error.
+ */
+static int load_archive
+ (
+   struct hist_reader *reader
+ )
+{
+   struct hist_buf data = { 0 };
+   struct hist_archive *archive;
+   char chunk[65536];
+   size_t n;
+
+   buf_put(&data, reader->line, reader->line_len);
+   reader->line_len = -1;
+
+   while ((n = fread(chunk, 1, sizeof(chunk), reader->hist_fh)) > 0)
+      if (! buf_put(&data, chunk, n)) {
+         free(data.data);
+         return 0;
+      }
+
+   if (ferror(reader->hist_fh)) {
+      perror("fread");
+      free(data.data);
+      return 0;
+   }
+
+   if (! (archive = calloc(1, sizeof(struct hist_archive)))) {
+      perror("calloc");
+      free(data.data);
+      return 0;
+   }
+   reader->archive = archive;
+
+   const unsigned char *pos = (unsigned char *) data.data + HIST_ARCHIVE_MAGIC_LEN;
+   const unsigned char *end = (unsigned char *) data.data + data.len;
+   uint64_t payload_size, n_types;
+
+   if (data.len < HIST_ARCHIVE_MAGIC_LEN + 2 ||
+         memcmp(data.data, HIST_ARCHIVE_MAGIC, HIST_ARCHIVE_MAGIC_LEN) ||
+         pos[0] != HIST_ARCHIVE_VERSION) {
+      warnx("Unknown archive format");
+      free(data.data);
+      return 0;
+   }
+
+   unsigned char flags = pos[1];
+   pos += 2;
+
+   if (! get_varint(&pos, end, &archive->n_entries) ||
+       ! get_varint(&pos, end, &payload_size)) {
+      warnx("Truncated archive");
+      free(data.data);
+      return 0;
+   }
+
+   if (flags & HIST_ARCHIVE_COMPRESSED) {
+      uLongf size = payload_size;
+
+      if (! (archive->payload = malloc(payload_size ? payload_size : 1))) {
+         perror("malloc");
+         free(data.data);
+         return 0;
+      }
+
+      if (uncompress((Bytef *) archive->payload, &size, pos, end - pos) != Z_OK ||
+            size != payload_size) {
+         warnx("Corrupt compressed archive");
+         free(data.data);
+         return 0;
+      }
+      free(data.data);
+   }
+   else {
+      if ((uint64_t) (end - pos) != payload_size) {
+         warnx("Truncated archive");
+         free(data.data);
+         return 0;
+      }
+
+      // keep the whole file, the payload is at its end
+      archive->payload = data.data;
+      memmove(archive->payload, pos, payload_size);
+   }
+   archive->payload_size = payload_size;
+
+   // find the start of every column
+   pos = (unsigned char *) archive->payload;
+   end = pos + payload_size;
+
+   if (! get_varint(&pos, end, &n_types) ||
+         n_types > 256 - HIST_ARCHIVE_FIRST_TYPE ||
+         (uint64_t) (end - pos) < 2 * n_types + archive->n_entries) {
+      warnx("Corrupt archive");
+      return 0;
+   }
+   archive->n_types = n_types;
+   memcpy(archive->types, pos, 2 * n_types);
+   pos += 2 * n_types;
+
+   archive->codes = pos;
+   archive->keys = pos += archive->n_entries;
+
+   if (! skip_varints(&pos, end, archive->n_entries) ||
+         ! (archive->follow = pos, skip_varints(&pos, end, archive->n_entries)) ||
+         ! (archive->lens = pos, skip_varints(&pos, end, archive->n_entries))) {
+      warnx("Corrupt archive");
+      return 0;
+   }
+   archive->bodies = pos;
+   archive->end = end;
+
+   return 1;
+}
+
+/*
+ * Create a hist_entry struct out of the next entry of the archive.
+ * Returns pointer to hist_entry or NULL on end of archive or error.
+ */
+static struct hist_entry* read_archive_entry
+ (
+   struct hist_reader *reader
+ )
+{
+   struct hist_archive *archive = reader->archive;
+   const unsigned char *end = archive->end;
+
+   while (archive->i < archive->n_entries) {
+      uint64_t delta, follow, len;
+      unsigned char code = archive->codes[archive->i++];
+
+      if (! get_varint(&archive->keys, end, &delta) ||
+          ! get_varint(&archive->follow, end, &follow) ||
+          ! get_varint(&archive->lens, end, &len) ||
+          len > (uint64_t) (end - archive->bodies) ||
+          code >= archive->n_types + HIST_ARCHIVE_FIRST_TYPE ||
+          follow > 999) {
+         warnx("Corrupt archive");
+         reader->error = 1;
+         return NULL;
+      }
+
+      const char *body = (const char *) archive->bodies;
+      archive->bodies += len;
+      reader->entry_offset = archive->i - 1;
+      archive->key += (delta >> 1) ^ -(delta & 1);
+
+      const char *type = code >= HIST_ARCHIVE_FIRST_TYPE ?
+         archive->types[code - HIST_ARCHIVE_FIRST_TYPE] : NULL;
+
+      if (type && ! keep_type(reader, type))
+         continue;
+
+      struct hist_entry *entry = calloc(1, sizeof(struct hist_entry));
+      if (! entry) {
+         perror("calloc");
+         reader->error = 1;
+         return NULL;
+      }
+
+      if (type) {
+         memcpy(entry->type, type, 2);
+         key_timestamp(archive->key, entry->timestamp);
+         snprintf(entry->follow_lines, sizeof(entry->follow_lines), "%03u", (unsigned) follow);
+         strcpy(reader->last_timestamp, entry->timestamp);
+      }
+      else {
+         entry->passthrough = 1;
+         if (code == HIST_ARCHIVE_RAW_TS)
+            key_timestamp(archive->key, entry->timestamp);
+         ++reader->n_malformed;
+      }
+
+      if (! set_body(reader, entry, body, len)) {
+         free(entry);
+         reader->error = 1;
+         return NULL;
+      }
+
+      return entry;
+   }
+
+   return NULL;
+}
+
+/*
+ * Create a hist_entry struct by reading the next entry of reader.
+ * Malformed input is returned as a passthrough record spanning up to
+ * the next valid header, so no bytes are lost. Entries filtered by
+ * hist_reader_set_types() are skipped. Binary archives are detected
+ * by their first line and read the same way.
+ * Returns pointer to hist_entry or NULL on end of file or error.
+ */
+struct hist_entry* read_entry
+ (
+   struct hist_reader *reader
+ )
+{
+   if (reader->error)
+      return NULL;
+
+   if (! reader->started) {
+      reader->started = 1;
+
+      if (fetch_line(reader) && is_archive_magic(reader->line, reader->line_len) &&
+            ! load_archive(reader)) {
+         reader->error = 1;
+         return NULL;
+      }
+   }
+
+   if (reader->archive)
+      return read_archive_entry(reader);
+
+   // filtered entries are skipped before an entry is allocated
+   int truncated = 0;
+   for (;;) {
+      if (! fetch_line(reader))
+         return NULL;
+
+      if (! is_entry_header(reader->line, reader->line_len) ||
+            keep_type(reader, reader->line))
+         break;
+
+      reader->entry_offset = reader->pos - reader->line_len;
+      if (skip_entry(reader))
+         continue;
+
+      if (reader->error)
+         return NULL;
+      truncated = 1;
+      break;
+   }
+
+   if (! truncated)
+      reader->entry_offset = reader->pos - reader->line_len;
+
+   struct hist_entry *entry = calloc(1, sizeof(struct hist_entry));
+   if (! entry) {
+      perror("malloc");
+      reader->error = 1;
+      return NULL;
+   }
+
+   if (truncated) {
+      warnx("Missing lines, keeping truncated entry as is");
+
+      if (! make_passthrough(reader, entry)) {
+         free(entry);
+         reader->error = 1;
+         return NULL;
+      }
+      return entry;
+   }
+
+   reader->body_len = 0;
+
+   if (! is_entry_header(reader->line, reader->line_len)) {
+      do {
+         if (! consume_line(reader)) {
+            free(entry);
+            reader->error = 1;
+            return NULL;
+         }
+      }
+      while (fetch_line(reader) && ! is_entry_header(reader->line, reader->line_len));
+
+      if (! make_passthrough(reader, entry)) {
+         free(entry);
+         reader->error = 1;
+         return NULL;
+      }
+      return entry;
+   }
+
+   char *line = reader->line;
+   memcpy(entry->type, line, 2);
+   memcpy(entry->timestamp, line + 3, 18);
+   memcpy(entry->follow_lines, line + 22, 3);
+   int follow_lines = atoi(entry->follow_lines);
+
+   // keep the header in the buffer in case the entry is truncated
+   for (int i = 0; i <= follow_lines; ++i) {
+      if (i && ! fetch_line(reader)) {
+         warnx("Missing lines, keeping truncated entry as is");
+
+         if (! make_passthrough(reader, entry)) {
+            free(entry);
+            reader->error = 1;
+            return NULL;
+         }
+         return entry;
+      }
+
+      if (! consume_line(reader)) {
+         free(entry);
+         reader->error = 1;
+         return NULL;
+      }
+   }
+
+   // the message starts right after the header
+   if (! intern_body(reader, entry, 26)) {
+      free(entry);
+      reader->error = 1;
+      return NULL;
+   }
+
+   strcpy(reader->last_timestamp, entry->timestamp);
+   return entry;
+}
+
+/*
+ * Create a reader on an already opened file stream.
+ * The stream is not closed by hist_reader_close().
+ * Returns pointer to hist_reader or NULL if failed.
+ */
+struct hist_reader* hist_reader_fdopen
+ (
+   FILE *hist_fh,
+   struct hist_pool *pool
+ )
+{
+   struct hist_reader *reader = calloc(1, sizeof(struct hist_reader));
+   if (! reader) {
+      perror("malloc");
+      return NULL;
+   }
+
+   reader->hist_fh = hist_fh;
+   reader->pool = pool;
+   reader->line_len = -1;
+   return reader;
+}
+
+/*
+ * Open a history file for reading entry by entry.
+ * Returns pointer to hist_reader or NULL if failed.
+ */
+struct hist_reader* hist_reader_open
+ (
+   const char *path,
+   struct hist_pool *pool
+ )
+{
+   struct hist_reader *reader;
+   FILE *hist_fh;
+
+   if (! (hist_fh = hist_io_open(path, "r"))) {
+      perror(path);
+      return NULL;
+   }
+
+   if (! (reader = hist_reader_fdopen(hist_fh, pool))) {
+      fclose(hist_fh);
+      return NULL;
+   }
+
+   reader->owns_fh = 1;
+   return reader;
+}
+
+/*
+ * Returns the next entry in file order or NULL at the end of the file.
+ * The entry belongs to the caller and has to be freed with
+ * free_hist_entry(), a long body stays valid until the pool is freed.
+ * Without pool a long body points into the buffer of the reader and is
+ * only valid until the next entry is read.
+ */
+struct hist_entry* hist_reader_next
+ (
+   struct hist_reader *reader
+ )
+{
+   return read_entry(reader);
+}
+
+/*
+ * Check if the reader stopped because of an error rather than at the
+ * end of the file.
+ */
+int hist_reader_error
+ (
+   const struct hist_reader *reader
+ )
+{
+   return reader->error;
+}
+
+/*
+ * Returns the count of passthrough records the reader has created
+ * for malformed input so far.
+ */
+int hist_reader_malformed
+ (
+   const struct hist_reader *reader
+ )
+{
+   return reader->n_malformed;
+}
+
+/*
+ * Returns the byte offset of the entry returned last in the file, or
+ * its number when reading a binary archive.
+ */
+long long hist_reader_offset
+ (
+   const struct hist_reader *reader
+ )
+{
+   return reader->entry_offset;
+}
+
+/*
+ * Check if the reader is reading a binary archive. Only known after
+ * the first entry has been read.
+ */
+int hist_reader_is_archive
+ (
+   const struct hist_reader *reader
+ )
+{
+   return reader->archive != NULL;
+}
+
+/*
+ * Only return entries whose type is in types and not in drop_types.
+ * Both are comma separated lists (MR,MS) or NULL. A single letter
+ * matches all types starting with it. Passthrough records are always
+ * returned.
+ */
+void hist_reader_set_types
+ (
+   struct hist_reader *reader,
+   const char *types,
+   const char *drop_types
+ )
+{
+   reader->types = types;
+   reader->drop_types = drop_types;
+}
+
+/*
+ * Frees a reader, closing its file if it was opened by hist_reader_open()
+ */
+void hist_reader_close
+ (
+   struct hist_reader *reader
+ )
+{
+   if (reader->owns_fh)
+      fclose(reader->hist_fh);
+   if (reader->archive) {
+      free(reader->archive->payload);
+      free(reader->archive);
+   }
+   free(reader->line);
+   free(reader->body);
+   free(reader);
+}
+
+/*
+ * Insert hist_entry pointer.
+ * Returns 1 on success or 0 on error.
+ */
+static int insert_hist_entry
+ (
+   struct hist_entry ***entries,
+   int *size,
+   struct hist_entry *entry,
+   int pre_alloc_size
+ )
+{
+   struct hist_entry **new_entries;
+   
+   if (! *size) {
+      new_entries = realloc(*entries, pre_alloc_size * sizeof(struct hist_entry *));
+   }
+   else if (*size % pre_alloc_size) {
+      (*entries)[ (*size)++ ] = entry;
+      return 1;
+   }
+   else {
+      new_entries = realloc(*entries, ((*size)+pre_alloc_size) * sizeof(struct hist_entry *));
+   }
+
+   if (! new_entries) {
+      perror("realloc");
+      return 0;
+   }
+
+   new_entries[ (*size)++ ] = entry;
+   *entries = new_entries;
+
+   return 1;
+}
+
+/*
+ * Create an array of hist_entry pointers out of reader.
+ */
+struct hist_entry** read_hist
+ (
+   struct hist_reader *reader,
+   int *n_entries
+ )
+{
+   *n_entries = 0;
+   struct hist_entry **entries = NULL;
+   struct hist_entry *entry;
+
+   while (entry = read_entry(reader)) {
+      if (! insert_hist_entry(&entries, n_entries, entry, 1000)) {
+         perror("realloc");
+         free_hist_entries(entries, *n_entries);
+         return NULL;
+      }
+   }
+
+   // don't mistake an error for the end of the file
+   if (reader->error) {
+      free_hist_entries(entries, *n_entries);
+      return NULL;
+   }
+
+   // an empty history is not an error
+   if (! entries && ! (entries = malloc(sizeof(struct hist_entry *)))) {
+      perror("malloc");
+      return NULL;
+   }
+
+   reader->in_order = 1;
+   for (int i = 1; reader->in_order && i < *n_entries; ++i)
+      reader->in_order = cmp_hist_entry_timestamp(entries[i - 1], entries[i]) <= 0;
+
+   if (! reader->in_order)
+      sort_hist_entries(entries, *n_entries);
+   return entries;
+}
+
+/*
+ * Parse two decimal digits
+ */
+static int digits2
+ (
+   const char *str
+ )
+{
+   return (str[0] - '0') * 10 + (str[1] - '0');
+}
+
+/*
+ * Convert a timestamp (20100901T13:39:14Z) to seconds since the epoch.
+ * The timestamp has to be well-formed.
+ */
+static long long timestamp_seconds
+ (
+   const char *ts
+ )
+{
+   long long y = digits2(ts) * 100 + digits2(ts + 2);
+   int m = digits2(ts + 4);
+   int d = digits2(ts + 6);
+
+   // days from civil, see http://howardhinnant.github.io/date_algorithms.html
+   y -= m <= 2;
+   long long era = (y >= 0 ? y : y - 399) / 400;
+   long long yoe = y - era * 400;
+   long long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+   long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+   long long days = era * 146097 + doe - 719468;
+
+   return days * 86400 + digits2(ts + 9) * 3600 + digits2(ts + 12) * 60 + digits2(ts + 15);
+}
+
+/*
+ * Check if entry is a status change (SO, SA, ...)
+ */
+static int is_status_entry
+ (
+   const struct hist_entry *entry
+ )
+{
+   return ! entry->passthrough && entry->type[0] == 'S';
+}
+
+/*
+ * Start iterating over the merge of two sorted lists of entries.
+ */
+void hist_merge_init
+ (
+   struct hist_merge *merge,
+   struct hist_entry **entries_a,
+   int n_entries_a,
+   struct hist_entry **entries_b,
+   int n_entries_b
+ )
+{
+   merge->entries_a = entries_a;
+   merge->n_entries_a = n_entries_a;
+   merge->i_a = 0;
+   merge->entries_b = entries_b;
+   merge->n_entries_b = n_entries_b;
+   merge->i_b = 0;
+   merge->collapse_window = -1;
+   merge->pending = NULL;
+   merge->ready = NULL;
+   merge->n_collapsed = 0;
+   merge->n_taken_b = 0;
+}
+
+/*
+ * Collapse runs of status entries in the merged sequence: of status
+ * entries at most window seconds apart only the last one is returned.
+ * A negative window disables collapsing.
+ */
+void hist_merge_collapse_status
+ (
+   struct hist_merge *merge,
+   long window
+ )
+{
+   merge->collapse_window = window;
+}
+
+/*
+ * Returns the next entry of the two merged lists, without collapsing
+ */
+static struct hist_entry* merge_step
+ (
+   struct hist_merge *merge
+ )
+{
+   int ts_cmp;
+
+   if (merge->i_a < merge->n_entries_a && merge->i_b < merge->n_entries_b) {
+      ts_cmp = strcmp(merge->entries_a[merge->i_a]->timestamp,
+                      merge->entries_b[merge->i_b]->timestamp);
+
+      if (ts_cmp <= 0) {
+         // exactly same, skip b, return a
+         if (ts_cmp == 0 && eq_hist_entry(merge->entries_a[merge->i_a],
+                                          merge->entries_b[merge->i_b])) {
+            ++merge->i_b;
+         }
+
+         return merge->entries_a[merge->i_a++];
+      }
+      else {
+         ++merge->n_taken_b;
+         return merge->entries_b[merge->i_b++];
+      }
+   }
+
+   if (merge->i_a < merge->n_entries_a)
+      return merge->entries_a[merge->i_a++];
+
+   if (merge->i_b < merge->n_entries_b) {
+      ++merge->n_taken_b;
+      return merge->entries_b[merge->i_b++];
+   }
+
+   return NULL;
+}
+
+/*
+ * Returns the next entry of the merged sequence or NULL when both
+ * lists are exhausted. Entries of b that are equal to the entry of a
+ * with the same timestamp are skipped.
+ */
+struct hist_entry* hist_merge_next
+ (
+   struct hist_merge *merge
+ )
+{
+   struct hist_entry *entry, *out;
+
+   if (merge->collapse_window < 0)
+      return merge_step(merge);
+
+   if (merge->ready) {
+      out = merge->ready;
+      merge->ready = NULL;
+      return out;
+   }
+
+   // only the pending status entry is held back
+   while (entry = merge_step(merge)) {
+      if (! is_status_entry(entry)) {
+         if (! merge->pending)
+            return entry;
+
+         out = merge->pending;
+         merge->pending = NULL;
+         merge->ready = entry;
+         return out;
+      }
+
+      if (! merge->pending) {
+         merge->pending = entry;
+      }
+      else if (timestamp_seconds(entry->timestamp) -
+               timestamp_seconds(merge->pending->timestamp) <= merge->collapse_window) {
+         merge->pending = entry;
+         ++merge->n_collapsed;
+      }
+      else {
+         out = merge->pending;
+         merge->pending = entry;
+         return out;
+      }
+   }
+
+   out = merge->pending;
+   merge->pending = NULL;
+   return out;
+}
+
+/*
+ * Merge two list of entries and write the result to file stream.
+ */
+void merge_entries
+ (
+   struct hist_entry **entries_a,
+   int n_entries_a,
+   struct hist_entry **entries_b,
+   int n_entries_b,
+   FILE *out_stream
+ )
+{
+   struct hist_merge merge;
+   struct hist_entry *entry;
+
+   hist_merge_init(&merge, entries_a, n_entries_a, entries_b, n_entries_b);
+
+   while (entry = hist_merge_next(&merge))
+      write_entry(entry, out_stream);
+}
+
+/*
+ * Find what merging entries_b into entries_a adds behind the end of
+ * entries_a, by a merge without collapsing that stops at the first
+ * entry taken from entries_b. If entries_a was exhausted by then, the
+ * result is entries_a followed by the rest of entries_b.
+ * Returns the index of the first added entry of entries_b, n_entries_b
+ * if nothing is added, or -1 if entries are added in between.
+ */
+static int find_appended
+ (
+   struct hist_entry **entries_a,
+   int n_entries_a,
+   struct hist_entry **entries_b,
+   int n_entries_b
+ )
+{
+   struct hist_merge merge;
+
+   hist_merge_init(&merge, entries_a, n_entries_a, entries_b, n_entries_b);
+
+   while (! merge.n_taken_b && merge_step(&merge))
+      ;
+
+   if (! merge.n_taken_b)
+      return n_entries_b;
+
+   return merge.i_a == n_entries_a ? merge.i_b - 1 : -1;
+}
+
+/*
+ * Read and sort the entries of a history file. With opts->cache the
+ * entries of unchanged files are taken from the cache instead.
+ * is_archive and in_order (set if the file needed no sorting) may be
+ * NULL.
+ * Returns the entries or NULL if failed.
+ */
+struct hist_entry** read_hist_file
+ (
+   const char *path,
+   struct hist_pool *pool,
+   const struct hist_options *opts,
+   int *n_entries,
+   int *is_archive,
+   int *in_order
+ )
+{
+   struct hist_reader *reader;
+   struct hist_entry **entries;
+   struct hist_cache_key key;
+   int cached = opts->cache && hist_cache_key(path, &key);
+   int archive, n_malformed, sorted;
+
+   if (cached && (entries = hist_cache_load(opts->cache, &key, opts, pool, n_entries,
+                                            &archive, &n_malformed, &sorted))) {
+      if (n_malformed)
+         warnx("%s: Kept %d malformed record(s) unchanged", path, n_malformed);
+      if (is_archive)
+         *is_archive = archive;
+      if (in_order)
+         *in_order = sorted;
+      return entries;
+   }
+
+   if (! (reader = hist_reader_open(path, pool)))
+      return NULL;
+
+   hist_reader_set_types(reader, opts->types, opts->drop_types);
+
+   if (! (entries = read_hist(reader, n_entries)))
+      warnx("%s: Error reading history file", path);
+   else if (reader->n_malformed)
+      warnx("%s: Kept %d malformed record(s) unchanged", path, reader->n_malformed);
+
+   archive = hist_reader_is_archive(reader);
+   if (is_archive)
+      *is_archive = archive;
+   if (in_order)
+      *in_order = reader->in_order;
+
+   // the cache is an optimization, failing to fill it is no error
+   if (entries && cached)
+      hist_cache_store(opts->cache, path, &key, opts, entries, *n_entries, archive,
+                       reader->n_malformed, reader->in_order);
+
+   hist_reader_close(reader);
+   return entries;
+}
+
+/*
+ * Write all entries of merge to out_stream, as text or as binary
+ * archive.
+ * Returns 1 on success, 0 on failure.
+ */
+static int write_merged
+ (
+   struct hist_merge *merge,
+   FILE *out_stream,
+   int archive,
+   const struct hist_options *opts
+ )
+{
+   struct hist_archive_writer *writer;
+   struct hist_entry *entry;
+   int status = 1;
+
+   if (! archive) {
+      while (entry = hist_merge_next(merge))
+         write_entry(entry, out_stream);
+      return ! ferror(out_stream);
+   }
+
+   if (! (writer = hist_archive_writer_new(opts->compress)))
+      return 0;
+
+   while (status && (entry = hist_merge_next(merge)))
+      status = hist_archive_add(writer, entry);
+
+   status = status && hist_archive_write(writer, out_stream);
+   hist_archive_writer_free(writer);
+   return status;
+}
+
+/*
+ * Returns the count of bytes write_entry() writes for entry
+ */
+static size_t entry_size
+ (
+   const struct hist_entry *entry
+ )
+{
+   if (entry->passthrough)
+      return entry->body_len;
+
+   return strlen(entry->type) + strlen(entry->timestamp) +
+          strlen(entry->follow_lines) + 3 + entry->body_len;
+}
+
+/*
+ * Copy entry to pos like write_entry() does.
+ * Returns the position behind the entry.
+ */
+static char* copy_entry
+ (
+   char *pos,
+   const struct hist_entry *entry
+ )
+{
+   if (! entry->passthrough) {
+      pos = stpcpy(pos, entry->type);
+      *pos++ = ' ';
+      pos = stpcpy(pos, entry->timestamp);
+      *pos++ = ' ';
+      pos = stpcpy(pos, entry->follow_lines);
+      *pos++ = ' ';
+   }
+
+   memcpy(pos, hist_entry_body(entry), entry->body_len);
+   return pos + entry->body_len;
+}
+
+/*
+ * Write the merged entries as text into fileO through a writable
+ * mapping. The merge is run twice, once to get the size of fileO, which
+ * is allocated in one go, and once to copy the entries.
+ * Returns 1 on success, 0 on failure.
+ */
+static int write_merged_mapped
+ (
+   struct hist_merge *merge,
+   const char *fileO
+ )
+{
+   struct hist_merge sizing = *merge;
+   struct hist_io_map map;
+   struct hist_entry *entry;
+   uint64_t size = 0;
+   char *pos;
+
+   while (entry = hist_merge_next(&sizing))
+      size += entry_size(entry);
+
+   if (! hist_io_map_open(&map, fileO, size)) {
+      perror(fileO);
+      return 0;
+   }
+
+   pos = map.data;
+   while (entry = hist_merge_next(merge))
+      pos = copy_entry(pos, entry);
+
+   if (! hist_io_map_close(&map)) {
+      perror(fileO);
+      return 0;
+   }
+
+   return 1;
+}
+
+static int copy(const char *source, const char *dest);
+static int copy_content(const char *source, const char *dest, off_t size);
+
+/*
+ * Write all entries of merge into fileO, through a temporary file if
+ * the durability policy asks for it.
+ * Returns 1 on success, 0 on failure.
+ */
+static int write_pair
+ (
+   struct hist_merge *merge,
+   const char *fileO,
+   int archive,
+   const struct hist_options *opts
+ )
+{
+   FILE   *file_fh;
+   char   *target;
+   int    status;
+
+   // the size of text output is known before writing, stdout can not be mapped
+   if (! (target = hist_io_temp_path(fileO))) {
+      status = 0;
+   }
+   else if (! archive && strcmp(fileO, "-") && hist_io_maps_output()) {
+      status = write_merged_mapped(merge, target);
+   }
+   else if ((file_fh = hist_io_open(target, "w"))) {
+      status = write_merged(merge, file_fh, archive, opts);
+      status &= fclose(file_fh) != EOF;
+   }
+   else {
+      perror(target);
+      status = 0;
+   }
+
+   if (target)
+      status = hist_io_finish(fileO, target, status);
+
+   if (! status)
+      warnx("%s: Error writing history file", fileO);
+
+   return status;
+}
+
+/*
+ * Check if path1 and path2 name the same existing file
+ */
+static int same_file
+ (
+   const char *path1,
+   const char *path2
+ )
+{
+   struct stat statbuf1, statbuf2;
+
+   if (! strcmp(path1, path2))
+      return 1;
+
+   return stat(path1, &statbuf1) != -1 && stat(path2, &statbuf2) != -1 &&
+          statbuf1.st_dev == statbuf2.st_dev && statbuf1.st_ino == statbuf2.st_ino;
+}
+
+/*
+ * Write file1 followed by entries into fileO. If fileO is file1 and
+ * the durability policy writes in place, the entries are only appended
+ * to it.
+ * Returns 1 on success, 0 on failure.
+ */
+static int append_entries
+ (
+   const char *file1,
+   const char *fileO,
+   struct hist_entry **entries,
+   int n_entries
+ )
+{
+   struct stat statbuf;
+   FILE   *file_fh;
+   char   *target;
+   int    status = 1;
+
+   if (! (target = hist_io_temp_path(fileO)))
+      return 0;
+
+   if (! same_file(target, file1)) {
+      if (stat(file1, &statbuf) == -1) {
+         perror(file1);
+         status = 0;
+      }
+      else {
+         status = copy_content(file1, target, statbuf.st_size);
+      }
+   }
+
+   if (status && (file_fh = hist_io_open(target, "a"))) {
+      for (int i = 0; i < n_entries; ++i)
+         write_entry(entries[i], file_fh);
+      status = ! ferror(file_fh);
+      status &= fclose(file_fh) != EOF;
+   }
+   else if (status) {
+      perror(target);
+      status = 0;
+   }
+
+   status = hist_io_finish(fileO, target, status);
+
+   if (! status)
+      warnx("%s: Error writing history file", fileO);
+
+   return status;
+}
+
+/*
+ * Check if append_entries() appends to file1 itself to write fileO,
+ * rather than writing a new file
+ */
+static int appends_in_place
+ (
+   const char *file1,
+   const char *fileO
+ )
+{
+   char *target = hist_io_temp_path(fileO);
+   int in_place = target && same_file(target, file1);
+
+   free(target);
+   return in_place;
+}
+
+/*
+ * Count the entries merge takes from its second list and their size as
+ * text, without collapsing
+ */
+static void count_added
+ (
+   struct hist_merge *merge,
+   long long *n_entries,
+   long long *n_bytes
+ )
+{
+   struct hist_entry *entry;
+
+   *n_entries = 0;
+   *n_bytes = 0;
+
+   while (entry = merge_step(merge)) {
+      if (merge->n_taken_b > *n_entries) {
+         ++*n_entries;
+         *n_bytes += entry_size(entry);
+      }
+   }
+}
+
+/*
+ * Print the plan line of fileO for opts->dry_run, see struct
+ * hist_options. A negative n_entries was not counted.
+ */
+static void print_plan
+ (
+   const char *action,
+   long long n_entries,
+   long long n_bytes,
+   const char *fileO
+ )
+{
+   // one call per line, so lines of several threads do not mix
+   if (n_entries < 0)
+      printf("%s\t-\t%lld\t%s\n", action, n_bytes, fileO);
+   else
+      printf("%s\t%lld\t%lld\t%s\n", action, n_entries, n_bytes, fileO);
+}
+
+/*
+ * Merge two files into one outfile, see merge_files(). If file1 is in
+ * order and file2 adds nothing to it, file1 is kept or copied. If file2
+ * only adds entries behind its end, they are appended. Both only with
+ * backends that write the bytes as they are. *unchanged is set if
+ * outfile is file1 and left alone.
+ * With opts->dry_run only the plan line of outfile is printed.
+ * Returns 1 on success, 0 on failure.
+ */
+static int merge_pair
+ (
+   const char *file1,
+   const char *file2,
+   const char *fileO,
+   const struct hist_options *opts,
+   int *unchanged
+ )
+{
+   struct hist_pool *pool;
+   struct hist_entry **hist1, **hist2;
+   int    n_hist1, n_hist2;
+   struct hist_merge merge;
+   int    archive;
+   int    in_order;
+   int    appended;
+   int    status;
+
+   *unchanged = 0;
+
+   if (opts->verbose) {
+      if (file2)
+         printf("Merging: %s + %s -> %s\n", file1, file2, fileO);
+      else
+         printf("Filtering: %s -> %s\n", file1, fileO);
+   }
+
+   // both files share one pool, so equal bodies are the same pointer
+   if (! (pool = hist_pool_new()))
+      return 0;
+
+   if (! (hist1 = read_hist_file(file1, pool, opts, &n_hist1, &archive, &in_order))) {
+      hist_pool_free(pool);
+      return 0;
+   }
+   archive |= opts->archive;
+
+   if (! file2) {
+      n_hist2 = 0;
+      hist2 = NULL;
+   }
+   else if (! (hist2 = read_hist_file(file2, pool, opts, &n_hist2, NULL, NULL))) {
+      free_hist_entries(hist1, n_hist1);
+      hist_pool_free(pool);
+      return 0;
+   }
+
+   // without filters the bytes of file1 in order are the merge of its
+   // entries, the result can start with them. A compressing backend
+   // writes the whole result, file1 may not be compressed.
+   if (file2 && ! archive && in_order && ! opts->types && ! opts->drop_types &&
+         opts->collapse_status < 0 && hist_io_transparent() &&
+         strcmp(file1, "-") && strcmp(fileO, "-"))
+      appended = find_appended(hist1, n_hist1, hist2, n_hist2);
+   else
+      appended = -1;
+
+   hist_merge_init(&merge, hist1, n_hist1, hist2, n_hist2);
+   hist_merge_collapse_status(&merge, opts->collapse_status);
+
+   if (opts->dry_run) {
+      long long n_added, added_bytes;
+
+      count_added(&merge, &n_added, &added_bytes);
+      if (appended == n_hist2)
+         print_plan(same_file(file1, fileO) ? "skip" : "copy", 0, 0, fileO);
+      else if (appended >= 0 && appends_in_place(file1, fileO))
+         print_plan("append", n_added, added_bytes, fileO);
+      else
+         print_plan("rewrite", n_added, added_bytes, fileO);
+      status = 1;
+   }
+   else if (appended == n_hist2) {
+      *unchanged = ! strcmp(file1, fileO);
+      status = *unchanged || copy(file1, fileO);
+   }
+   else if (appended >= 0) {
+      status = append_entries(file1, fileO, hist2 + appended, n_hist2 - appended);
+   }
+   else {
+      status = write_pair(&merge, fileO, archive, opts);
+   }
+
+   free_hist_entries(hist1, n_hist1);
+   free_hist_entries(hist2, n_hist2);
+   hist_pool_free(pool);
+   return status;
+}
+
+/*
+ * Merge two files into one outfile.
+ * If file2 is NULL file1 is only filtered into outfile.
+ * Text files and binary archives can be mixed. outfile is written as
+ * archive if opts ask for it or if file1 is an archive. If opts name
+ * an index, it is updated for outfile unless that is file1 and gains
+ * nothing; it is loaded and saved whole, so callers merging many files
+ * update it once themselves, as merge_dirs() does. With opts->dry_run
+ * only the plan line of outfile is printed.
+ * Any of the files may be "-" for stdin or stdout.
+ * Returns 1 on success, 0 on failure.
+ */
+int merge_files
+ (
+   const char *file1,
+   const char *file2,
+   const char *fileO,
+   const struct hist_options *opts
+ )
+{
+   struct hist_index *index;
+   int status, unchanged;
+   struct hist_options default_opts;
+
+   if (! opts) {
+      hist_options_init(&default_opts);
+      opts = &default_opts;
+   }
+
+   status = merge_pair(file1, file2, fileO, opts, &unchanged);
+   status &= hist_io_commit();
+
+   // nothing to index on stdout, nor if outfile is as it was
+   if (status && opts->index && strcmp(fileO, "-") && ! opts->dry_run && ! unchanged) {
+      if (! (index = hist_index_load(opts->index)))
+         return 0;
+
+      status = hist_index_add_file(index, fileO, 1) && hist_index_save(index);
+      hist_index_free(index);
+   }
+
+   return status;
+}
+
+/*
+ * Convert source into dest, keeping the order of entries.
+ * dest is written as binary archive if opts->archive is set, else as
+ * text, so text -> archive -> text gives back the same bytes.
+ * Returns 1 on success, 0 on failure.
+ */
+int convert_file
+ (
+   const char *source,
+   const char *dest,
+   const struct hist_options *opts
+ )
+{
+   FILE *file_fh;
+   struct hist_pool *pool;
+   struct hist_reader *reader;
+   struct hist_archive_writer *writer = NULL;
+   struct hist_entry *entry;
+   int status = 1;
+   char *target;
+   struct hist_options default_opts;
+
+   if (! opts) {
+      hist_options_init(&default_opts);
+      opts = &default_opts;
+   }
+
+   if (opts->verbose)
+      printf("Converting: %s -> %s\n", source, dest);
+
+   if (! (target = hist_io_temp_path(dest)))
+      return 0;
+
+   if (! (pool = hist_pool_new())) {
+      free(target);
+      return 0;
+   }
+
+   if (! (reader = hist_reader_open(source, pool))) {
+      hist_pool_free(pool);
+      free(target);
+      return 0;
+   }
+   hist_reader_set_types(reader, opts->types, opts->drop_types);
+
+   if (opts->archive && ! (writer = hist_archive_writer_new(opts->compress))) {
+      hist_reader_close(reader);
+      hist_pool_free(pool);
+      free(target);
+      return 0;
+   }
+
+   // the whole input is read before dest is opened, it may be source
+   if (writer) {
+      while (status && (entry = read_entry(reader))) {
+         status = hist_archive_add(writer, entry);
+         free_hist_entry(entry);
+      }
+   }
+   else {
+      struct hist_entry **entries = NULL;
+      int n_entries = 0;
+
+      while (status && (entry = read_entry(reader)))
+         status = insert_hist_entry(&entries, &n_entries, entry, 1000);
+
+      if (status && ! reader->error && (file_fh = hist_io_open(target, "w"))) {
+         for (int i = 0; i < n_entries; ++i)
+            write_entry(entries[i], file_fh);
+         status = ! ferror(file_fh);
+         status &= fclose(file_fh) != EOF;
+      }
+      else if (status && ! reader->error) {
+         perror(target);
+         status = 0;
+      }
+
+      free_hist_entries(entries, n_entries);
+   }
+
+   status &= ! reader->error;
+
+   if (writer) {
+      if (status && (file_fh = hist_io_open(target, "w"))) {
+         status = hist_archive_write(writer, file_fh);
+         status &= fclose(file_fh) != EOF;
+      }
+      else if (status) {
+         perror(target);
+         status = 0;
+      }
+      hist_archive_writer_free(writer);
+   }
+
+   status = hist_io_finish(dest, target, status);
+
+   if (! status)
+      warnx("%s: Error converting history file", source);
+
+   hist_reader_close(reader);
+   hist_pool_free(pool);
+   return status;
+}
+
+/*
+ * Copies source to dest through the I/O backend
+ * Returns 1 on success, 0 on failure
+ */
+static int copy_stream
+ (
+   const char *source,
+   const char *dest
+ )
+{
+   FILE *source_fh, *dest_fh;
+   char buf[64 * 1024];
+   size_t n;
+   int status = 1;
+
+   if (! (source_fh = hist_io_open(source, "r"))) {
+      perror(source);
+      return 0;
+   }
+
+   if (! (dest_fh = hist_io_open(dest, "w"))) {
+      perror(dest);
+      fclose(source_fh);
+      return 0;
+   }
+
+   while (status && (n = fread(buf, 1, sizeof(buf), source_fh)) > 0)
+      status = fwrite(buf, 1, n, dest_fh) == n;
+
+   if (ferror(source_fh) || ! status) {
+      perror("copy");
+      status = 0;
+   }
+
+   fclose(source_fh);
+   if (fclose(dest_fh) == EOF) {
+      perror(dest);
+      status = 0;
+   }
+
+   return status;
+}
+
+/*
+ * Copies size bytes of source to dest with sendfile()
+ * Returns 1 on success, 0 on failure
+ */
+static int copy_fd
+ (
+   const char *source,
+   const char *dest,
+   off_t size
+ )
+{
+   int source_fd, dest_fd;
+
+   if ((source_fd = open(source, O_RDONLY)) == -1) {
+      perror(source);
+      return 0;
+   }
+
+   if ((dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+      close(source_fd);
+      perror(dest);
+      return 0;
+   }
+
+   if (! hist_io_sendfile(dest_fd, source_fd, size)) {
+      close(source_fd);
+      close(dest_fd);
+      perror("copy");
+      return 0;
+   }
+
+   close(source_fd);
+   return close(dest_fd) != -1;
+}
+
+/*
+ * Copies the size bytes of source to dest, without temporary file
+ * Returns 1 on success, 0 on failure
+ */
+static int copy_content
+ (
+   const char *source,
+   const char *dest,
+   off_t size
+ )
+{
+   // the backend changes the bytes (compression)
+   if (! hist_io_transparent())
+      return copy_stream(source, dest);
+
+   return copy_fd(source, dest, size);
+}
+
+/*
+ * Copies source to dest. If source and dest are the same file nothing
+ * is done and 1 is returned.
+ * Returns 1 on success, 0 on failure
+ */
+static int copy
+ (
+   const char *source,
+   const char *dest
+ )
+{
+   char *target;
+   int status;
+
+   struct stat statbuf;
+   if (stat(source, &statbuf) == -1) {
+      perror(source);
+      return 0;
+   }
+
+   ino_t source_ino = statbuf.st_ino;
+   off_t size = statbuf.st_size;
+
+   // file exists, check if is same file
+   if (stat(dest, &statbuf) != -1) {
+      if (source_ino == statbuf.st_ino) {
+         return 1;
+      }
+   }
+
+   if (! (target = hist_io_temp_path(dest)))
+      return 0;
+
+   status = copy_content(source, target, size);
+   return hist_io_finish(dest, target, status);
+}
+
+/*
+ * Copy source to dest, or filter it if opts filter or collapse entries.
+ * Returns 1 on success, 0 on failure
+ */
+static int copy_or_filter
+ (
+   const char *source,
+   const char *dest,
+   const struct hist_options *opts
+ )
+{
+   int unchanged;
+
+   if (opts->types || opts->drop_types || opts->collapse_status >= 0)
+      return merge_pair(source, NULL, dest, opts, &unchanged);
+
+   return copy(source, dest);
+}
+
+/*
+ * Print the plan line of copying (or filtering) file1 or file2, the one
+ * that is not NULL, to fileO for opts->dry_run. Files of the second tree
+ * gain all their bytes, their entries are not counted.
+ * Returns 1 on success, 0 on failure
+ */
+static int plan_copy
+ (
+   const char *file1,
+   const char *file2,
+   const char *fileO,
+   const struct hist_options *opts
+ )
+{
+   const char *source = file1 ? file1 : file2;
+   int filter = opts->types || opts->drop_types || opts->collapse_status >= 0;
+   struct stat statbuf;
+
+   if (stat(source, &statbuf) == -1) {
+      perror(source);
+      return 0;
+   }
+
+   if (file1)
+      print_plan(filter ? "rewrite" : same_file(file1, fileO) ? "skip" : "copy", 0, 0, fileO);
+   else
+      print_plan(filter ? "rewrite" : "copy", -1, statbuf.st_size, fileO);
+
+   return 1;
+}
+
+/*
+ * Join directory and file name.
+ * Returns the allocated path or NULL if failed.
+ */
+static char* join_path
+ (
+   const char *dir,
+   const char *name
+ )
+{
+   char *path = malloc( strlen(dir) + 2 + strlen(name) );
+   if (! path) {
+      perror("malloc");
+      return NULL;
+   }
+
+   strcpy(path, dir);
+   strcat(path, "/");
+   strcat(path, name);
+   return path;
+}
+
+/*
+ * Create directory dir if it does not exist.
+ * Returns 1 on success, 0 on failure.
+ */
+static int make_dir
+ (
+   const char *dir
+ )
+{
+   if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+      perror(dir);
+      return 0;
+   }
+
+   return 1;
+}
+
+/*
+ * Returns the file type of path (S_IFREG, S_IFDIR, ...), following
+ * symlinks, or 0 if it does not exist.
+ */
+static mode_t path_type
+ (
+   const char *path
+ )
+{
+   struct stat statbuf;
+
+   if (stat(path, &statbuf) == -1)
+      return 0;
+
+   return statbuf.st_mode & S_IFMT;
+}
+
+/*
+ * Returns the file type of the directory entry file of dir like
+ * path_type(). Filesystems that do not fill in d_type are asked by
+ * stat().
+ */
+static mode_t dirent_type
+ (
+   const char *dir,
+   const struct dirent *file
+ )
+{
+   switch (file->d_type) {
+      case DT_REG:
+         return S_IFREG;
+      case DT_DIR:
+         return S_IFDIR;
+      case DT_UNKNOWN:
+      case DT_LNK: {
+         char *path = join_path(dir, file->d_name);
+         mode_t type = path ? path_type(path) : 0;
+         free(path);
+         return type;
+      }
+      default:
+         return DTTOIF(file->d_type);
+   }
+}
+
+/*
+ * Directory being walked, with the ones it lies in
+ */
+struct hist_walk_dir
+{
+   dev_t dev;
+   ino_t ino;
+   const struct hist_walk_dir *parent;
+};
+
+/*
+ * Check if the directory at path is walked already, being dir or one
+ * it lies in: a link back up that would be walked forever.
+ * Returns 1 if so, 0 if not.
+ */
+static int is_walked
+ (
+   const char *path,
+   const struct hist_walk_dir *dir
+ )
+{
+   struct stat statbuf;
+
+   if (stat(path, &statbuf) == -1)
+      return 0;
+
+   for (; dir; dir = dir->parent)
+      if (dir->dev == statbuf.st_dev && dir->ino == statbuf.st_ino)
+         return 1;
+
+   return 0;
+}
+
+/*
+ * Walk dir, rel is its path relative to the root of the walk (NULL for
+ * the root) and parent the directory it lies in, see hist_walk().
+ * Returns 1 on success, 0 on failure.
+ */
+static int walk_dir
+ (
+   const char *dir,
+   const char *rel,
+   const struct hist_walk_dir *parent,
+   int (*visit)(const char *path, const char *name, int is_dir, void *arg),
+   void *arg
+ )
+{
+   struct hist_walk_dir walked = { 0, 0, parent };
+   struct stat statbuf;
+   DIR *dir_fh;
+   struct dirent *file;
+   int status = 1;
+
+   if (! (dir_fh = opendir(dir)) || fstat(dirfd(dir_fh), &statbuf) == -1) {
+      perror(dir);
+      if (dir_fh)
+         closedir(dir_fh);
+      return 0;
+   }
+   walked.dev = statbuf.st_dev;
+   walked.ino = statbuf.st_ino;
+
+   while (status && (file = readdir(dir_fh))) {
+      if (! strcmp(file->d_name, ".") || ! strcmp(file->d_name, ".."))
+         continue;
+
+      mode_t type = dirent_type(dir, file);
+      if (type != S_IFDIR && type != S_IFREG)
+         continue;
+
+      // not a history, left behind by a run that was killed
+      if (type == S_IFREG && hist_io_is_temp(file->d_name))
+         continue;
+
+      char *path = join_path(dir, file->d_name);
+      char *name = rel ? join_path(rel, file->d_name) : strdup(file->d_name);
+      int go_on;
+
+      if (! path || ! name)
+         go_on = -1;
+      else if (type == S_IFDIR && is_walked(path, &walked))
+         go_on = 0;
+      else
+         go_on = visit(path, name, type == S_IFDIR, arg);
+
+      if (go_on < 0)
+         status = 0;
+      else if (go_on && type == S_IFDIR)
+         status = walk_dir(path, name, &walked, visit, arg);
+
+      free(path);
+      free(name);
+   }
+   closedir(dir_fh);
+
+   return status;
+}
+
+/*
+ * Walk the directory tree below root recursively and call visit for
+ * every regular file and directory in it (links are followed, except
+ * links to a directory the walk is in already), with
+ * its path and its path relative to root as name. visit returns 1 to
+ * go on, 0 to not walk into a directory and -1 to stop on failure.
+ * Temporary files of hist_io_temp_path() are left out.
+ * Filesystems that do not fill in d_type are asked by stat().
+ * Returns 1 on success, 0 on failure.
+ */
+int hist_walk
+ (
+   const char *root,
+   int (*visit)(const char *path, const char *name, int is_dir, void *arg),
+   void *arg
+ )
+{
+   return walk_dir(root, NULL, NULL, visit, arg);
+}
+
+/*
+ * One output file of a directory merge
+ */
+struct hist_dir_task
+{
+   // Input files, one of them is NULL if the file only exists in one tree
+   char *file1;
+   char *file2;
+   char *fileO;
+
+   // Finished by an earlier run according to the journal
+   int skipped;
+
+   // Written successfully
+   int done;
+
+   // Left alone, the output is the first input and has all entries
+   int unchanged;
+
+   // Where the first input lies on disk, for opts->order
+   uint64_t dev;
+   uint64_t location;
+};
+
+/*
+ * All files of a directory merge, worked off by one or more threads
+ */
+struct hist_dir_queue
+{
+   struct hist_dir_task *tasks;
+   size_t n_tasks;
+   size_t size;
+
+   // Next task to hand out, and status of all tasks done so far
+   size_t next;
+   int status;
+   pthread_mutex_t lock;
+
+   const struct hist_options *opts;
+   struct hist_journal *journal;
+};
+
+/*
+ * Add a task for name in dir1, dir2 and dirO to queue. file1 and file2
+ * tell which of the input files exist.
+ * Returns 1 on success, 0 on failure.
+ */
+static int add_dir_task
+ (
+   struct hist_dir_queue *queue,
+   const char *dir1,
+   const char *dir2,
+   const char *dirO,
+   const char *name,
+   int file1,
+   int file2
+ )
+{
+   struct hist_dir_task *task;
+
+   if (queue->n_tasks == queue->size) {
+      size_t size = queue->size ? queue->size * 2 : 64;
+      struct hist_dir_task *tasks = realloc(queue->tasks, size * sizeof(struct hist_dir_task));
+      if (! tasks) {
+         perror("realloc");
+         return 0;
+      }
+      queue->tasks = tasks;
+      queue->size = size;
+   }
+
+   task = &queue->tasks[queue->n_tasks];
+   task->file1 = file1 ? join_path(dir1, name) : NULL;
+   task->file2 = file2 ? join_path(dir2, name) : NULL;
+   task->fileO = join_path(dirO, name);
+   task->skipped = 0;
+   task->done = 0;
+   task->unchanged = 0;
+
+   if ((file1 && ! task->file1) || (file2 && ! task->file2) || ! task->fileO) {
+      free(task->file1);
+      free(task->file2);
+      free(task->fileO);
+      return 0;
+   }
+
+   ++queue->n_tasks;
+   return 1;
+}
+
+/*
+ * Trees and queue of a directory merge while collecting its tasks
+ */
+struct hist_dir_walk
+{
+   struct hist_dir_queue *queue;
+   const char *dir1;
+   const char *dir2;
+   const char *dirO;
+};
+
+/*
+ * Create directory name of dirO unless planning a dry run.
+ * Returns 1 on success, -1 on failure, for hist_walk().
+ */
+static int make_out_dir
+ (
+   struct hist_dir_walk *walk,
+   const char *name
+ )
+{
+   char *subO = join_path(walk->dirO, name);
+   int status = subO && (walk->queue->opts->dry_run || make_dir(subO));
+
+   free(subO);
+   return status ? 1 : -1;
+}
+
+/*
+ * hist_walk() callback over dir1: add a task for every file, merged
+ * with the one of dir2 if that is a file too
+ */
+static int collect_first
+ (
+   const char *path,
+   const char *name,
+   int is_dir,
+   void *arg
+ )
+{
+   struct hist_dir_walk *walk = arg;
+   char *file2;
+   int status;
+
+   if (is_dir)
+      return make_out_dir(walk, name);
+
+   if (! (file2 = join_path(walk->dir2, name)))
+      return -1;
+
+   status = add_dir_task(walk->queue, walk->dir1, walk->dir2, walk->dirO, name,
+               1, path_type(file2) == S_IFREG);
+   free(file2);
+   return status ? 1 : -1;
+}
+
+/*
+ * hist_walk() callback over dir2: add a task for every file dir1 does
+ * not have. Where the trees differ in type dir1 wins.
+ */
+static int collect_second
+ (
+   const char *path,
+   const char *name,
+   int is_dir,
+   void *arg
+ )
+{
+   struct hist_dir_walk *walk = arg;
+   char *file1 = join_path(walk->dir1, name);
+   mode_t type1;
+
+   if (! file1)
+      return -1;
+
+   type1 = path_type(file1);
+   if (type1 && type1 != (is_dir ? S_IFDIR : S_IFREG)) {
+      fprintf(stderr, "%s: Not merged, differs in type from %s\n", path, file1);
+      free(file1);
+      return 0;
+   }
+   free(file1);
+
+   // merged from dir1, directories may hold files only dir2 has
+   if (type1)
+      return 1;
+
+   if (is_dir)
+      return make_out_dir(walk, name);
+
+   return add_dir_task(walk->queue, walk->dir1, walk->dir2, walk->dirO, name, 0, 1) ? 1 : -1;
+}
+
+/*
+ * Get the physical offset of the first extent of the file at fd.
+ * Returns 1 on success or 0 if the filesystem cannot tell.
+ */
+static int first_extent
+ (
+   int fd,
+   uint64_t *offset
+ )
+{
+   union {
+      struct fiemap map;
+      char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+   } fiemap;
+
+   memset(&fiemap, 0, sizeof(fiemap));
+   fiemap.map.fm_length = FIEMAP_MAX_OFFSET;
+   fiemap.map.fm_extent_count = 1;
+
+   if (ioctl(fd, FS_IOC_FIEMAP, &fiemap.map) == -1 || ! fiemap.map.fm_mapped_extents ||
+         (fiemap.map.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+      return 0;
+
+   *offset = fiemap.map.fm_extents[0].fe_physical;
+   return 1;
+}
+
+/*
+ * Set where the first input of task lies on disk: its inode number or
+ * the offset of its first extent. Files without extents (empty, inline
+ * or on filesystems without FIEMAP) go last, by inode number.
+ */
+static void locate_dir_task
+ (
+   struct hist_dir_task *task,
+   int order
+ )
+{
+   const char *path = task->file1 ? task->file1 : task->file2;
+   struct stat statbuf;
+   uint64_t offset;
+   int fd;
+
+   task->dev = 0;
+   task->location = UINT64_MAX;
+
+   if ((fd = open(path, O_RDONLY)) == -1)
+      return;
+
+   if (fstat(fd, &statbuf) != -1) {
+      task->dev = statbuf.st_dev;
+      task->location = statbuf.st_ino;
+
+      if (order == HIST_ORDER_EXTENT)
+         task->location = first_extent(fd, &offset) ? offset : (1ULL << 63) | statbuf.st_ino;
+   }
+
+   close(fd);
+}
+
+/*
+ * Compare function for qsort on tasks by device and location
+ */
+static int cmp_dir_task
+ (
+   const void *a,
+   const void *b
+ )
+{
+   const struct hist_dir_task *task_a = a, *task_b = b;
+
+   if (task_a->dev != task_b->dev)
+      return task_a->dev < task_b->dev ? -1 : 1;
+   if (task_a->location != task_b->location)
+      return task_a->location < task_b->location ? -1 : 1;
+   return 0;
+}
+
+/*
+ * Thread function, works off tasks until none are left
+ */
+static void* run_dir_tasks
+ (
+   void *arg
+ )
+{
+   struct hist_dir_queue *queue = arg;
+   struct hist_dir_task *task;
+   int status;
+
+   for (;;) {
+      pthread_mutex_lock(&queue->lock);
+      task = queue->next < queue->n_tasks ? &queue->tasks[queue->next++] : NULL;
+      pthread_mutex_unlock(&queue->lock);
+
+      if (! task)
+         break;
+
+      if (queue->journal &&
+            hist_journal_done(queue->journal, task->file1, task->file2, task->fileO)) {
+         if (queue->opts->dry_run)
+            print_plan("skip", 0, 0, task->fileO);
+         task->skipped = 1;
+         continue;
+      }
+
+      if (task->file1 && task->file2)
+         status = merge_pair(task->file1, task->file2, task->fileO, queue->opts,
+                             &task->unchanged);
+      else if (queue->opts->dry_run)
+         status = plan_copy(task->file1, task->file2, task->fileO, queue->opts);
+      else
+         status = copy_or_filter(task->file1 ? task->file1 : task->file2,
+                                 task->fileO, queue->opts);
+
+      task->done = status;
+
+      // deferred files are journaled once committed
+      if (status && queue->journal && ! queue->opts->dry_run && ! hist_io_deferred())
+         status = hist_journal_add(queue->journal, task->file1, task->file2, task->fileO);
+
+      pthread_mutex_lock(&queue->lock);
+      queue->status &= status;
+      pthread_mutex_unlock(&queue->lock);
+   }
+
+   return NULL;
+}
+
+/*
+ * Merge all files of two directory trees into dirO.
+ * Files only present in one tree are copied, subdirectories are merged
+ * recursively. The files of the whole tree are merged by opts->jobs
+ * threads in parallel, in the order given by opts->order.
+ * If opts name a journal, files finished by an earlier run are skipped
+ * and every finished file is recorded.
+ * If opts name an index, it is updated for the written files.
+ * With opts->dry_run nothing is written, an existing journal is only
+ * read.
+ * Returns 1 on success, 0 on failure.
+ */
+int merge_dirs
+ (
+   const char *dir1,
+   const char *dir2,
+   const char *dirO,
+   const struct hist_options *opts
+ )
+{
+   struct hist_dir_queue queue = { NULL, 0, 0, 0, 1, PTHREAD_MUTEX_INITIALIZER, NULL, NULL };
+   struct hist_dir_walk walk = { &queue, dir1, dir2, dirO };
+   struct hist_index *index = NULL;
+   pthread_t *threads = NULL;
+   int n_threads;
+   int status, committed;
+   struct hist_options default_opts;
+
+   if (! opts) {
+      hist_options_init(&default_opts);
+      opts = &default_opts;
+   }
+   queue.opts = opts;
+
+   if (opts->index && ! opts->dry_run && ! (index = hist_index_load(opts->index)))
+      return 0;
+
+   // a dry run does not create the journal
+   if (opts->journal && ! (opts->dry_run && access(opts->journal, F_OK) == -1) &&
+         ! (queue.journal = hist_journal_open(opts->journal, opts))) {
+      if (index)
+         hist_index_free(index);
+      return 0;
+   }
+
+   // both inputs have to exist at the top
+   if (path_type(dir1) != S_IFDIR || path_type(dir2) != S_IFDIR) {
+      fprintf(stderr, "%s: Not a directory\n", path_type(dir1) != S_IFDIR ? dir1 : dir2);
+      status = 0;
+   }
+   else {
+      // subdirectories are created in dirO on the way
+      status = (opts->dry_run || make_dir(dirO)) && hist_walk(dir1, collect_first, &walk) &&
+               hist_walk(dir2, collect_second, &walk);
+   }
+
+   // read the inputs along the disk instead of in directory order
+   if (status && opts->order != HIST_ORDER_READDIR) {
+      for (size_t i = 0; i < queue.n_tasks; ++i)
+         locate_dir_task(&queue.tasks[i], opts->order);
+      qsort(queue.tasks, queue.n_tasks, sizeof(struct hist_dir_task), cmp_dir_task);
+   }
+
+   n_threads = opts->jobs > 0 ? opts->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+   if ((size_t) n_threads > queue.n_tasks)
+      n_threads = queue.n_tasks;
+
+   if (status && n_threads > 1 && ! (threads = calloc(n_threads, sizeof(pthread_t)))) {
+      perror("calloc");
+      status = 0;
+   }
+
+   if (status) {
+      // the first thread is this one
+      int started = 1;
+
+      for (; started < n_threads; ++started) {
+         if (pthread_create(&threads[started], NULL, run_dir_tasks, &queue)) {
+            perror("pthread_create");
+            break;
+         }
+      }
+
+      run_dir_tasks(&queue);
+
+      for (int i = 1; i < started; ++i)
+         pthread_join(threads[i], NULL);
+
+      status = queue.status;
+   }
+
+   committed = hist_io_commit();
+   status &= committed;
+
+   // every file written counts, whatever failed besides it
+   for (size_t i = 0; i < queue.n_tasks; ++i) {
+      if (queue.journal && hist_io_deferred() && ! opts->dry_run && committed &&
+            queue.tasks[i].done)
+         status &= hist_journal_add(queue.journal, queue.tasks[i].file1,
+                                    queue.tasks[i].file2, queue.tasks[i].fileO);
+
+      if (index && queue.tasks[i].done && ! queue.tasks[i].unchanged)
+         status &= hist_index_add_file(index, queue.tasks[i].fileO, 1);
+
+      free(queue.tasks[i].file1);
+      free(queue.tasks[i].file2);
+      free(queue.tasks[i].fileO);
+   }
+   free(queue.tasks);
+   free(threads);
+
+   if (queue.journal)
+      hist_journal_close(queue.journal);
+
+   if (index) {
+      status &= hist_index_save(index);
+      hist_index_free(index);
+   }
+
+   return status;
+}
+
+/*
+ * Check if name is the name of a segment file (YYYYMM)
+ */
+static int is_segment_name
+ (
+   const char *name
+ )
+{
+   for (int i = 0; i < HIST_SEGMENT_NAME_LEN; ++i)
+      if (name[i] < '0' || name[i] > '9')
+         return 0;
+
+   return name[HIST_SEGMENT_NAME_LEN] == '\0';
+}
+
+/*
+ * Merge the sorted entries of one month into its segment file, which
+ * is left alone if they add nothing to it. The type filters of opts
+ * only apply to the entries, the segment keeps all of its own.
+ * Returns 1 on success, 0 on failure.
+ */
+static int merge_segment
+ (
+   const char *segdir,
+   const char *month,
+   struct hist_entry **entries,
+   int n_entries,
+   struct hist_pool *pool,
+   const struct hist_options *opts
+ )
+{
+   FILE *file_fh;
+   struct hist_entry **segment = NULL;
+   int n_segment = 0;
+   struct hist_merge merge;
+   struct hist_entry *entry;
+   char *target;
+   int status;
+
+   // a rewrite would drop what the filters leave out
+   struct hist_options segment_opts = *opts;
+   segment_opts.types = NULL;
+   segment_opts.drop_types = NULL;
+
+   char *path = join_path(segdir, month);
+   if (! path)
+      return 0;
+
+   if (access(path, F_OK) != -1 &&
+         ! (segment = read_hist_file(path, pool, &segment_opts, &n_segment, NULL, NULL))) {
+      free(path);
+      return 0;
+   }
+
+   // the segment has all entries of the month already
+   if (segment && find_appended(segment, n_segment, entries, n_entries) == n_entries) {
+      free_hist_entries(segment, n_segment);
+      free(path);
+      return 1;
+   }
+
+   if (opts->verbose)
+      printf("Merging: %d entries -> %s\n", n_entries, path);
+
+   if (! (target = hist_io_temp_path(path)) || ! (file_fh = hist_io_open(target, "w"))) {
+      perror(path);
+      free(target);
+      free_hist_entries(segment, n_segment);
+      free(path);
+      return 0;
+   }
+
+   hist_merge_init(&merge, segment, n_segment, entries, n_entries);
+   hist_merge_collapse_status(&merge, opts->collapse_status);
+
+   while (entry = hist_merge_next(&merge))
+      write_entry(entry, file_fh);
+
+   status = ! ferror(file_fh);
+   status &= fclose(file_fh) != EOF;
+   status = hist_io_finish(path, target, status);
+
+   free_hist_entries(segment, n_segment);
+   free(path);
+   return status;
+}
+
+/*
+ * Merge a flat history file into the segment directory segdir, holding
+ * one history file per month (YYYYMM). Only segments of months that
+ * gain entries from file are rewritten.
+ * Returns 1 on success, 0 on failure.
+ */
+int merge_segments
+ (
+   const char *segdir,
+   const char *file,
+   const struct hist_options *opts
+ )
+{
+   int status = 1;
+   struct hist_pool *pool;
+   struct hist_entry **hist;
+   int n_hist;
+   struct hist_options default_opts;
+
+   if (! opts) {
+      hist_options_init(&default_opts);
+      opts = &default_opts;
+   }
+
+   if (! make_dir(segdir))
+      return 0;
+
+   if (! (pool = hist_pool_new()))
+      return 0;
+
+   if (! (hist = read_hist_file(file, pool, opts, &n_hist, NULL, NULL))) {
+      hist_pool_free(pool);
+      return 0;
+   }
+
+   for (int i = 0, j; i < n_hist; i = j) {
+      char month[HIST_SEGMENT_NAME_LEN + 1] = "000000";
+
+      // passthrough records at the start of the file have no timestamp,
+      // they go to the month of the first well-formed entry
+      for (j = i; j < n_hist; ++j) {
+         if (hist[j]->timestamp[0]) {
+            memcpy(month, hist[j]->timestamp, HIST_SEGMENT_NAME_LEN);
+            break;
+         }
+      }
+
+      for (j = i; j < n_hist; ++j)
+         if (hist[j]->timestamp[0] && memcmp(hist[j]->timestamp, month, HIST_SEGMENT_NAME_LEN))
+            break;
+
+      status &= merge_segment(segdir, month, hist + i, j - i, pool, opts);
+   }
+
+   free_hist_entries(hist, n_hist);
+   hist_pool_free(pool);
+   return status;
+}
+
+/*
+ * Compare function for qsort on segment names
+ */
+static int cmp_segment_name(const void *a, const void *b)
+{
+   return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Collect the sorted names of all segments in segdir.
+ * Returns the names or NULL if failed.
+ */
+static char** read_segment_names
+ (
+   const char *segdir,
+   int *n_names
+ )
+{
+   DIR *dir_fh;
+   struct dirent *file;
+   char **names = calloc(1, sizeof(char *));
+
+   *n_names = 0;
+
+   if (! names) {
+      perror("calloc");
+      return NULL;
+   }
+
+   if (! (dir_fh = opendir(segdir))) {
+      perror(segdir);
+      free(names);
+      return NULL;
+   }
+
+   while (file = readdir(dir_fh)) {
+      if (! is_segment_name(file->d_name))
+         continue;
+
+      char **new_names = realloc(names, (*n_names + 2) * sizeof(char *));
+      if (! new_names) {
+         perror("realloc");
+         break;
+      }
+      names = new_names;
+
+      if (! (names[*n_names] = strdup(file->d_name))) {
+         perror("strdup");
+         break;
+      }
+      names[ ++(*n_names) ] = NULL;
+   }
+   closedir(dir_fh);
+
+   // stopped early on error
+   if (file) {
+      for (char **it = names; *it; ++it)
+         free(*it);
+      free(names);
+      return NULL;
+   }
+
+   qsort(names, *n_names, sizeof(char *), cmp_segment_name);
+   return names;
+}
+
+/*
+ * Append the contents of file source to out_fd.
+ * Returns 1 on success, 0 on failure.
+ */
+static int append_file
+ (
+   int out_fd,
+   const char *source
+ )
+{
+   struct stat statbuf;
+   int source_fd;
+
+   if ((source_fd = open(source, O_RDONLY)) == -1 || fstat(source_fd, &statbuf) == -1) {
+      perror(source);
+      if (source_fd != -1)
+         close(source_fd);
+      return 0;
+   }
+
+   if (! hist_io_sendfile(out_fd, source_fd, statbuf.st_size)) {
+      perror(source);
+      close(source_fd);
+      return 0;
+   }
+
+   close(source_fd);
+   return 1;
+}
+
+/*
+ * Rebuild a flat history file out of the segment directory segdir.
+ * Segments hold disjoint months, so they are concatenated in order.
+ * Returns 1 on success, 0 on failure.
+ */
+int flatten_segments
+ (
+   const char *segdir,
+   const char *fileO,
+   const struct hist_options *opts
+ )
+{
+   int status = 1;
+   char **names;
+   int n_names;
+   int out_fd = -1;
+   char *target;
+
+   if (! (names = read_segment_names(segdir, &n_names)))
+      return 0;
+
+   if (opts && opts->verbose)
+      printf("Flattening: %s -> %s\n", segdir, fileO);
+
+   if (! (target = hist_io_temp_path(fileO)) ||
+         (out_fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+      perror(fileO);
+      status = 0;
+   }
+
+   for (int i = 0; i < n_names && status; ++i) {
+      char *path = join_path(segdir, names[i]);
+
+      status = path && append_file(out_fd, path);
+      free(path);
+   }
+
+   if (out_fd != -1 && close(out_fd) == -1)
+      status = 0;
+
+   if (target)
+      status = hist_io_finish(fileO, target, status);
+
+   for (int i = 0; i < n_names; ++i)
+      free(names[i]);
+   free(names);
+   return status;
+}
+
+/*
+ * Destination, options and status of a walk merging a directory tree
+ * into a segment store or flattening one
+ */
+struct hist_segment_walk
+{
+   const char *dest;
+   const struct hist_options *opts;
+   int status;
+};
+
+/*
+ * hist_walk() callback of merge_segment_dirs(): merge every file into
+ * the segment directory of the same name, subdirectories become
+ * subdirectories of the store
+ */
+static int merge_segment_file
+ (
+   const char *path,
+   const char *name,
+   int is_dir,
+   void *arg
+ )
+{
+   struct hist_segment_walk *walk = arg;
+   char *segdir = join_path(walk->dest, name);
+
+   if (! segdir)
+      return -1;
+
+   if (is_dir) {
+      int status = make_dir(segdir);
+      free(segdir);
+      return status ? 1 : -1;
+   }
+
+   walk->status &= merge_segments(segdir, path, walk->opts);
+   free(segdir);
+   return 1;
+}
+
+/*
+ * Merge all files of the directory tree dir into the segment store
+ * root, holding one segment directory per file at the same place.
+ * Returns 1 on success, 0 on failure.
+ */
+int merge_segment_dirs
+ (
+   const char *root,
+   const char *dir,
+   const struct hist_options *opts
+ )
+{
+   struct hist_segment_walk walk = { root, opts, 1 };
+
+   if (! make_dir(root))
+      return 0;
+
+   return hist_walk(dir, merge_segment_file, &walk) && walk.status;
+}
+
+/*
+ * Check if dir is a segment directory: one without subdirectories.
+ * Returns 1 if so, 0 if not, -1 on error.
+ */
+static int is_segment_dir
+ (
+   const char *dir
+ )
+{
+   DIR *dir_fh;
+   struct dirent *file;
+   int is_segdir = 1;
+
+   if (! (dir_fh = opendir(dir))) {
+      perror(dir);
+      return -1;
+   }
+
+   while (is_segdir && (file = readdir(dir_fh)))
+      if (strcmp(file->d_name, ".") && strcmp(file->d_name, "..") &&
+            dirent_type(dir, file) == S_IFDIR)
+         is_segdir = 0;
+   closedir(dir_fh);
+
+   return is_segdir;
+}
+
+/*
+ * hist_walk() callback of flatten_segment_dirs(): flatten every
+ * segment directory into the file of the same name, other directories
+ * become subdirectories of the output
+ */
+static int flatten_segment_dir
+ (
+   const char *path,
+   const char *name,
+   int is_dir,
+   void *arg
+ )
+{
+   struct hist_segment_walk *walk = arg;
+   int is_segdir, status;
+   char *fileO;
+
+   // segments are flattened with their directory
+   if (! is_dir)
+      return 1;
+
+   if ((is_segdir = is_segment_dir(path)) == -1 || ! (fileO = join_path(walk->dest, name)))
+      return -1;
+
+   if (is_segdir) {
+      walk->status &= flatten_segments(path, fileO, walk->opts);
+      free(fileO);
+      return 0;
+   }
+
+   status = make_dir(fileO);
+   free(fileO);
+   return status ? 1 : -1;
+}
+
+/*
+ * Rebuild flat history files in dirO out of every segment directory
+ * of the segment store root, directories holding segment directories
+ * are rebuilt as subdirectories.
+ * Returns 1 on success, 0 on failure.
+ */
+int flatten_segment_dirs
+ (
+   const char *root,
+   const char *dirO,
+   const struct hist_options *opts
+ )
+{
+   struct hist_segment_walk walk = { dirO, opts, 1 };
+
+   return hist_walk(root, flatten_segment_dir, &walk) && walk.status;
+}
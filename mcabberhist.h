@@ -0,0 +1,319 @@
+/*
+ * libmcabberhist - read, merge and write mcabber history files
+ * Copyright (C) 2016 Benjamin Abendroth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MCABBERHIST_H
+#define MCABBERHIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Bodies up to this size are stored inside the entry
+ */
+#define HIST_INLINE_BODY 48
+
+/*
+ * Orders of the files of a directory merge: as read from the directory,
+ * by inode number or by disk offset of the first extent
+ */
+#define HIST_ORDER_READDIR 0
+#define HIST_ORDER_INODE 1
+#define HIST_ORDER_EXTENT 2
+
+/*
+ * Default bound of the total size of the entry cache, 1 GiB
+ */
+#define HIST_CACHE_SIZE (1024ULL * 1024 * 1024)
+
+/*
+ * Identity of an input file in the cache of entry tables, changes
+ * whenever the file is written
+ */
+struct hist_cache_key
+{
+   uint64_t dev;
+   uint64_t ino;
+   uint64_t size;
+   uint64_t mtime_sec;
+   uint64_t mtime_nsec;
+   uint64_t ctime_sec;
+   uint64_t ctime_nsec;
+};
+
+/*
+ * Mcabber history entry
+ */
+struct hist_entry
+{
+   // Holds message type (MR, MS)
+   char type[3];
+
+   // Holds timestamp (20100901T13:39:14Z)
+   char timestamp[19];
+
+   // Holds count of following lines (000, 001, ...)
+   char follow_lines[4];
+
+   // Set for malformed input kept verbatim in body.
+   // type and follow_lines are empty, timestamp is the one of the
+   // preceding well-formed entry.
+   int passthrough;
+
+   // Length of all lines belonging to this message, each one
+   // terminated by a newline. Use hist_entry_body() to get them.
+   size_t body_len;
+
+   union
+   {
+      // Bodies of up to HIST_INLINE_BODY bytes
+      char inline_body[HIST_INLINE_BODY];
+
+      // Longer bodies, interned in a hist_pool, so equal bodies read
+      // into the same pool share storage and compare by pointer
+      const char *body;
+   };
+};
+
+/*
+ * Returns the lines belonging to entry (not null-terminated)
+ */
+static inline const char* hist_entry_body(const struct hist_entry *entry)
+{
+   return entry->body_len <= HIST_INLINE_BODY ? entry->inline_body : entry->body;
+}
+
+/*
+ * Options shared by merge_files() and merge_dirs().
+ * Initialize with hist_options_init() before changing single fields.
+ */
+struct hist_options
+{
+   // Print a line for every merged file to stdout
+   int verbose;
+
+   // Comma separated entry types to keep (MR,MS), NULL keeps all.
+   // A single letter matches all types starting with it.
+   const char *types;
+
+   // Comma separated entry types to drop, NULL drops none
+   const char *drop_types;
+
+   // Of status entries at most this many seconds apart only keep the
+   // last one, negative keeps all
+   long collapse_status;
+
+   // Write output as binary archive
+   int archive;
+
+   // Compress the payload of written binary archives
+   int compress;
+
+   // Full-text index updated for every written file, NULL for none
+   const char *index;
+
+   // Threads to work with, 0 uses one per online CPU
+   int jobs;
+
+   // Journal of finished files, directory merges skip files finished
+   // by an earlier run. NULL for none.
+   const char *journal;
+
+   // Order in which directory merges work off their files,
+   // HIST_ORDER_READDIR, HIST_ORDER_INODE or HIST_ORDER_EXTENT
+   int order;
+
+   // Directory caching the parsed and sorted entries of unchanged
+   // input files, NULL for none
+   const char *cache;
+
+   // Bound of the total size of the cache in bytes, the least recently
+   // used files are deleted beyond it. 0 for none.
+   uint64_t cache_size;
+
+   // Write nothing, print a plan line for every output file to stdout:
+   // action (skip, copy, append or rewrite), entries and bytes it gains
+   // over the first input, path
+   int dry_run;
+};
+
+/*
+ * Pool of interned entry bodies
+ */
+struct hist_pool;
+
+/*
+ * Streaming reader over the entries of a history file
+ */
+struct hist_reader;
+
+/*
+ * Binary archive being written
+ */
+struct hist_archive_writer;
+
+/*
+ * Full-text index over history files
+ */
+struct hist_index;
+
+/*
+ * Progress journal of a directory merge
+ */
+struct hist_journal;
+
+/*
+ * Output file mapped by hist_io_map_open()
+ */
+struct hist_io_map
+{
+   int fd;
+   char *data;
+   uint64_t size;
+};
+
+/*
+ * Iterator over the merged sequence of two sorted entry arrays
+ */
+struct hist_merge
+{
+   struct hist_entry **entries_a;
+   int n_entries_a;
+   int i_a;
+
+   struct hist_entry **entries_b;
+   int n_entries_b;
+   int i_b;
+
+   // Status collapsing, see hist_merge_collapse_status()
+   long collapse_window;
+   struct hist_entry *pending;
+   struct hist_entry *ready;
+   int n_collapsed;
+
+   // Entries returned from b, entries equal to one of a not counted
+   int n_taken_b;
+};
+
+void hist_options_init(struct hist_options *opts);
+
+uint64_t hist_timestamp_key(const char *ts);
+
+struct hist_pool* hist_pool_new(void);
+const char* hist_pool_intern(struct hist_pool *pool, const char *str, size_t len);
+void hist_pool_free(struct hist_pool *pool);
+
+void free_hist_entry(struct hist_entry *entry);
+void free_hist_entries(struct hist_entry **entries, int size);
+
+int eq_hist_entry(const struct hist_entry *a, const struct hist_entry *b);
+void write_entry(struct hist_entry *entry, FILE *out_stream);
+struct hist_entry* read_entry(struct hist_reader *reader);
+struct hist_entry** read_hist(struct hist_reader *reader, int *n_entries);
+struct hist_entry** read_hist_file(const char *path, struct hist_pool *pool,
+   const struct hist_options *opts, int *n_entries, int *is_archive, int *in_order);
+
+struct hist_reader* hist_reader_open(const char *path, struct hist_pool *pool);
+struct hist_reader* hist_reader_fdopen(FILE *hist_fh, struct hist_pool *pool);
+struct hist_entry* hist_reader_next(struct hist_reader *reader);
+int hist_reader_error(const struct hist_reader *reader);
+int hist_reader_malformed(const struct hist_reader *reader);
+int hist_reader_is_archive(const struct hist_reader *reader);
+long long hist_reader_offset(const struct hist_reader *reader);
+void hist_reader_set_types(struct hist_reader *reader, const char *types,
+   const char *drop_types);
+void hist_reader_close(struct hist_reader *reader);
+
+struct hist_archive_writer* hist_archive_writer_new(int compress);
+int hist_archive_add(struct hist_archive_writer *writer, const struct hist_entry *entry);
+int hist_archive_write(struct hist_archive_writer *writer, FILE *out_stream);
+void hist_archive_writer_free(struct hist_archive_writer *writer);
+
+void hist_merge_init(struct hist_merge *merge,
+   struct hist_entry **entries_a, int n_entries_a,
+   struct hist_entry **entries_b, int n_entries_b);
+void hist_merge_collapse_status(struct hist_merge *merge, long window);
+struct hist_entry* hist_merge_next(struct hist_merge *merge);
+
+void merge_entries(struct hist_entry **entries_a, int n_entries_a,
+   struct hist_entry **entries_b, int n_entries_b, FILE *out_stream);
+int merge_files(const char *file1, const char *file2, const char *fileO,
+   const struct hist_options *opts);
+int convert_file(const char *source, const char *dest,
+   const struct hist_options *opts);
+int merge_dirs(const char *dir1, const char *dir2, const char *dirO,
+   const struct hist_options *opts);
+
+int hist_walk(const char *root,
+   int (*visit)(const char *path, const char *name, int is_dir, void *arg), void *arg);
+
+int merge_segments(const char *segdir, const char *file,
+   const struct hist_options *opts);
+int flatten_segments(const char *segdir, const char *fileO,
+   const struct hist_options *opts);
+int merge_segment_dirs(const char *root, const char *dir,
+   const struct hist_options *opts);
+int flatten_segment_dirs(const char *root, const char *dirO,
+   const struct hist_options *opts);
+
+struct hist_index* hist_index_load(const char *path);
+int hist_index_add_file(struct hist_index *index, const char *path, int force);
+void hist_index_prune(struct hist_index *index);
+int hist_index_save(struct hist_index *index);
+void hist_index_free(struct hist_index *index);
+long hist_index_search(const char *path, const char **words, int n_words,
+   uint64_t from, uint64_t to, FILE *out_stream);
+
+void hist_io_limit(uint64_t read_rate, uint64_t write_rate, uint64_t iops);
+int hist_io_backend(const char *name);
+int hist_io_transparent(void);
+int hist_io_maps_output(void);
+int hist_io_durability(const char *name);
+int hist_io_page_cache(const char *name);
+int hist_io_deferred(void);
+char* hist_io_temp_path(const char *path);
+int hist_io_is_temp(const char *name);
+int hist_io_finish(const char *path, char *temp, int status);
+int hist_io_commit(void);
+int hist_io_map_open(struct hist_io_map *map, const char *path, uint64_t size);
+int hist_io_map_close(struct hist_io_map *map);
+FILE* hist_io_open(const char *path, const char *mode);
+int hist_io_sendfile(int out_fd, int in_fd, uint64_t size);
+
+struct hist_journal* hist_journal_open(const char *path, const struct hist_options *opts);
+int hist_journal_done(struct hist_journal *journal, const char *file1,
+   const char *file2, const char *fileO);
+int hist_journal_add(struct hist_journal *journal, const char *file1,
+   const char *file2, const char *fileO);
+void hist_journal_close(struct hist_journal *journal);
+
+int hist_stats(const char **paths, int n_paths, const struct hist_options *opts,
+   FILE *out_stream);
+
+int hist_cache_key(const char *path, struct hist_cache_key *key);
+struct hist_entry** hist_cache_load(const char *dir, const struct hist_cache_key *key,
+   const struct hist_options *opts, struct hist_pool *pool, int *n_entries,
+   int *archive, int *n_malformed, int *in_order);
+int hist_cache_store(const char *dir, const char *path, const struct hist_cache_key *key,
+   const struct hist_options *opts, struct hist_entry **entries, int n_entries,
+   int archive, int n_malformed, int in_order);
+
+int hist_sync(const char *root, int in_fd, int out_fd, const struct hist_options *opts);
+int hist_sync_serve(const char *root, int in_fd, int out_fd, const struct hist_options *opts);
+
+#endif